@@ -2,35 +2,93 @@
  *                                                                   *
  *                               alu                                 *
  *                                                                   *
- *                File: alu.c                                        *
+ *                File: alu.h                                        *
  *             Authors: Andrew Burgos and Lucy Qin                   *
  *       Date Modified: November 13, 2014                            *        
- *             Purpose: Header for the ALU module, which             *
- *                      executes UM instructions involving           *
+ *             Purpose: Executes UM instructions involving           *
  *                      arithmetic and basic data manipulation       *
  *                      that does not involve accessing the          *
- *                      segmented memory.                            *
- *                                                                   *
+ *                      segmented memory. Defined here so that the   *
+ *                      interpreter can inline them                  *
  *                                                                   *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#ifndef ALU_INCLUDED
+#define ALU_INCLUDED
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 
 #include "assert.h"
-#include "uarray.h"
-
-extern void cond_move  (unsigned ra, unsigned rb,
-                        unsigned rc, UArray_T registers);
-extern void addition   (unsigned ra, unsigned rb, 
-                        unsigned  rc, UArray_T registers);
-extern void multiply   (unsigned ra, unsigned rb,
-                        unsigned rc, UArray_T registers);
-extern void nand       (unsigned ra, unsigned rb, 
-                        unsigned rc, UArray_T registers);
-extern void division   (unsigned ra, unsigned rb, 
-                        unsigned rc, UArray_T registers);
-extern void load_value (unsigned ra, uint32_t value, UArray_T registers);
+#include "state.h"
+#include "fault.h"
+
+
+static inline void cond_move(unsigned ra, unsigned rb, unsigned rc, 
+                             Um_state um)
+{
+        if ( um->registers[rc] != 0 ) {
+                um->registers[ra] = um->registers[rb];
+        }
+}
+
+static inline void addition(unsigned ra, unsigned rb, unsigned rc, 
+                            Um_state um)
+{
+        um->registers[ra] = um->registers[rb] + um->registers[rc];
+}
+
+static inline void multiply(unsigned ra, unsigned rb, unsigned rc, 
+                            Um_state um)
+{
+        um->registers[ra] = um->registers[rb] * um->registers[rc];
+}
+
+static inline void nand(unsigned ra, unsigned rb, unsigned rc, Um_state um)
+{
+        um->registers[ra] = ~(um->registers[rb] & um->registers[rc]);
+}
+
+static inline void division(unsigned ra, unsigned rb, unsigned rc, 
+                            Um_state um)
+{
+        check(um->registers[rc] != 0);
+        um->registers[ra] = um->registers[rb] / um->registers[rc];
+}
+
+static inline void load_value(unsigned ra, uint32_t value, Um_state um)
+{
+        um->registers[ra] = value; 
+}
+
+
+/*   S U P E R I N S T R U C T I O N S   */
+
+static inline void move(unsigned ra, unsigned rb, Um_state um)
+{
+        um->registers[ra] = um->registers[rb];
+}
+
+/* Leaves the scratch register rt as the two NANDs it replaces do */
+static inline void bitwise_and(unsigned ra, unsigned rb, unsigned rc, 
+                               unsigned rt, Um_state um)
+{
+        nand(rt, rb, rc, um);
+        nand(ra, rt, rt, um);
+}
+
+/* 
+ * Leaves the two scratch registers as the four instructions it replaces 
+ * do, which also keeps it right when they alias ra, rb or rc
+ */
+static inline void subtract(unsigned ra, unsigned rb, unsigned rc, 
+                            unsigned rx, unsigned ry, Um_state um)
+{
+        nand(rx, rc, rc, um);
+        load_value(ry, 1, um);
+        addition(rx, rx, ry, um);
+        addition(ra, rb, rx, um);
+}
 
+#endif
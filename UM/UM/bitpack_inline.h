@@ -0,0 +1,144 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                          bitpack_inline                           *
+ *                                                                   *
+ *                File: bitpack_inline.h                             *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Inline versions of Bitpack_getu and          *
+ *                      Bitpack_newu, for callers whose widths and   *
+ *                      offsets are constants, which compile down to *
+ *                      a shift and a mask. Also gets or sets one    *
+ *                      field of every word in an array of 32-bit    *
+ *                      words, 8 words at a time when built with     *
+ *                      -mavx2. Each behaves as Bitpack does,        *
+ *                      raising Bitpack_Overflow for a value that    *
+ *                      does not fit                                 *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BITPACK_INLINE_INCLUDED
+#define BITPACK_INLINE_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "assert.h"
+#include "except.h"
+#include "bitpack.h"
+
+
+/* Returns a mask of the low width bits */
+static inline uint64_t Bitpack_mask(unsigned width)
+{
+        return width >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << width) - 1;
+}
+
+static inline uint64_t Bitpack_getu_inline(uint64_t word, unsigned width,
+                                           unsigned lsb)
+{
+        assert(width + lsb <= 64);
+        if ( width == 0 ) {
+                return 0;
+        }
+        return (word >> lsb) & Bitpack_mask(width);
+}
+
+static inline uint64_t Bitpack_newu_inline(uint64_t word, unsigned width,
+                                           unsigned lsb, uint64_t value)
+{
+        assert(width + lsb <= 64);
+        if ( (value & ~Bitpack_mask(width)) != 0 ) {
+                RAISE(Bitpack_Overflow);
+        }
+        if ( width == 0 ) {
+                return word;
+        }
+        return (word & ~(Bitpack_mask(width) << lsb)) | value << lsb;
+}
+
+/* Stores the field of each of count words in fields */
+static inline void Bitpack_getu_array(const uint32_t *words, size_t count,
+                                      unsigned width, unsigned lsb,
+                                      uint32_t *fields)
+{
+        assert(width + lsb <= 32);
+
+        uint32_t mask = Bitpack_mask(width);
+        unsigned shift = width == 0 ? 0 : lsb;
+        size_t i = 0;
+
+#if defined(__AVX2__)
+        const __m256i masks = _mm256_set1_epi32(mask);
+        const __m128i shifts = _mm_cvtsi32_si128(shift);
+
+        for ( ; i + 8 <= count; i += 8 ) {
+                __m256i in = _mm256_loadu_si256((const __m256i *)
+                                                (words + i));
+                _mm256_storeu_si256((__m256i *)(fields + i),
+                                    _mm256_and_si256(_mm256_srl_epi32(in,
+                                                                      shifts),
+                                                     masks));
+        }
+#endif
+
+        for ( ; i < count; i++ ) {
+                fields[i] = (words[i] >> shift) & mask;
+        }
+}
+
+/*
+ * Replaces the field of each of count words with the matching value.
+ * Raises Bitpack_Overflow without changing any word if a value does not
+ * fit
+ */
+static inline void Bitpack_newu_array(uint32_t *words, size_t count,
+                                      unsigned width, unsigned lsb,
+                                      const uint32_t *values)
+{
+        assert(width + lsb <= 32);
+
+        uint32_t mask = Bitpack_mask(width);
+        uint32_t all_values = 0;
+        size_t i;
+
+        for ( i = 0; i < count; i++ ) {
+                all_values |= values[i];
+        }
+        if ( (all_values & ~mask) != 0 ) {
+                RAISE(Bitpack_Overflow);
+        }
+        if ( width == 0 ) {
+                return;
+        }
+
+        uint32_t keep = ~(mask << lsb);
+        i = 0;
+
+#if defined(__AVX2__)
+        const __m256i keeps = _mm256_set1_epi32(keep);
+        const __m128i shifts = _mm_cvtsi32_si128(lsb);
+
+        for ( ; i + 8 <= count; i += 8 ) {
+                __m256i in = _mm256_loadu_si256((const __m256i *)
+                                                (words + i));
+                __m256i value = _mm256_loadu_si256((const __m256i *)
+                                                   (values + i));
+                _mm256_storeu_si256((__m256i *)(words + i),
+                                    _mm256_or_si256(_mm256_and_si256(in,
+                                                                     keeps),
+                                                    _mm256_sll_epi32(value,
+                                                                     shifts)));
+        }
+#endif
+
+        for ( ; i < count; i++ ) {
+                words[i] = (words[i] & keep) | values[i] << lsb;
+        }
+}
+
+#endif
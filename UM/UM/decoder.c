@@ -8,105 +8,410 @@
  *             Purpose: Decodes 32-bit UM instructions by            *
  *                      extracting the opcode and relevant           *
  *                      information about the registers based on     *
- *                      the opcode                                   *
- *                                                                   *
+ *                      the opcode, and fuses common sequences of    *
+ *                      decoded instructions into superinstructions  *
  *                                                                   *
  *                                                                   *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 #include "decoder.h"
 
-static void store_regs(uint32_t codeword, instruction decoded);
-static void store_three_regs(uint32_t codeword, instruction decoded);
-static void check_registers(instruction decoded, unsigned used_registers);
 
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   S T R U C T U R E   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
 
 /* 
- * Extracts the opcode from the 32-bit UM instruction and calls the 
- * appropriate functions to store information about the registers 
+ * Where the fields of a word with some opcode are. A register field the 
+ * opcode uses is 0xff in its used byte, and one it does not use is 0, so 
+ * that it decodes to UNUSED_REGISTER
+ */
+typedef struct Layout {
+        uint8_t ra_shift;
+        uint8_t ra_used;
+        uint8_t rb_used;
+        uint8_t rc_used;
+        uint32_t value_mask;
+} Layout;
+
+/* halt and the illegal opcodes 14 and 15 use no fields */
+static const Layout LAYOUTS[16] = {
+        [CONDMOVE] = { 6, 0xff, 0xff, 0xff, 0 },
+        [SEGLOAD]  = { 6, 0xff, 0xff, 0xff, 0 },
+        [SEGSTORE] = { 6, 0xff, 0xff, 0xff, 0 },
+        [ADD]      = { 6, 0xff, 0xff, 0xff, 0 },
+        [MULTI]    = { 6, 0xff, 0xff, 0xff, 0 },
+        [DIVIDE]   = { 6, 0xff, 0xff, 0xff, 0 },
+        [NAND]     = { 6, 0xff, 0xff, 0xff, 0 },
+        [MAPSEG]   = { 0, 0,    0xff, 0xff, 0 },
+        [UNMAPSEG] = { 0, 0,    0,    0xff, 0 },
+        [OUT]      = { 0, 0,    0,    0xff, 0 },
+        [IN]       = { 0, 0,    0,    0xff, 0 },
+        [LOADPROG] = { 0, 0,    0xff, 0xff, 0 },
+        [LOADVAL]  = { 25, 0xff, 0,   0,    0x1ffffff }
+};
+
+#if defined(__AVX2__)
+/* the columns of LAYOUTS, split into the entries for opcodes 0-7 and 8-15 */
+typedef struct Columns {
+        __m256i shift[2];
+        __m256i unused[2];
+        __m256i value_mask[2];
+} Columns;
+#endif
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N S   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static void fuse(const struct instruction *plain, unsigned count, 
+                 instruction fused);
+
+#if defined(__AVX2__)
+static uint32_t decode_eight(const uint32_t *codewords, uint32_t length,
+                             struct instruction *decoded);
+static __m256i  lookup      (const __m256i *column, __m256i opcodes,
+                             __m256i upper);
+#endif
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+/* 
+ * Decodes a 32-bit UM instruction by looking up where the fields of its 
+ * opcode are, without branching on the opcode
  */
 extern void decode(uint32_t codeword, instruction decoded) 
 {
-        uint32_t opcode = Bitpack_getu(codeword, 4, 28);
-        assert(opcode < 14);
-        
+        uint32_t opcode = codeword >> 28;
+        const Layout *layout = &LAYOUTS[opcode];
+
         decoded->opcode = opcode;
+        decoded->ra = ((codeword >> layout->ra_shift) & 7) | 
+                      (uint8_t)~layout->ra_used;
+        decoded->rb = ((codeword >> 3) & 7) | (uint8_t)~layout->rb_used;
+        decoded->rc = (codeword & 7) | (uint8_t)~layout->rc_used;
+        decoded->value = codeword & layout->value_mask;
+}
+
+/* 
+ * Returns whether an instruction read from outside the UM, such as from
+ * an image cache file, is one the decoder could have written: its opcode
+ * is known, every register it uses is one of the 8, and every register 
+ * it does not use is UNUSED_REGISTER
+ */
+extern int valid_instruction(const struct instruction *decoded)
+{
+        unsigned opcode = decoded->opcode;
+
+        if ( opcode >= NUM_OPCODES ) {
+                return 0;
+        }
 
-        if ( opcode >= 7 ) {
-                store_regs(codeword, decoded);
+        if ( opcode < MOVE ) {
+                const Layout *layout = &LAYOUTS[opcode];
 
-        } else {
-                store_three_regs(codeword, decoded);
+                return (layout->ra_used ? decoded->ra < 8 
+                                        : decoded->ra == UNUSED_REGISTER) &&
+                       (layout->rb_used ? decoded->rb < 8 
+                                        : decoded->rb == UNUSED_REGISTER) &&
+                       (layout->rc_used ? decoded->rc < 8 
+                                        : decoded->rc == UNUSED_REGISTER) &&
+                       (decoded->value & ~layout->value_mask) == 0;
+        }
+
+        if ( decoded->ra >= 8 || decoded->rb >= 8 ) {
+                return 0;
+        }
+        switch ( opcode ) {
+                case MOVE:
+                        return decoded->rc == UNUSED_REGISTER && 
+                               decoded->value == 0;
+                case AND:
+                        return decoded->rc < 8 && decoded->value < 8;
+                case SUB:
+                case SUB_NAND:
+                        return decoded->rc < 8 && decoded->value < 64;
+                default:
+                        return decoded->rc < 8 && 
+                               (decoded->value >> FUSED_SHIFT) < 8;
         }
 }
 
 /* 
- * Stores information about the registers for instructions involving 
- * less than three registers 
+ * Decodes every word of a segment into an array of instructions, so that 
+ * the UM does not have to decode a word each time it is executed. Built 
+ * with -mavx2, it decodes 8 words at a time
  */
-static void store_regs(uint32_t codeword, instruction decoded)
+extern void decode_segment(const uint32_t *codewords, uint32_t length,
+                           struct instruction *decoded)
 {
-        
-        if ( decoded->opcode == HALT ) {
-                
-                decoded->ra = -1;
-                decoded->rb = -1;
-                decoded->rc = -1;
-        
-        } else if ( decoded->opcode == MAPSEG || 
-                    decoded->opcode == LOADPROG ) {
-                /* instructions using two registers */
-                decoded->ra = -1;
-                decoded->rb = Bitpack_getu(codeword, 3, 3);
-                decoded->rc = Bitpack_getu(codeword, 3, 0);
-                check_registers(decoded, 2);
-                
-        } else if ( decoded->opcode == UNMAPSEG || 
-                   decoded->opcode == IN || 
-                   decoded->opcode == OUT ) {
-                
-                /* instructions using 1 register */
-                decoded->ra = -1;
-                decoded->rb = -1;
-                decoded->rc = Bitpack_getu(codeword, 3, 0);
-        
-                check_registers(decoded, 1);
-                
-        } else if ( decoded->opcode == LOADVAL ) {
-                decoded->ra = Bitpack_getu(codeword, 3, 25);
-                assert(decoded->ra <= 7);
-                // TODO: check value?!
-                decoded->value = Bitpack_getu(codeword, 25, 0);
+        uint32_t i = 0;
+
+#if defined(__AVX2__)
+        i = decode_eight(codewords, length, decoded);
+#endif
+
+        for ( ; i < length; i++ ) {
+                decode(codewords[i], &decoded[i]);
         }
 }
 
-/* Stores register info for UM instructions that involve three registers */
-static void store_three_regs(uint32_t codeword, instruction decoded)
+/* 
+ * Puts a superinstruction in place of the first instruction of each 
+ * sequence it covers. The rest of the sequence stays decoded as it was, 
+ * so jumps into the middle of it still work
+ */
+extern void fuse_segment(uint32_t length, struct instruction *decoded)
 {
-        decoded->ra = Bitpack_getu(codeword, 3, 6);
-        decoded->rb = Bitpack_getu(codeword, 3, 3);
-        decoded->rc = Bitpack_getu(codeword, 3, 0);
-        check_registers(decoded, 3);
+        uint32_t i;
+
+        /* only instructions behind i have been fused so far */
+        for ( i = 0; i < length; i++ ) {
+                unsigned count = length - i < MAX_FUSED ? length - i 
+                                                        : MAX_FUSED;
+                fuse(&decoded[i], count, &decoded[i]);
+        }
 }
 
 /* 
- * Checks that values stored are valid and that the registers accessed exist. 
- * Checks are completed based on the number of registers used by a UM
- * instruction
+ * Decodes and fuses a whole segment 0 into length + 1 instructions. The
+ * last is an illegal word, so that falling off the end of the program 
+ * faults
  */
-static void check_registers(instruction decoded, unsigned used_registers) 
+extern void decode_program(const uint32_t *codewords, uint32_t length,
+                           struct instruction *decoded)
 {
-        /* checks registers based on the number of registers used */
-        assert(decoded->rc <= 7);
-        if ( used_registers == 1 ) {
-                return;
+        if ( length > 0 ) {
+                decode_segment(codewords, length, decoded);
+                fuse_segment(length, decoded);
+        }
+
+        decode(~(uint32_t)0, &decoded[length]);
+}
+
+/* 
+ * Decodes a word of segment 0 that has been overwritten with codeword. 
+ * Superinstructions in front of it that covered it are split back into
+ * their first instruction rather than fused again, since most stores into
+ * segment 0 are data that never runs
+ */
+extern void redecode_word(uint32_t codeword, uint32_t length,
+                          struct instruction *decoded, uint32_t offset)
+{
+        struct instruction plain[MAX_FUSED];
+        uint32_t first = offset < MAX_FUSED - 1 ? 0 
+                                                : offset - (MAX_FUSED - 1);
+        unsigned count = 1;
+        uint32_t i;
+
+        for ( i = first; i < offset; i++ ) {
+                if ( decoded[i].opcode >= MOVE && 
+                     i + fused_length(decoded[i].opcode) > offset ) {
+                        unfuse(&decoded[i], &plain[0]);
+                        decoded[i] = plain[0];
+                }
+        }
+
+        decode(codeword, &plain[0]);
+
+        /* only a LOADVAL or a NAND starts a superinstruction */
+        if ( plain[0].opcode == LOADVAL || plain[0].opcode == NAND ) {
+                for ( ; count < MAX_FUSED && offset + count < length; 
+                      count++ ) {
+                        unfuse(&decoded[offset + count], &plain[count]);
+                }
         }
-        
-        assert(decoded->rb <= 7);
-        if ( used_registers == 2 ) {
+
+        fuse(plain, count, &decoded[offset]);
+}
+
+/* Returns the first instruction of the sequence a superinstruction covers */
+extern void unfuse(const struct instruction *fused, instruction first)
+{
+        *first = *fused;
+
+        switch ( fused->opcode ) {
+                case MOVE:
+                        first->opcode = LOADVAL;
+                        first->rb = UNUSED_REGISTER;
+                        first->rc = UNUSED_REGISTER;
+                        first->value = 0;
+                        break;
+                case AND:
+                        first->opcode = NAND;
+                        first->ra = fused->value;
+                        first->value = 0;
+                        break;
+                case SUB:
+                case SUB_NAND:
+                        first->opcode = NAND;
+                        first->ra = fused->value & 7;
+                        first->rb = fused->rc;
+                        first->value = 0;
+                        break;
+                case LOADVAL_SEGLOAD:
+                case LOADVAL_SEGSTORE:
+                        first->opcode = LOADVAL;
+                        first->ra = fused->value >> FUSED_SHIFT;
+                        first->rb = UNUSED_REGISTER;
+                        first->rc = UNUSED_REGISTER;
+                        first->value = fused->value & FUSED_VALUE;
+                        break;
+        }
+}
+
+/* 
+ * Stores in fused a superinstruction for the sequence starting at plain, 
+ * which holds count decoded instructions, or plain[0] if none matches
+ */
+static void fuse(const struct instruction *plain, unsigned count, 
+                 instruction fused)
+{
+        /* fused may be plain[0] itself */
+        const struct instruction first = plain[0];
+        const struct instruction *a = &first;
+        const struct instruction *b = &plain[1];
+
+        *fused = *a;
+        if ( count < 2 ) {
                 return;
         }
-        assert(decoded->ra <= 7);
 
-}
\ No newline at end of file
+        if ( count >= 4 && a->opcode == NAND && a->rb == a->rc &&
+             b->opcode == LOADVAL && b->value == 1 && b->ra != a->ra &&
+             plain[2].opcode == ADD && plain[2].ra == a->ra && 
+             ((plain[2].rb == a->ra && plain[2].rc == b->ra) ||
+              (plain[2].rb == b->ra && plain[2].rc == a->ra)) &&
+             plain[3].opcode == ADD && 
+             (plain[3].rb == a->ra || plain[3].rc == a->ra) ) {
+                fused->opcode = SUB;
+                fused->ra = plain[3].ra;
+                fused->rb = plain[3].rc == a->ra ? plain[3].rb 
+                                                 : plain[3].rc;
+                fused->rc = a->rb;
+                fused->value = a->ra | b->ra << 3;
+
+                if ( count >= 5 && plain[4].opcode == NAND && 
+                     plain[4].ra == a->ra && plain[4].rb == a->ra &&
+                     plain[4].rc == a->ra ) {
+                        fused->opcode = SUB_NAND;
+                }
+
+        } else if ( a->opcode == LOADVAL && a->value == 0 && 
+                    b->opcode == ADD && b->ra == a->ra &&
+                    (b->rb == a->ra) != (b->rc == a->ra) ) {
+                fused->opcode = MOVE;
+                fused->rb = b->rb == a->ra ? b->rc : b->rb;
+
+        } else if ( a->opcode == NAND && b->opcode == NAND && 
+                    b->rb == a->ra && b->rc == a->ra ) {
+                fused->opcode = AND;
+                fused->ra = b->ra;
+                fused->value = a->ra;
+
+        } else if ( a->opcode == LOADVAL && 
+                    (b->opcode == SEGLOAD || b->opcode == SEGSTORE) ) {
+                fused->opcode = b->opcode == SEGLOAD ? LOADVAL_SEGLOAD 
+                                                     : LOADVAL_SEGSTORE;
+                fused->ra = b->ra;
+                fused->rb = b->rb;
+                fused->rc = b->rc;
+                fused->value = a->value | a->ra << FUSED_SHIFT;
+        }
+}
+
+#if defined(__AVX2__)
+/* 
+ * Decodes the words of a segment 8 at a time, as decode does, and returns 
+ * how many it decoded. Each instruction is stored as the 32-bit word 
+ * opcode | ra << 8 | rb << 16 | rc << 24 followed by its value, which is 
+ * how struct instruction lies in memory on x86
+ */
+static uint32_t decode_eight(const uint32_t *codewords, uint32_t length,
+                             struct instruction *decoded)
+{
+        uint32_t shift[16], unused[16], value_mask[16];
+        Columns columns;
+        unsigned opcode, half;
+        uint32_t i;
+
+        for ( opcode = 0; opcode < 16; opcode++ ) {
+                const Layout *layout = &LAYOUTS[opcode];
+
+                shift[opcode] = layout->ra_shift;
+                unused[opcode] = (uint32_t)(uint8_t)~layout->ra_used << 8 |
+                                 (uint32_t)(uint8_t)~layout->rb_used << 16 |
+                                 (uint32_t)(uint8_t)~layout->rc_used << 24;
+                value_mask[opcode] = layout->value_mask;
+        }
+        for ( half = 0; half < 2; half++ ) {
+                columns.shift[half] = _mm256_loadu_si256((const __m256i *)
+                                                         &shift[8 * half]);
+                columns.unused[half] = _mm256_loadu_si256((const __m256i *)
+                                                          &unused[8 * half]);
+                columns.value_mask[half] = _mm256_loadu_si256(
+                        (const __m256i *)&value_mask[8 * half]);
+        }
+
+        const __m256i three_bits = _mm256_set1_epi32(7);
+
+        for ( i = 0; i + 8 <= length; i += 8 ) {
+                __m256i words = _mm256_loadu_si256((const __m256i *)
+                                                   (codewords + i));
+                __m256i opcodes = _mm256_srli_epi32(words, 28);
+                __m256i upper = _mm256_cmpgt_epi32(opcodes, three_bits);
+
+                __m256i ra = _mm256_and_si256(_mm256_srlv_epi32(words, 
+                                lookup(columns.shift, opcodes, upper)), 
+                                three_bits);
+                __m256i rb = _mm256_and_si256(_mm256_srli_epi32(words, 3),
+                                              three_bits);
+                __m256i rc = _mm256_and_si256(words, three_bits);
+
+                __m256i fields = _mm256_or_si256(
+                        _mm256_or_si256(opcodes, _mm256_slli_epi32(ra, 8)),
+                        _mm256_or_si256(_mm256_slli_epi32(rb, 16),
+                                        _mm256_slli_epi32(rc, 24)));
+                fields = _mm256_or_si256(fields, lookup(columns.unused, 
+                                                        opcodes, upper));
+                __m256i values = _mm256_and_si256(words, 
+                                lookup(columns.value_mask, opcodes, upper));
+
+                /* instructions 0, 1, 4, 5 and then 2, 3, 6, 7 */
+                __m256i first = _mm256_unpacklo_epi32(fields, values);
+                __m256i second = _mm256_unpackhi_epi32(fields, values);
+
+                _mm256_storeu_si256((__m256i *)&decoded[i], 
+                                    _mm256_permute2x128_si256(first, second,
+                                                              0x20));
+                _mm256_storeu_si256((__m256i *)&decoded[i + 4], 
+                                    _mm256_permute2x128_si256(first, second,
+                                                              0x31));
+        }
+
+        return i;
+}
+
+/* 
+ * Looks up the entries of a column of LAYOUTS for 8 opcodes at once. upper 
+ * is all ones for the opcodes from 8 up
+ */
+static inline __m256i lookup(const __m256i *column, __m256i opcodes, 
+                             __m256i upper)
+{
+        return _mm256_blendv_epi8(_mm256_permutevar8x32_epi32(column[0], 
+                                                              opcodes),
+                                  _mm256_permutevar8x32_epi32(column[1], 
+                                                              opcodes),
+                                  upper);
+}
+#endif
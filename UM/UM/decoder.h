@@ -16,6 +16,9 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 
+#ifndef DECODER_INCLUDED
+#define DECODER_INCLUDED
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -25,13 +28,73 @@
 enum opcodes {CONDMOVE = 0, SEGLOAD, SEGSTORE, ADD, MULTI, DIVIDE,
               NAND, HALT, MAPSEG, UNMAPSEG, OUT, IN, LOADPROG, LOADVAL};
 
+/* 
+ * Superinstructions that fuse_segment puts in place of the first word of
+ * a common sequence, as the macro assembler writes them:
+ *   MOVE              LV a,0; ADD a,a,b              a = b
+ *   AND               NAND t,b,c; NAND a,t,t         a = b & c
+ *   SUB               NAND x,c,c; LV y,1; ADD x,y,x; ADD a,b,x
+ *                                                    a = b - c
+ *   SUB_NAND          SUB, then NAND x,x,x
+ *   LOADVAL_SEGLOAD   LV r,k; SEGLOAD a,b,c
+ *   LOADVAL_SEGSTORE  LV r,k; SEGSTORE a,b,c
+ * AND keeps t in value, and t may be b, as in the assembler's and, or a.
+ * The SUBs keep x in value and y in value >> 3, and take either order of
+ * the operands of both ADDs. The LOADVAL pairs keep k in the low 25 bits
+ * of value and r above them
+ */
+enum fused_opcodes {MOVE = 16, AND, SUB, SUB_NAND, LOADVAL_SEGLOAD, 
+                    LOADVAL_SEGSTORE, NUM_OPCODES};
+
+#define MAX_FUSED     5
+#define FUSED_VALUE   0x1ffffff
+#define FUSED_SHIFT   25
+
+/* Returns the number of words an instruction covers */
+static inline unsigned fused_length(unsigned opcode)
+{
+        if ( opcode < MOVE ) {
+                return 1;
+        }
+        if ( opcode == SUB_NAND ) {
+                return 5;
+        }
+        return opcode == SUB ? 4 : 2;
+}
+
+/* register field value for registers an instruction does not use */
+#define UNUSED_REGISTER 0xff
+
+/* 
+ * Decoded UM instruction. Kept to 8 bytes so that a whole predecoded 
+ * segment stays compact in the cache. Words whose opcode is not a legal 
+ * UM instruction keep their opcode so the fault happens on execution
+ */
 typedef struct instruction {
-        unsigned opcode;
-        unsigned ra;
-        unsigned rb;
-        unsigned rc;
-        unsigned value;
+        uint8_t opcode;
+        uint8_t ra;
+        uint8_t rb;
+        uint8_t rc;
+        uint32_t value;
 } *instruction;
 
 
-extern void decode(uint32_t codeword, instruction decoded);
\ No newline at end of file
+extern void decode        (uint32_t codeword, instruction decoded);
+
+extern void decode_segment(const uint32_t *codewords, uint32_t length,
+                           struct instruction *decoded);
+
+extern void fuse_segment  (uint32_t length, struct instruction *decoded);
+
+extern void decode_program(const uint32_t *codewords, uint32_t length,
+                           struct instruction *decoded);
+
+extern void redecode_word (uint32_t codeword, uint32_t length,
+                           struct instruction *decoded, uint32_t offset);
+
+extern void unfuse        (const struct instruction *fused, 
+                           instruction first);
+
+extern int  valid_instruction(const struct instruction *decoded);
+
+#endif
\ No newline at end of file
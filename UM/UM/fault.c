@@ -0,0 +1,136 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                               fault                               *
+ *                                                                   *
+ *                File: fault.c                                      *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Keeps one fault handler per thread and jumps *
+ *                      to it when a UM program fails a check, or    *
+ *                      reads through a NULL segment in a build that *
+ *                      relies on the page at address 0 being        *
+ *                      unmapped instead of checking                 *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "fault.h"
+
+
+static __thread jmp_buf *current = NULL;
+
+static pthread_once_t guarded = PTHREAD_ONCE_INIT;
+
+/* the handler installed before install_guard's, for crashes not its own */
+static struct sigaction previous_action;
+
+/* a segment's length and size class are at the start of it */
+static const uintptr_t GUARD_SIZE = 4096;
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N S   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static void install_guard (void);
+static void null_read     (int signal_number, siginfo_t *info, 
+                           void *context);
+static void chain         (int signal_number, siginfo_t *info, 
+                           void *context);
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+extern jmp_buf *catch_faults(jmp_buf *handler)
+{
+        jmp_buf *previous = current;
+
+        current = handler;
+        return previous;
+}
+
+extern void fault(void)
+{
+        if ( current == NULL ) {
+                fprintf(stderr, "Error: the UM program failed\n");
+                exit(EXIT_FAILURE);
+        }
+
+        longjmp(*current, 1);
+}
+
+extern void guard_null_segments(void)
+{
+        pthread_once(&guarded, install_guard);
+}
+
+static void install_guard(void)
+{
+        struct sigaction action;
+
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = null_read;
+
+        /* fault leaves the handler by a jump, which must not leave 
+         * SIGSEGV blocked */
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+
+        sigaction(SIGSEGV, &action, &previous_action);
+}
+
+/* 
+ * Turns a read near address 0 into a fault of the UM running on this 
+ * thread, if one is. Anything else is passed on to the handler that was 
+ * there before. Only calls that are safe in a signal handler are made
+ */
+static void null_read(int signal_number, siginfo_t *info, void *context)
+{
+        static const char message[] = "Error: the UM program failed\n";
+
+        if ( (uintptr_t)info->si_addr >= GUARD_SIZE ) {
+                chain(signal_number, info, context);
+                return;
+        }
+        if ( current == NULL ) {
+                ssize_t written = write(STDERR_FILENO, message, 
+                                        sizeof(message) - 1);
+
+                (void)written;
+                _exit(EXIT_FAILURE);
+        }
+        longjmp(*current, 1);
+}
+
+/* 
+ * Hands a crash to the previous handler. A default or ignored SIGSEGV is
+ * put back in place instead, so that the crash happens again under it 
+ * when the read is retried
+ */
+static void chain(int signal_number, siginfo_t *info, void *context)
+{
+        if ( previous_action.sa_flags & SA_SIGINFO ) {
+                previous_action.sa_sigaction(signal_number, info, context);
+        } else if ( previous_action.sa_handler != SIG_DFL && 
+                    previous_action.sa_handler != SIG_IGN ) {
+                previous_action.sa_handler(signal_number);
+        } else {
+                struct sigaction action;
+
+                memset(&action, 0, sizeof(action));
+                action.sa_handler = SIG_DFL;
+                sigemptyset(&action.sa_mask);
+                sigaction(signal_number, &action, NULL);
+        }
+}
@@ -0,0 +1,43 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                               fault                               *
+ *                                                                   *
+ *                File: fault.h                                      *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Checks for the things a UM program can do    *
+ *                      wrong, such as dividing by zero or loading   *
+ *                      from an unmapped segment. A failed check     *
+ *                      jumps back to the handler set on the thread  *
+ *                      running the UM, so that UMs on different     *
+ *                      threads can fail independently, which CII    *
+ *                      exceptions cannot do. Mistakes of the UM     *
+ *                      itself are still caught with assert          *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef FAULT_INCLUDED
+#define FAULT_INCLUDED
+
+#include <setjmp.h>
+
+/* like assert, but kept with -DNDEBUG */
+#define check(e) ((void)((e) || (fault(), 0)))
+
+/* 
+ * Makes faults on this thread jump to handler, or end the program with an
+ * error if handler is NULL, and returns the handler it replaces
+ */
+extern jmp_buf *catch_faults (jmp_buf *handler);
+
+extern void     fault        (void) __attribute__((noreturn));
+
+/*
+ * Makes a read through the NULL segment of an unmapped ID fail like a
+ * failed check on whichever thread it happens, so that -DUM_GUARDED 
+ * builds need not check for them. Any read of the first page of memory
+ * is taken to be one
+ */
+extern void     guard_null_segments (void);
+
+#endif
@@ -0,0 +1,483 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                               image                               *
+ *                                                                   *
+ *                File: image.c                                      *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Keeps one copy of each program image that    *
+ *                      the UMs in a process have loaded, found by a *
+ *                      hash of its words. An image is segment 0     *
+ *                      followed by its predecoded instructions, in  *
+ *                      an in-memory file that each UM maps          *
+ *                      privately, so that the kernel shares the     *
+ *                      pages until a UM writes to one and then      *
+ *                      copies only that page. The pointers a UM     *
+ *                      holds into segment 0 stay valid throughout.  *
+ *                      The file can be kept on disk as a .umx cache *
+ *                      file, which later processes map instead of   *
+ *                      converting and decoding the words again      *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+#include "image.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   S T R U C T U R E   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/* 
+ * The start of every image file, followed by segment 0 and then, on a 
+ * cache line, its predecoded instructions. A cache file is only used if
+ * all of it matches the image being loaded and this build: its words are
+ * compared with the program's, and its instructions must hash to 
+ * program_hash and each be one the decoder could have written
+ */
+typedef struct Image_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t instruction_size;
+        uint32_t length;
+        uint64_t hash;
+        uint64_t program_offset;
+        uint64_t size;
+        uint64_t program_hash;
+        uint8_t padding[16];
+} Image_header;
+
+struct Image {
+        uint64_t hash;
+        uint32_t length;
+
+        /* offsets from the start of the file */
+        size_t program_offset;
+        size_t size;
+
+        int file;
+        uint8_t *view;
+        Segment segment;
+
+        unsigned references;
+        Image next;
+};
+
+/* every image held by some UM */
+static struct {
+        Image first;
+        pthread_mutex_t lock;
+} images = { NULL, PTHREAD_MUTEX_INITIALIZER };
+
+
+/* FNV-1a, a word of 8 bytes at a time */
+static const uint64_t HASH_START = 14695981039346656037ull;
+static const uint64_t HASH_PRIME = 1099511628211ull;
+
+/* "UMX1" */
+static const uint32_t MAGIC      = 0x554d5831;
+static const uint32_t VERSION    = 3;
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N S   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static Image    build         (const uint8_t *bytes, uint32_t length,
+                               uint64_t hash);
+static Image    open_cache    (const char *path, const uint8_t *bytes,
+                               uint32_t length, uint64_t hash);
+static int      valid_program (const uint8_t *view, uint32_t length,
+                               size_t program_offset, uint64_t hash);
+static void     write_cache   (Image image, const char *path);
+static Image    new_image     (int file, uint8_t *view, uint32_t length,
+                               uint64_t hash);
+static size_t   layout        (uint32_t length, size_t *program_offset);
+static int      same_words    (Image image, const uint8_t *bytes,
+                               uint32_t length);
+static uint64_t hash_bytes    (const uint8_t *bytes, size_t size);
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+/*
+ * Converts count big-endian words into host order, 32 or 16 bytes at a
+ * time when built with -mavx2 or -mssse3
+ */
+extern void swap_words(uint32_t *words, const uint8_t *bytes, size_t count)
+{
+        size_t i = 0;
+
+#if defined(__AVX2__)
+        const __m256i order = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                               11, 10, 9, 8, 15, 14, 13, 12,
+                                               3, 2, 1, 0, 7, 6, 5, 4,
+                                               11, 10, 9, 8, 15, 14, 13, 12);
+        for ( ; i + 8 <= count; i += 8 ) {
+                __m256i in = _mm256_loadu_si256((const __m256i *)
+                                                (bytes + 4 * i));
+                _mm256_storeu_si256((__m256i *)(words + i),
+                                    _mm256_shuffle_epi8(in, order));
+        }
+#elif defined(__SSSE3__)
+        const __m128i order = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                            11, 10, 9, 8, 15, 14, 13, 12);
+        for ( ; i + 4 <= count; i += 4 ) {
+                __m128i in = _mm_loadu_si128((const __m128i *)
+                                             (bytes + 4 * i));
+                _mm_storeu_si128((__m128i *)(words + i),
+                                 _mm_shuffle_epi8(in, order));
+        }
+#endif
+
+        for ( ; i < count; i++ ) {
+                const uint8_t *word = bytes + 4 * i;
+                words[i] = (uint32_t)word[0] << 24 | (uint32_t)word[1] << 16 |
+                           (uint32_t)word[2] << 8  | (uint32_t)word[3];
+        }
+}
+
+extern Image image_acquire(const void *bytes, size_t size, 
+                           const char *cache_path)
+{
+        assert(size % 4 == 0 && size / 4 <= UINT32_MAX);
+
+        uint32_t length = size / 4;
+        uint64_t hash = hash_bytes(bytes, size);
+        Image image;
+
+        pthread_mutex_lock(&images.lock);
+
+        for ( image = images.first; image != NULL; image = image->next ) {
+                if ( image->hash == hash && image->length == length &&
+                     same_words(image, bytes, length) ) {
+                        break;
+                }
+        }
+
+        if ( image == NULL ) {
+                if ( cache_path != NULL ) {
+                        image = open_cache(cache_path, bytes, length, hash);
+                }
+                if ( image == NULL ) {
+                        image = build(bytes, length, hash);
+
+                        if ( image == NULL ) {
+                                pthread_mutex_unlock(&images.lock);
+                                return NULL;
+                        }
+                        if ( cache_path != NULL ) {
+                                write_cache(image, cache_path);
+                        }
+                }
+                image->next = images.first;
+                images.first = image;
+        }
+        image->references++;
+
+        pthread_mutex_unlock(&images.lock);
+        return image;
+}
+
+extern Segment image_map(Image image, instruction *program)
+{
+        uint8_t *view = mmap(NULL, image->size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE, image->file, 0);
+        if ( view == MAP_FAILED ) {
+                return NULL;
+        }
+
+        *program = (instruction)(view + image->program_offset);
+        return (Segment)(view + sizeof(Image_header));
+}
+
+extern void image_unmap(Image image, Segment segment)
+{
+        munmap((uint8_t *)segment - sizeof(Image_header), image->size);
+}
+
+extern void image_release(Image *image)
+{
+        Image old = *image;
+        Image *link = &images.first;
+
+        pthread_mutex_lock(&images.lock);
+
+        if ( --old->references > 0 ) {
+                old = NULL;
+        } else {
+                while ( *link != old ) {
+                        link = &(*link)->next;
+                }
+                *link = old->next;
+        }
+
+        pthread_mutex_unlock(&images.lock);
+
+        if ( old != NULL ) {
+                munmap(old->view, old->size);
+                close(old->file);
+                free(old);
+        }
+        *image = NULL;
+}
+
+/*
+ * Writes the words and predecoded instructions of a new image into an
+ * in-memory file, and keeps a read-only view of it to compare against.
+ * Returns NULL if the file cannot be made, made that large or mapped
+ */
+static Image build(const uint8_t *bytes, uint32_t length, uint64_t hash)
+{
+        size_t program_offset;
+        size_t size = layout(length, &program_offset);
+        int file = memfd_create("um-image", MFD_CLOEXEC);
+
+        if ( file == -1 ) {
+                return NULL;
+        }
+        if ( ftruncate(file, size) != 0 ) {
+                close(file);
+                return NULL;
+        }
+
+        uint8_t *view = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, file, 0);
+        if ( view == MAP_FAILED ) {
+                close(file);
+                return NULL;
+        }
+
+        Image image = new_image(file, view, length, hash);
+        Image_header header;
+
+        image->segment->length = length;
+        image->segment->size_class = 0;
+        swap_words(image->segment->words, bytes, length);
+
+        decode_program(image->segment->words, length,
+                       (instruction)(view + image->program_offset));
+
+        memset(&header, 0, sizeof(header));
+        header.magic = MAGIC;
+        header.version = VERSION;
+        header.instruction_size = sizeof(struct instruction);
+        header.length = length;
+        header.hash = hash;
+        header.program_offset = image->program_offset;
+        header.size = image->size;
+        header.program_hash = hash_bytes(view + image->program_offset,
+                                         size - image->program_offset);
+        memcpy(view, &header, sizeof(header));
+
+        mprotect(view, image->size, PROT_READ);
+        return image;
+}
+
+/* 
+ * Returns the image in the cache file at path if it holds the length 
+ * words at bytes, decoded by this build, or NULL if it does not
+ */
+static Image open_cache(const char *path, const uint8_t *bytes, 
+                        uint32_t length, uint64_t hash)
+{
+        size_t program_offset;
+        size_t size = layout(length, &program_offset);
+        int file = open(path, O_RDONLY | O_CLOEXEC);
+        struct stat file_stats;
+
+        if ( file == -1 ) {
+                return NULL;
+        }
+        if ( fstat(file, &file_stats) == -1 ||
+             (size_t)file_stats.st_size != size ) {
+                close(file);
+                return NULL;
+        }
+
+        uint8_t *view = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+        Image_header header;
+
+        if ( view == MAP_FAILED ) {
+                close(file);
+                return NULL;
+        }
+
+        memcpy(&header, view, sizeof(header));
+
+        if ( header.magic != MAGIC || header.version != VERSION ||
+             header.instruction_size != sizeof(struct instruction) ||
+             header.length != length || header.hash != hash ||
+             header.program_offset != program_offset ||
+             header.size != size || 
+             !valid_program(view, length, program_offset, 
+                            header.program_hash) ) {
+                munmap(view, size);
+                close(file);
+                return NULL;
+        }
+
+        Image image = new_image(file, view, length, hash);
+
+        if ( image->segment->length != length || 
+             image->segment->size_class != 0 || 
+             !same_words(image, bytes, length) ) {
+                munmap(view, size);
+                close(file);
+                free(image);
+                return NULL;
+        }
+        return image;
+}
+
+/* 
+ * Returns whether the instructions of a cache file hash to hash and could
+ * all have come from the decoder, so that running them cannot take the 
+ * UM outside its registers or its dispatch table
+ */
+static int valid_program(const uint8_t *view, uint32_t length, 
+                         size_t program_offset, uint64_t hash)
+{
+        const struct instruction *program = 
+                (const struct instruction *)(view + program_offset);
+        struct instruction end;
+        uint32_t i;
+
+        if ( hash_bytes(view + program_offset, 
+                        ((size_t)length + 1) * sizeof(*program)) != hash ) {
+                return 0;
+        }
+        for ( i = 0; i < length; i++ ) {
+                if ( !valid_instruction(&program[i]) ) {
+                        return 0;
+                }
+        }
+
+        /* the instruction past the end stops a run that falls off it */
+        decode(~(uint32_t)0, &end);
+        return memcmp(&program[length], &end, sizeof(end)) == 0;
+}
+
+/* 
+ * Writes an image out as a cache file at path, through a file of its own
+ * that replaces path once it is whole. An image that cannot be cached 
+ * is simply converted again next time
+ */
+static void write_cache(Image image, const char *path)
+{
+        size_t length = strlen(path);
+        char *temporary = malloc(length + sizeof(".XXXXXX"));
+        size_t written = 0;
+
+        assert(temporary);
+        memcpy(temporary, path, length);
+        memcpy(temporary + length, ".XXXXXX", sizeof(".XXXXXX"));
+
+        /* a name no other writer has, made by creating the file */
+        int file = mkostemp(temporary, O_CLOEXEC);
+
+        if ( file == -1 ) {
+                free(temporary);
+                return;
+        }
+        fchmod(file, 0644);
+
+        while ( written < image->size ) {
+                ssize_t result = write(file, image->view + written, 
+                                       image->size - written);
+                if ( result <= 0 ) {
+                        break;
+                }
+                written += result;
+        }
+
+        if ( close(file) != 0 || written < image->size || 
+             rename(temporary, path) != 0 ) {
+                unlink(temporary);
+        }
+        free(temporary);
+}
+
+/* Returns an image with no references, whose file is mapped at view */
+static Image new_image(int file, uint8_t *view, uint32_t length, 
+                       uint64_t hash)
+{
+        Image image = malloc(sizeof(*image));
+        assert(image);
+
+        image->hash = hash;
+        image->length = length;
+        image->size = layout(length, &image->program_offset);
+
+        image->file = file;
+        image->view = view;
+        image->segment = (Segment)(view + sizeof(Image_header));
+        image->references = 0;
+
+        return image;
+}
+
+/* 
+ * Returns the size of the file of an image of length words, and sets 
+ * where its instructions start, on the cache line after the words
+ */
+static size_t layout(uint32_t length, size_t *program_offset)
+{
+        size_t words_end = sizeof(Image_header) + sizeof(struct Segment) +
+                           (size_t)length * sizeof(uint32_t);
+
+        *program_offset = (words_end + 63) & ~(size_t)63;
+        return *program_offset + 
+               ((size_t)length + 1) * sizeof(struct instruction);
+}
+
+static int same_words(Image image, const uint8_t *bytes, uint32_t length)
+{
+        const uint32_t *words = image->segment->words;
+        uint32_t i;
+
+        for ( i = 0; i < length; i++ ) {
+                const uint8_t *word = bytes + 4 * i;
+
+                if ( words[i] != ((uint32_t)word[0] << 24 |
+                                  (uint32_t)word[1] << 16 |
+                                  (uint32_t)word[2] << 8  |
+                                  (uint32_t)word[3]) ) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+static uint64_t hash_bytes(const uint8_t *bytes, size_t size)
+{
+        uint64_t hash = HASH_START;
+        size_t i;
+
+        for ( i = 0; i + 8 <= size; i += 8 ) {
+                uint64_t chunk;
+
+                memcpy(&chunk, bytes + i, sizeof(chunk));
+                hash = (hash ^ chunk) * HASH_PRIME;
+        }
+        for ( ; i < size; i++ ) {
+                hash = (hash ^ bytes[i]) * HASH_PRIME;
+        }
+
+        return hash;
+}
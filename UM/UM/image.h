@@ -0,0 +1,57 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                               image                               *
+ *                                                                   *
+ *                File: image.h                                      *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Interface for the program images that UMs    *
+ *                      start from. UMs in one process that load the *
+ *                      same words share one copy of them and of     *
+ *                      their predecoded instructions, and each UM   *
+ *                      gets a private copy of a page only when it   *
+ *                      writes to it                                 *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef IMAGE_INCLUDED
+#define IMAGE_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "segheap.h"
+#include "decoder.h"
+
+typedef struct Image *Image;
+
+
+/* Converts count big-endian words into host order */
+extern void    swap_words    (uint32_t *words, const uint8_t *bytes,
+                              size_t count);
+
+/*
+ * Returns the image of a UM binary of size bytes, a whole number of
+ * big-endian words, holding a reference to it. The words are converted
+ * and decoded only if no image with the same words is held already and
+ * the cache file at cache_path does not hold them, in which case they 
+ * are written there for next time. cache_path may be NULL. Returns NULL
+ * if the image cannot be built
+ */
+extern Image   image_acquire (const void *bytes, size_t size,
+                              const char *cache_path);
+
+/*
+ * Maps a copy-on-write view of the image, and returns the segment 0 in
+ * it along with its predecoded instructions in *program. Both may be
+ * written like any segment 0 of one UM. Returns NULL if there is no
+ * room for the view
+ */
+extern Segment image_map     (Image image, instruction *program);
+
+extern void    image_unmap   (Image image, Segment segment);
+
+/* Drops a reference, freeing the image once no UM holds it */
+extern void    image_release (Image *image);
+
+#endif
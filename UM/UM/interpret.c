@@ -0,0 +1,507 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                            interpret                              *
+ *                                                                   *
+ *                File: interpret.c                                  *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Runs the predecoded instructions of          *
+ *                      segment 0 until the UM halts, waits for      *
+ *                      input or has used up its steps, handing each *
+ *                      instruction to the module that executes it.  *
+ *                      Steps are counted a straight run of words at *
+ *                      a time. A run that may not fit in the steps  *
+ *                      left is checked word by word, and runs only  *
+ *                      the first word of a superinstruction that    *
+ *                      does not fit, so the UM stops after exactly  *
+ *                      the steps it was given                       *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "interpret.h"
+#include "alu.h"
+#include "io.h"
+#include "jit.h"
+#include "fault.h"
+#include "trace.h"
+
+
+/* * * * * * * * * * * * * * * * * * 
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+#if !defined(UM_THREADED) && !defined(UM_JIT)
+
+/* 
+ * Returns where a straight run from run_start has used up left steps,
+ * or a point past the end of segment 0 if it cannot get that far
+ */
+static inline uint64_t end_of_run(uint32_t run_start, uint64_t left,
+                                  uint32_t program_length)
+{
+        if ( left > program_length ) {
+                left = (uint64_t)program_length + 1;
+        }
+        return run_start + left;
+}
+
+/* 
+ * Executes instructions from segment 0 one at a time through a switch on
+ * the opcode, until a halt instruction is reached or the UM has to stop
+ */
+extern Um_status interpret(Um_state um, uint64_t *budget)
+{
+        uint32_t program_length;
+        instruction program = program_instructions(um->mem, &program_length);
+        uint64_t left = *budget;
+        uint32_t run_start = um->program_counter;
+        uint64_t stop = end_of_run(run_start, left, program_length);
+        
+        for (;;) {
+                uint32_t program_counter = um->program_counter;
+                instruction decoded = &program[program_counter];
+                unsigned opcode = decoded->opcode;
+                struct instruction first;
+
+                /* within reach of the end of the steps */
+                if ( program_counter + MAX_FUSED > stop ) {
+                        if ( program_counter == stop ) {
+                                *budget = 0;
+                                return UM_BUDGET_EXHAUSTED;
+                        }
+                        if ( program_counter + fused_length(opcode) > 
+                             stop ) {
+                                unfuse(decoded, &first);
+                                decoded = &first;
+                                opcode = first.opcode;
+                        }
+                }
+
+                check(program_counter < program_length);
+
+                /* the words since the last jump have all run */
+                uint64_t steps = program_counter - run_start + 1;
+
+                if ( opcode == HALT ) {
+                        *budget = left - steps;
+                        return UM_HALTED;
+                }
+                if ( opcode == IN ) {
+                        um->input_step = um->steps + (*budget - left) + 
+                                         steps - 1;
+                }
+
+                if ( !execute_instruction(decoded, um) ) {
+                        *budget = left - steps + 1;
+                        return UM_WAITING_FOR_INPUT;
+                }
+
+                /* segment 0 may have been replaced */
+                if ( opcode == LOADPROG ) {
+                        left -= steps;
+
+                        program = program_instructions(um->mem, 
+                                                       &program_length);
+                        run_start = um->program_counter;
+                        stop = end_of_run(run_start, left, program_length);
+                }
+        }   
+}
+
+#elif defined(UM_THREADED)
+
+/* labels as values are a GNU extension */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+/* 
+ * Executes instructions from segment 0 using threaded dispatch: every 
+ * handler ends with its own indirect jump to the handler of the next 
+ * instruction, so each jump is predicted separately and the program 
+ * counter stays in a register as a pointer into the predecoded program. 
+ * Running off the end of segment 0 lands on the illegal instruction that
+ * predecode_program places after the last word. A straight run that may
+ * use up the steps left dispatches through counted instead, which checks
+ * the steps before every instruction
+ */
+extern Um_status interpret(Um_state um, uint64_t *budget)
+{
+        static void *const handlers[NUM_OPCODES] = {
+                &&condmove, &&segload, &&segstore, &&add, &&multi, 
+                &&divide, &&nand, &&halt, &&mapseg, &&unmapseg, &&out, 
+                &&in, &&loadprog, &&loadval, &&illegal, &&illegal,
+                &&move, &&and, &&sub, &&sub_nand, &&loadval_segload, 
+                &&loadval_segstore
+        };
+        static void *const counted[NUM_OPCODES] = {
+                [0 ... NUM_OPCODES - 1] = &&count
+        };
+        
+        uint32_t program_length;
+        instruction program = program_instructions(um->mem, &program_length);
+        instruction ip = &program[um->program_counter];
+        instruction run_start, stop = NULL;
+        void *const *table;
+        uint64_t left = *budget;
+
+#define DISPATCH() goto *table[ip->opcode]
+#define NEXT()     do { ip++; DISPATCH(); } while (0)
+#define SKIP(n)    do { ip += (n); DISPATCH(); } while (0)
+
+/* an instruction that may fault leaves the program counter on itself, 
+ * for the report of the fault */
+#define AT_IP()    (um->program_counter = ip - program)
+
+/* a run with more steps than words left in segment 0 cannot use them up */
+#define START_RUN()                                                     \
+        do {                                                            \
+                run_start = ip;                                         \
+                if ( left > program_length - (uint32_t)(ip - program) ) { \
+                        table = handlers;                               \
+                } else {                                                \
+                        table = counted;                                \
+                        stop = ip + left;                               \
+                }                                                       \
+        } while (0)
+
+        START_RUN();
+        DISPATCH();
+
+count:
+        if ( ip >= stop ) {
+                um->program_counter = ip - program;
+                *budget = 0;
+                return UM_BUDGET_EXHAUSTED;
+        }
+        if ( ip->opcode >= MOVE && 
+             ip + fused_length(ip->opcode) > stop ) {
+                /* only the first word of the superinstruction fits */
+                struct instruction first;
+
+                unfuse(ip, &first);
+                um->program_counter = ip - program;
+                execute_instruction(&first, um);
+                NEXT();
+        }
+        goto *handlers[ip->opcode];
+
+condmove:
+        cond_move(ip->ra, ip->rb, ip->rc, um);
+        NEXT();
+segload:
+        AT_IP();
+        segmented_load(ip->ra, ip->rb, ip->rc, um);
+        NEXT();
+segstore:
+        /* stores into segment 0 patch the predecoded program in place */
+        AT_IP();
+        segmented_store(ip->ra, ip->rb, ip->rc, um);
+        NEXT();
+add:
+        addition(ip->ra, ip->rb, ip->rc, um);
+        NEXT();
+multi:
+        multiply(ip->ra, ip->rb, ip->rc, um);
+        NEXT();
+divide:
+        AT_IP();
+        division(ip->ra, ip->rb, ip->rc, um);
+        NEXT();
+nand:
+        nand(ip->ra, ip->rb, ip->rc, um);
+        NEXT();
+mapseg:
+        AT_IP();
+        map_segment(ip->rb, ip->rc, um);
+        trace_instruction(um, ip - program, ip);
+        NEXT();
+unmapseg:
+        AT_IP();
+        unmap_segment(ip->rc, um);
+        trace_instruction(um, ip - program, ip);
+        NEXT();
+out:
+        AT_IP();
+        output(ip->rc, um);
+        trace_instruction(um, ip - program, ip);
+        NEXT();
+in:
+        /* input logs note the steps before each byte */
+        AT_IP();
+        um->input_step = um->steps + (*budget - left) + (ip - run_start);
+        if ( !input(ip->rc, um) ) {
+                *budget = left - (ip - run_start);
+                return UM_WAITING_FOR_INPUT;
+        }
+        trace_instruction(um, ip - program, ip);
+        NEXT();
+loadval:
+        load_value(ip->ra, ip->value, um);
+        NEXT();
+move:
+        move(ip->ra, ip->rb, um);
+        SKIP(2);
+and:
+        bitwise_and(ip->ra, ip->rb, ip->rc, ip->value, um);
+        SKIP(2);
+sub:
+        subtract(ip->ra, ip->rb, ip->rc, ip->value & 7, ip->value >> 3, um);
+        SKIP(4);
+sub_nand:
+        subtract(ip->ra, ip->rb, ip->rc, ip->value & 7, ip->value >> 3, um);
+        nand(ip->value & 7, ip->value & 7, ip->value & 7, um);
+        SKIP(5);
+loadval_segload:
+        AT_IP();
+        load_value(ip->value >> FUSED_SHIFT, ip->value & FUSED_VALUE, um);
+        segmented_load(ip->ra, ip->rb, ip->rc, um);
+        SKIP(2);
+loadval_segstore:
+        AT_IP();
+        load_value(ip->value >> FUSED_SHIFT, ip->value & FUSED_VALUE, um);
+        segmented_store(ip->ra, ip->rb, ip->rc, um);
+        SKIP(2);
+loadprog:
+        left -= ip - run_start + 1;
+        trace_instruction(um, ip - program, ip);
+        AT_IP();
+        load_program(ip->rb, ip->rc, um);
+
+        program = program_instructions(um->mem, &program_length);
+        ip = &program[um->program_counter];
+        START_RUN();
+        DISPATCH();
+halt:
+        AT_IP();
+        *budget = left - (ip - run_start) - 1;
+        return UM_HALTED;
+illegal:
+        AT_IP();
+        fault();
+
+#undef AT_IP
+#undef START_RUN
+#undef SKIP
+#undef NEXT
+#undef DISPATCH
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+#ifndef __x86_64__
+#error "UM_JIT generates x86-64 code"
+#endif
+
+/* 
+ * Executes segment 0 as native code translated by the jit module. The 
+ * interpreter runs one instruction wherever native code gives up: a halt,
+ * a load of another segment into segment 0, a jump to a block that has 
+ * not been translated yet, an input that has to wait, a block that does 
+ * not fit in the steps left, or an instruction that is about to fail. 
+ * The steps left are taken one at a time while the blocks do not fit.
+ * The translated code is kept in the state for the next run until the UM
+ * halts
+ */
+extern Um_status interpret(Um_state um, uint64_t *budget)
+{
+        uint32_t program_length;
+
+        if ( um->jit == NULL ) {
+                um->jit = jit_new(um);
+        }
+
+        Jit jit = um->jit;
+        jit_start_run(jit, *budget);
+
+        for (;;) {
+                instruction program = program_instructions(um->mem, 
+                                                           &program_length);
+                instruction decoded = &program[um->program_counter];
+                uint64_t left = jit_budget(jit);
+
+                if ( left == 0 ) {
+                        *budget = 0;
+                        return UM_BUDGET_EXHAUSTED;
+                }
+                if ( decoded->opcode == HALT ) {
+                        jit_free(&um->jit);
+                        *budget = left - 1;
+                        return UM_HALTED;
+                }
+
+                um->input_step = um->steps + (*budget - left);
+                if ( !jit_step(jit) ) {
+                        *budget = left;
+                        return UM_WAITING_FOR_INPUT;
+                }
+                jit_set_budget(jit, left - 1);
+
+                void *block = jit_block(jit, um->program_counter);
+                uint32_t program_counter = jit_run(jit, block);
+
+                /* native code leaves an input that waits where it was */
+                if ( jit_waiting(jit) ) {
+                        *budget = jit_budget(jit);
+                        return UM_WAITING_FOR_INPUT;
+                }
+                um->program_counter = program_counter;
+        }
+}
+
+#endif
+
+/* 
+ * Executes UM instruction based off decoded opcode. Returns 0 if it is an
+ * input that has to wait, leaving the program counter on it
+ */
+extern int execute_instruction(instruction decoded, Um_state um) 
+{
+        /* load_program frees the instruction that called it */
+        unsigned opcode = decoded->opcode;
+
+        switch ( opcode ) {
+                case 0:
+                        cond_move(decoded->ra, decoded->rb, decoded->rc, um);
+                        break;
+                case 1:
+                        segmented_load(decoded->ra, decoded->rb, decoded->rc,
+                                       um);
+                        break;
+                case 2: 
+                        segmented_store(decoded->ra, decoded->rb, decoded->rc,
+                                        um);
+                        break;
+                case 3:
+                        addition(decoded->ra, decoded->rb, decoded->rc, um);
+                        break;
+                case 4:
+                        multiply(decoded->ra, decoded->rb, decoded->rc, um);
+                        break;
+                case 5: 
+                        division(decoded->ra, decoded->rb, decoded->rc, um);
+                        break;
+                case 6: 
+                        nand(decoded->ra, decoded->rb, decoded->rc, um);
+                        break;
+                case 7: 
+                        return 1;
+                case 8: 
+                        map_segment(decoded->rb, decoded->rc, um);
+                        trace_instruction(um, um->program_counter, decoded);
+                        break;
+                case 9: 
+                        unmap_segment(decoded->rc, um);
+                        trace_instruction(um, um->program_counter, decoded);
+                        break;
+                case 10: 
+                        output(decoded->rc, um);
+                        trace_instruction(um, um->program_counter, decoded);
+                        break;
+                case 11: 
+                        if ( !input(decoded->rc, um) ) {
+                                return 0;
+                        }
+                        trace_instruction(um, um->program_counter, decoded);
+                        break;
+                case 12: 
+                        trace_instruction(um, um->program_counter, decoded);
+                        load_program(decoded->rb, decoded->rc, um); 
+                        break;
+                case 13: 
+                        load_value(decoded->ra, decoded->value, um);
+                        break;
+                case MOVE:
+                        move(decoded->ra, decoded->rb, um);
+                        break;
+                case AND:
+                        bitwise_and(decoded->ra, decoded->rb, decoded->rc,
+                                    decoded->value, um);
+                        break;
+                case SUB:
+                case SUB_NAND:
+                        subtract(decoded->ra, decoded->rb, decoded->rc,
+                                 decoded->value & 7, decoded->value >> 3, um);
+                        if ( opcode == SUB_NAND ) {
+                                nand(decoded->value & 7, decoded->value & 7,
+                                     decoded->value & 7, um);
+                        }
+                        break;
+                case LOADVAL_SEGLOAD:
+                        load_value(decoded->value >> FUSED_SHIFT, 
+                                   decoded->value & FUSED_VALUE, um);
+                        segmented_load(decoded->ra, decoded->rb, decoded->rc,
+                                       um);
+                        break;
+                case LOADVAL_SEGSTORE:
+                        load_value(decoded->value >> FUSED_SHIFT, 
+                                   decoded->value & FUSED_VALUE, um);
+                        segmented_store(decoded->ra, decoded->rb, decoded->rc,
+                                        um);
+                        break;
+                default:
+                        /* not a legal UM instruction */
+                        fault();
+        }
+        
+        if (opcode != 12) {
+                um->program_counter = um->program_counter + 
+                                      fused_length(opcode);
+        }
+        return 1;
+}
+
+/* 
+ * No instruction changes the UM before the check it fails, so the program
+ * counter is still on the word that failed, or on the LOADVAL fused in 
+ * front of it, and the registers still hold what it reached for. This 
+ * holds for the reads of the NULL segment that -DUM_GUARDED builds leave
+ * to fault.c as much as for failed checks
+ */
+extern void describe_fault(Um_state um, Um_fault *report)
+{
+        uint32_t program_length;
+        instruction program = program_instructions(um->mem, &program_length);
+        uint32_t program_counter = um->program_counter;
+        const uint32_t *registers = um->registers;
+        struct instruction failed;
+
+        report->access = 0;
+        report->segment = 0;
+        report->offset = 0;
+
+        if ( program_counter >= program_length ) {
+                report->program_counter = program_counter;
+                report->opcode = UM_PAST_END;
+                return;
+        }
+        if ( program[program_counter].opcode == LOADVAL_SEGLOAD ||
+             program[program_counter].opcode == LOADVAL_SEGSTORE ) {
+                program_counter++;
+        }
+
+        decode(*segment_word(um->mem, 0, program_counter), &failed);
+        report->program_counter = program_counter;
+        report->opcode = failed.opcode;
+
+        switch ( failed.opcode ) {
+                case SEGLOAD:
+                case LOADPROG:
+                        report->access = 1;
+                        report->segment = registers[failed.rb];
+                        report->offset = registers[failed.rc];
+                        break;
+                case SEGSTORE:
+                        report->access = 1;
+                        report->segment = registers[failed.ra];
+                        report->offset = registers[failed.rb];
+                        break;
+                case UNMAPSEG:
+                        report->access = 1;
+                        report->segment = registers[failed.rc];
+                        break;
+                default:
+                        break;
+        }
+}
@@ -0,0 +1,44 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                            interpret                              *
+ *                                                                   *
+ *                File: interpret.h                                  *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Header for the interpret module, which       *
+ *                      runs the predecoded instructions of          *
+ *                      segment 0 until the UM stops. Compiling      *
+ *                      with -DUM_THREADED selects a threaded        *
+ *                      dispatch loop instead of the switch loop,    *
+ *                      and -DUM_JIT runs segment 0 as native code   *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef INTERPRET_INCLUDED
+#define INTERPRET_INCLUDED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "state.h"
+#include "managemem.h"
+#include "decoder.h"
+#include "libum.h"
+
+/*
+ * Runs the UM for at most *budget steps, and takes the steps it ran from
+ * *budget. Every word of segment 0 that runs is a step, halt included.
+ * An input that has to wait is not, and the UM is left on it
+ */
+extern Um_status interpret           (Um_state um, uint64_t *budget);
+
+extern int       execute_instruction (instruction decoded, Um_state um);
+
+/*
+ * Fills in report with where a UM that has just faulted failed, taken 
+ * from the state the fault left it in
+ */
+extern void      describe_fault      (Um_state um, Um_fault *report);
+
+#endif
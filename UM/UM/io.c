@@ -7,40 +7,681 @@
  *       Date Modified: November 13, 2014                            *
  *             Purpose: Handles receiving input from standard        *
  *                      input and outputting values to standard      *
- *                      output                                       *
- *                                                                   *
+ *                      output, or through the callbacks of an       *
+ *                      embedding program. The first input from      *
+ *                      standard input starts a thread that reads    *
+ *                      ahead into a ring shared with the UM, one    *
+ *                      writer and one reader, so the UM only waits  *
+ *                      on it when the ring is empty. The input can  *
+ *                      also be recorded to a log as the UM reads    *
+ *                      it, and a log replayed from memory in place  *
+ *                      of the input, so that two runs of a UM get   *
+ *                      exactly the same bytes after the same steps, *
+ *                      as um_steps counts them, without waiting on  *
+ *                      a reader. There is one ring, as there is one *
+ *                      standard input, so only one UM at a time     *
+ *                      may read it                                  *
  *                                                                   *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
 #include "io.h"
+#include "fault.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   S T R U C T U R E   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define OUTPUT_SIZE (64 * 1024)
+#define RING_SIZE   (1024 * 1024)
+#define READ_SIZE   (64 * 1024)
+#define FREE_STEP   (4 * 1024)
+#define RUN_SIZE    (64 * 1024)
+
+/* 
+ * An input log is a header followed by runs of bytes, each the run header
+ * followed by its bytes, in the byte order of the machine that wrote it.
+ * The UM read the bytes of a run after step, step + stride, step + 2 * 
+ * stride and so on steps, so that a loop reading a line is one run. A 
+ * run of no bytes is the UM reading the end of the input after step steps
+ */
+typedef struct Log_header {
+        uint32_t magic;
+        uint32_t version;
+} Log_header;
+
+typedef struct Log_run {
+        uint64_t step;
+        uint64_t stride;
+        uint32_t length;
+        uint32_t padding;
+} Log_run;
+
+/* "UMIN" */
+static const uint32_t LOG_MAGIC   = 0x554d494e;
+static const uint32_t LOG_VERSION = 2;
+
+struct Io {
+        Um_io callbacks;
+
+        /* bytes of input given to the UM, and bytes still to be thrown 
+         * away because a restored UM had already read them */
+        uint64_t position;
+        uint64_t discard;
+
+        /* NULL unless the input is being recorded, with the run being 
+         * read, and whether writing the log has failed */
+        FILE *record;
+        uint8_t *run;
+        uint64_t run_step;
+        uint64_t run_stride;
+        uint32_t run_used;
+        int record_failed;
+
+        /* NULL unless the input is being replayed from a log held in 
+         * memory, with the bytes left of the run being replayed and the 
+         * step the next of them must be read after */
+        uint8_t *replay;
+        const uint8_t *replay_next;
+        const uint8_t *replay_end;
+        uint64_t replay_step;
+        uint64_t replay_stride;
+        uint32_t replay_left;
+
+        size_t out_used;
+        uint8_t out_buffer[OUTPUT_SIZE];
+};
+
+/* 
+ * Bytes from head up to tail are ready for the UM. The reader thread only
+ * moves tail, and the UM moves head but only hands the space back as 
+ * freed every FREE_STEP bytes. Whichever side runs out sets its waiting 
+ * flag and sleeps. The reader sleeps until a whole read fits, so that it
+ * is not woken for every byte the UM takes
+ */
+static struct {
+        uint8_t bytes[RING_SIZE];
+        uint64_t head;
+        uint64_t freed;
+        uint64_t tail;
+        int eof;
+
+        int started;
+        int start_failed;
+        int reader_waiting;
+        int um_waiting;
+        pthread_mutex_t lock;
+        pthread_cond_t changed;
+} ring = { 
+        .lock = PTHREAD_MUTEX_INITIALIZER, 
+        .changed = PTHREAD_COND_INITIALIZER 
+};
+
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * */
+
+static int   read_byte      (Io io, uint64_t step);
+static void  record_byte    (Io io, uint64_t step, int byte);
+static void  end_run        (Io io);
+static int   replay_byte    (Io io, uint64_t step, int checked);
+static int   check_log      (const uint8_t *next, const uint8_t *end);
+static int   discard_input  (Io io, uint64_t step);
+static int   read_standard  (void *closure);
+static int   take_standard  (Io io);
+static void  write_standard (void *closure, const uint8_t *bytes, 
+                             size_t count);
+
+static void  start_reader   (void);
+static void *read_ahead     (void *unused);
+static void  free_input     (uint64_t head);
+static void  wait_for_input (uint64_t head);
+static void  wait_for_space (uint64_t tail);
+static void  wake           (int *waiting);
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
 
 /* 
- * Gets characters from standard input and stores them in the designated
- * register
+ * Returns io for a UM that uses callbacks, or standard input and output 
+ * if callbacks is NULL
  */
-extern void input(unsigned rc, UArray_T registers)
+extern Io io_new(const Um_io *callbacks)
 {
-        uint32_t input_value = fgetc(stdin);
-        
-        if ( input_value == (unsigned)EOF ) {
-                input_value = 0;
-                input_value = ~input_value;
+        Io io = malloc(sizeof(*io));
+        assert(io);
+
+        if ( callbacks != NULL ) {
+                io->callbacks = *callbacks;
+        } else {
+                io->callbacks.read = read_standard;
+                io->callbacks.write = write_standard;
+                io->callbacks.closure = io;
+        }
+        io->position = 0;
+        io->discard = 0;
+        io->record = NULL;
+        io->run = NULL;
+        io->run_used = 0;
+        io->record_failed = 0;
+        io->replay = NULL;
+        io->replay_left = 0;
+        io->out_used = 0;
+
+        return io;
+}
+
+/* 
+ * Gets a character and stores it in the designated register, or all ones 
+ * once the input has ended. Returns 0 without touching the register if 
+ * no character is ready yet. The interpreter must have set the steps 
+ * before the instruction in the state
+ */
+extern int input(unsigned rc, Um_state um)
+{
+        Io io = um->io;
+        uint64_t step = um->input_step;
+
+        if ( io->discard > 0 && !discard_input(io, step) ) {
+                return 0;
+        }
+
+        int byte = read_byte(io, step);
+
+        if ( byte == UM_NO_INPUT ) {
+                return 0;
+        }
+
+        assert(byte >= UM_EOF && byte <= 255);
+        if ( byte == UM_EOF ) {
+                um->registers[rc] = ~(uint32_t)0;
         } else {
-                assert(input_value <= 255);
+                um->registers[rc] = byte;
+                io->position++;
+        }
+        return 1;
+}
+
+/* Returns the number of bytes of input the UM has read */
+extern uint64_t input_position(Io io)
+{
+        return io->position;
+}
+
+/* 
+ * Makes a UM that has just been restored read and throw away the first
+ * position bytes of its input, which it read before it was saved
+ */
+extern void skip_input(Io io, uint64_t position)
+{
+        io->position = position;
+        io->discard = position;
+}
+
+/* 
+ * Starts writing every byte read from now on to a new input log at path,
+ * or if path is NULL, finishes the log being written. Returns 0, or -1 
+ * if the log could not be opened or, when finishing it, written
+ */
+extern int record_input(Io io, const char *path)
+{
+        int failed = 0;
+
+        if ( io->record != NULL ) {
+                if ( io->run_used > 0 ) {
+                        end_run(io);
+                }
+                failed = io->record_failed | (fclose(io->record) != 0);
+                free(io->run);
+                io->record = NULL;
+                io->run = NULL;
+                io->record_failed = 0;
+        }
+        if ( path == NULL ) {
+                return failed ? -1 : 0;
+        }
+
+        Log_header header = { LOG_MAGIC, LOG_VERSION };
+
+        io->record = fopen(path, "wb");
+        if ( io->record == NULL ) {
+                return -1;
+        }
+        io->run = malloc(RUN_SIZE);
+        assert(io->run);
+        io->record_failed = fwrite(&header, sizeof(header), 1, 
+                                   io->record) != 1;
+        return 0;
+}
+
+/* 
+ * Reads the whole input log at path into memory, and takes the input 
+ * from it from now on instead of from the callbacks. Once it runs out the
+ * input has ended. A path of NULL goes back to the callbacks. Returns 0,
+ * or -1 if path is not an input log
+ */
+extern int replay_input(Io io, const char *path)
+{
+        free(io->replay);
+        io->replay = NULL;
+        io->replay_left = 0;
+
+        if ( path == NULL ) {
+                return 0;
+        }
+
+        FILE *file = fopen(path, "rb");
+        struct stat file_stats;
+        Log_header header;
+
+        if ( file == NULL ) {
+                return -1;
+        }
+        if ( fstat(fileno(file), &file_stats) == -1 ||
+             (size_t)file_stats.st_size < sizeof(header) ||
+             fread(&header, sizeof(header), 1, file) != 1 ||
+             header.magic != LOG_MAGIC || header.version != LOG_VERSION ) {
+                fclose(file);
+                return -1;
         }
-        
-        uint32_t *store_value  = UArray_at(registers, rc);
-        *store_value = input_value;
+
+        size_t size = file_stats.st_size - sizeof(header);
+
+        /* one more byte, so that an empty log is not a failed malloc */
+        uint8_t *log = malloc(size + 1);
+        assert(log);
+
+        int failed = fread(log, 1, size, file) != size || 
+                     !check_log(log, log + size);
+
+        fclose(file);
+        if ( failed ) {
+                free(log);
+                return -1;
+        }
+
+        io->replay = log;
+        io->replay_next = log;
+        io->replay_end = log + size;
+        return 0;
 }
 
 /* 
- * Takes a character from the designated register and outputs it to standard
+ * Takes a character from the designated register and buffers it for 
  * output
  */
-extern void output(unsigned rc, UArray_T registers) 
+extern void output(unsigned rc, Um_state um) 
 {
-        uint32_t *output_value = UArray_at(registers, rc);
+        Io io = um->io;
+        uint32_t output_value = um->registers[rc];
     
-        assert(*output_value <= 255);
-        fputc(*output_value, stdout);
-}
\ No newline at end of file
+        check(output_value <= 255);
+        io->out_buffer[io->out_used++] = output_value;
+
+        if ( io->out_used == OUTPUT_SIZE ) {
+                flush_output(io);
+        }
+}
+
+/* Writes out everything output so far. Must be called when the UM stops */
+extern void flush_output(Io io)
+{
+        if ( io->out_used > 0 ) {
+                io->callbacks.write(io->callbacks.closure, io->out_buffer, 
+                                    io->out_used);
+                io->out_used = 0;
+        }
+        /* so that a UM killed while it waits for input leaves its log */
+        if ( io->record != NULL ) {
+                if ( io->run_used > 0 ) {
+                        end_run(io);
+                }
+                io->record_failed |= fflush(io->record) != 0;
+        }
+}
+
+extern void io_free(Io *io)
+{
+        flush_output(*io);
+        record_input(*io, NULL);
+        replay_input(*io, NULL);
+        free(*io);
+        *io = NULL;
+}
+
+/* Reads a byte for an input instruction run after step steps */
+static inline int read_byte(Io io, uint64_t step)
+{
+        int byte;
+
+        if ( io->replay != NULL ) {
+                return replay_byte(io, step, 1);
+        }
+
+        /* standard input is taken straight from the ring */
+        if ( io->callbacks.read == read_standard ) {
+                byte = take_standard(io);
+        } else {
+                byte = io->callbacks.read(io->callbacks.closure);
+        }
+
+        if ( io->record != NULL && byte != UM_NO_INPUT ) {
+                record_byte(io, step, byte);
+        }
+        return byte;
+}
+
+/* 
+ * Adds a byte or the end of input to the log being recorded. A run goes
+ * on while its bytes are read the same number of steps apart, and the 
+ * end of input is a run of its own
+ */
+static void record_byte(Io io, uint64_t step, int byte)
+{
+        uint32_t used = io->run_used;
+
+        if ( used > 0 && (byte == UM_EOF || used == RUN_SIZE || 
+                          (used > 1 && 
+                           step != io->run_step + io->run_stride * used)) ) {
+                end_run(io);
+                used = 0;
+        }
+
+        if ( used == 0 ) {
+                io->run_step = step;
+                io->run_stride = 0;
+        } else if ( used == 1 ) {
+                io->run_stride = step - io->run_step;
+        }
+
+        if ( byte == UM_EOF ) {
+                end_run(io);
+        } else {
+                io->run[io->run_used++] = byte;
+        }
+}
+
+/* 
+ * Writes the run being read to the log. One of no bytes is written as 
+ * the end of input
+ */
+static void end_run(Io io)
+{
+        Log_run run = { io->run_step, io->run_stride, io->run_used, 0 };
+
+        io->record_failed |= fwrite(&run, sizeof(run), 1, io->record) != 1;
+        io->record_failed |= fwrite(io->run, 1, io->run_used, io->record)
+                             != io->run_used;
+        io->run_used = 0;
+}
+
+/* 
+ * Takes the next byte from the log being replayed. Unless the byte is 
+ * only being thrown away, the UM must read it after the steps it read it
+ * after when it was recorded, or it is not running the same program on
+ * the same input, and fails
+ */
+static inline int replay_byte(Io io, uint64_t step, int checked)
+{
+        if ( io->replay_left == 0 ) {
+                Log_run run;
+
+                if ( io->replay_next == io->replay_end ) {
+                        return UM_EOF;
+                }
+
+                memcpy(&run, io->replay_next, sizeof(run));
+                io->replay_next += sizeof(run);
+                io->replay_step = run.step;
+                io->replay_stride = run.stride;
+                io->replay_left = run.length;
+
+                if ( run.length == 0 ) {
+                        check(!checked || run.step == step);
+                        return UM_EOF;
+                }
+        }
+
+        check(!checked || io->replay_step == step);
+        io->replay_step += io->replay_stride;
+        io->replay_left--;
+        return *io->replay_next++;
+}
+
+/* Returns whether the runs from next to end fit it exactly */
+static int check_log(const uint8_t *next, const uint8_t *end)
+{
+        while ( next != end ) {
+                Log_run run;
+
+                if ( (size_t)(end - next) < sizeof(run) ) {
+                        return 0;
+                }
+                memcpy(&run, next, sizeof(run));
+                next += sizeof(run);
+
+                if ( (size_t)(end - next) < run.length ) {
+                        return 0;
+                }
+                next += run.length;
+        }
+        return 1;
+}
+
+/* 
+ * Throws away the input a restored UM had already read. Returns 0 if it 
+ * has to wait for more of it
+ */
+static int discard_input(Io io, uint64_t step)
+{
+        while ( io->discard > 0 ) {
+                int byte;
+
+                /* the saved UM read these after fewer steps */
+                if ( io->replay != NULL ) {
+                        byte = replay_byte(io, step, 0);
+                } else {
+                        byte = read_byte(io, step);
+                }
+
+                if ( byte == UM_NO_INPUT ) {
+                        return 0;
+                }
+                if ( byte == UM_EOF ) {
+                        io->discard = 0;
+                        break;
+                }
+                io->discard--;
+        }
+        return 1;
+}
+
+static int read_standard(void *closure)
+{
+        return take_standard(closure);
+}
+
+/* Takes the next character from the ring that the reader thread fills */
+static inline int take_standard(Io io)
+{
+        if ( !__atomic_load_n(&ring.started, __ATOMIC_ACQUIRE) ) {
+                pthread_once(&reader_once, start_reader);
+
+                if ( ring.start_failed ) {
+                        fprintf(stderr, "Error: cannot start reading "
+                                        "standard input\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        uint64_t head = ring.head;
+
+        if ( __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == head ) {
+                /* the user may need to see the prompt before typing */
+                flush_output(io);
+                free_input(head);
+                wait_for_input(head);
+
+                if ( __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == head ) {
+                        return UM_EOF;
+                }
+        }
+
+        int byte = ring.bytes[head % RING_SIZE];
+        ring.head = ++head;
+
+        if ( head % FREE_STEP == 0 ) {
+                free_input(head);
+        }
+        return byte;
+}
+
+static void write_standard(void *closure, const uint8_t *bytes, 
+                           size_t count)
+{
+        size_t written = 0;
+        (void)closure;
+
+        while ( written < count ) {
+                ssize_t result = write(STDOUT_FILENO, bytes + written, 
+                                       count - written);
+                assert(result > 0);
+                written += result;
+        }
+}
+
+/* Hands the ring space before head back to the reader */
+static void free_input(uint64_t head)
+{
+        __atomic_store_n(&ring.freed, head, __ATOMIC_SEQ_CST);
+
+        if ( __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) - head <= 
+             RING_SIZE - READ_SIZE ) {
+                wake(&ring.reader_waiting);
+        }
+}
+
+/* 
+ * Starts the reader thread, once however many UMs reach their first 
+ * input at the same time
+ */
+static void start_reader(void)
+{
+        pthread_t reader;
+
+        if ( pthread_create(&reader, NULL, read_ahead, NULL) != 0 ) {
+                ring.start_failed = 1;
+                return;
+        }
+        pthread_detach(reader);
+        __atomic_store_n(&ring.started, 1, __ATOMIC_RELEASE);
+}
+
+/* 
+ * Reads standard input into the ring until end of file or an error. A 
+ * read interrupted by a signal is tried again
+ */
+static void *read_ahead(void *unused)
+{
+        uint64_t tail = 0;
+        (void)unused;
+
+        for (;;) {
+                uint64_t freed = __atomic_load_n(&ring.freed, 
+                                                 __ATOMIC_ACQUIRE);
+
+                if ( tail - freed > RING_SIZE - READ_SIZE ) {
+                        wait_for_space(tail);
+                        continue;
+                }
+
+                /* read no further than the end of the ring */
+                size_t offset = tail % RING_SIZE;
+                size_t space = RING_SIZE - offset;
+
+                if ( space > READ_SIZE ) {
+                        space = READ_SIZE;
+                }
+
+                ssize_t result = read(STDIN_FILENO, ring.bytes + offset, 
+                                      space);
+
+                if ( result < 0 && errno == EINTR ) {
+                        continue;
+                }
+                if ( result <= 0 ) {
+                        break;
+                }
+
+                tail += result;
+                __atomic_store_n(&ring.tail, tail, __ATOMIC_SEQ_CST);
+                wake(&ring.um_waiting);
+        }
+
+        pthread_mutex_lock(&ring.lock);
+        ring.eof = 1;
+        pthread_cond_broadcast(&ring.changed);
+        pthread_mutex_unlock(&ring.lock);
+
+        return NULL;
+}
+
+/* 
+ * Sleeps until the reader has gone past head or the input has ended. The
+ * flag is raised before tail is checked again, so a wake that comes in 
+ * between is not lost
+ */
+static void wait_for_input(uint64_t head)
+{
+        pthread_mutex_lock(&ring.lock);
+        __atomic_store_n(&ring.um_waiting, 1, __ATOMIC_SEQ_CST);
+
+        while ( __atomic_load_n(&ring.tail, __ATOMIC_SEQ_CST) == head && 
+                !ring.eof ) {
+                pthread_cond_wait(&ring.changed, &ring.lock);
+        }
+
+        __atomic_store_n(&ring.um_waiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&ring.lock);
+}
+
+/* Sleeps until a whole read fits in the ring past tail */
+static void wait_for_space(uint64_t tail)
+{
+        pthread_mutex_lock(&ring.lock);
+        __atomic_store_n(&ring.reader_waiting, 1, __ATOMIC_SEQ_CST);
+
+        while ( tail - __atomic_load_n(&ring.freed, __ATOMIC_SEQ_CST) > 
+                RING_SIZE - READ_SIZE ) {
+                pthread_cond_wait(&ring.changed, &ring.lock);
+        }
+
+        __atomic_store_n(&ring.reader_waiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&ring.lock);
+}
+
+/* 
+ * Wakes the other side if it is sleeping in wait_for_input or 
+ * wait_for_space
+ */
+static void wake(int *waiting)
+{
+        if ( __atomic_load_n(waiting, __ATOMIC_SEQ_CST) ) {
+                pthread_mutex_lock(&ring.lock);
+                pthread_cond_broadcast(&ring.changed);
+                pthread_mutex_unlock(&ring.lock);
+        }
+}
@@ -8,18 +8,42 @@
  *             Purpose: Header file for the io module, which         *
  *                      handles receiving input from standard        *
  *                      input and outputting values to standard      *
- *                      output                                       *
+ *                      output, or through callbacks. Output is      *
+ *                      buffered until the UM stops, the buffer      *
+ *                      fills or the UM waits for input, which a     *
+ *                      reader thread prefetches from standard input *
+ *                      or replays from a log recorded earlier       *
  *                                                                   *
  *                                                                   *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#ifndef IO_INCLUDED
+#define IO_INCLUDED
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 
 #include "assert.h"
-#include "uarray.h"
+#include "state.h"
+#include "libum.h"
+
+typedef struct Io *Io;
+
+
+extern Io   io_new       (const Um_io *callbacks);
+
+extern int  input        (unsigned rc, Um_state um);
+extern void output       (unsigned rc, Um_state um);
+
+extern void flush_output (Io io);
+
+extern uint64_t input_position (Io io);
+extern void     skip_input     (Io io, uint64_t position);
+
+extern int      record_input   (Io io, const char *path);
+extern int      replay_input   (Io io, const char *path);
 
+extern void io_free      (Io *io);
 
-extern void input  (unsigned ra, UArray_T registers);
-extern void output (unsigned ra, UArray_T registers);
+#endif
@@ -0,0 +1,915 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                               jit                                 *
+ *                                                                   *
+ *                File: jit.c                                        *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Translates basic blocks of segment 0 into    *
+ *                      x86-64 code in an executable buffer. UM      *
+ *                      register i lives in host register r8+i       *
+ *                      while a block runs. Arithmetic, loads and    *
+ *                      stores, and jumps within segment 0 are       *
+ *                      translated directly, stores into segment 0,  *
+ *                      mapping and io call back into the C modules, *
+ *                      and everything else is left to the           *
+ *                      interpreter. Each block takes its            *
+ *                      length from the step budget as it is         *
+ *                      entered, and leaves if there is not enough.  *
+ *                      Leaving a block gives back the words of it   *
+ *                      that did not run                             *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+#include "interpret.h"
+#include "trace.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   S T R U C T U R E   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+struct Jit {
+        /* read by the generated code, so they must stay at small offsets */
+        uint32_t *regs;
+        void **blocks;
+        Memory mem;
+        uint32_t program_length;
+        uint32_t block_end;
+        uint64_t budget;
+        Trace trace;
+        Um_state um;
+
+        instruction program;
+        uint32_t version;
+        Memory_layout layout;
+
+        /* the steps the UM will have taken once the budget is used up */
+        uint64_t last_step;
+
+        /* which words of segment 0 are part of a translated block */
+        uint8_t *translated;
+        int stale;
+
+        /* set when native code left an input that has to wait */
+        int waiting;
+
+        uint8_t *code;
+        size_t code_used;
+        size_t stubs_end;
+        uint8_t *leave;
+};
+
+typedef uint32_t (*Enter)(Jit jit, void *block);
+
+
+const size_t   CODE_SIZE              = 16 * 1024 * 1024;
+const unsigned MAX_BLOCK_INSTRUCTIONS = 1024;
+
+/* 
+ * more than any one instruction is translated into, the exit after it 
+ * included. A block only takes another instruction while there is room
+ * for it and for the exit that ends the block
+ */
+const size_t   MAX_INSTRUCTION_BYTES  = 256;
+
+/* UM registers kept in r8 to r11, which calls do not preserve */
+const unsigned CALLER_SAVED           = 4;
+
+/* host registers */
+enum { EAX = 0, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
+#define HOST(r) (8 + (r))
+
+/* x86-64 opcodes, WIDE selects the 64-bit form */
+#define WIDE       0x10000
+#define MOV_RM_R   0x89
+#define MOV_R_RM   0x8b
+#define ADD_RM_R   0x01
+#define SUB_RM_R   0x29
+#define AND_RM_R   0x21
+#define XOR_RM_R   0x31
+#define TEST_RM_R  0x85
+#define CMP_R_RM   0x3b
+#define IMUL_R_RM  0x0faf
+#define CMOVNE     0x0f45
+#define GROUP1     0x81
+#define MOV_RM_I   0xc7
+#define GROUP3     0xf7
+#define GROUP5     0xff
+#define JZ         0x74
+#define JNZ        0x75
+#define JAE        0x73
+#define JMP        0xeb
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * */
+
+static void     flush             (Jit jit);
+static void    *compile_block     (Jit jit, uint32_t program_counter);
+static uint32_t execute_call      (Jit jit, uint32_t program_counter);
+static uint32_t store_program     (Jit jit, uint32_t offset, 
+                                   uint32_t value);
+static int      writes_code       (Jit jit, instruction decoded);
+
+static void     emit_stubs        (Jit jit);
+static void     emit_charge       (Jit jit, uint32_t program_counter,
+                                   size_t patches[3]);
+static void     emit_arithmetic   (Jit jit, instruction decoded,
+                                   uint32_t program_counter);
+static void     emit_segment      (Jit jit, instruction decoded,
+                                   uint32_t program_counter);
+static void     emit_map          (Jit jit, instruction decoded,
+                                   uint32_t program_counter);
+static void     emit_call         (Jit jit, uint32_t program_counter);
+static void     emit_store_program(Jit jit, instruction decoded,
+                                   uint32_t program_counter);
+static void     emit_host_call    (Jit jit, uint64_t function);
+static void     emit_load_program (Jit jit, instruction decoded,
+                                   uint32_t program_counter);
+static void     emit_trace_jump   (Jit jit, instruction decoded,
+                                   uint32_t program_counter);
+static void     emit_exit         (Jit jit, uint32_t program_counter);
+static void     emit_spill        (Jit jit, unsigned count);
+static void     emit_reload       (Jit jit, unsigned count);
+
+static void     emit_byte         (Jit jit, uint8_t byte);
+static void     emit_u32          (Jit jit, uint32_t value);
+static void     emit_op           (Jit jit, unsigned op, unsigned reg,
+                                   unsigned base);
+static void     emit_rr           (Jit jit, unsigned op, unsigned reg,
+                                   unsigned rm);
+static void     emit_rm           (Jit jit, unsigned op, unsigned reg,
+                                   unsigned base, size_t disp);
+static void     emit_rsib         (Jit jit, unsigned op, unsigned reg,
+                                   unsigned base, unsigned index,
+                                   unsigned scale, size_t disp);
+static size_t   emit_jump         (Jit jit, uint8_t condition);
+static void     patch_jump        (Jit jit, size_t jump);
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+extern Jit jit_new(Um_state um)
+{
+        Jit jit = malloc(sizeof(*jit));
+        assert(jit);
+        assert(offsetof(struct Jit, um) < 128);
+        assert(offsetof(struct Um_state, registers) == 0);
+
+        jit->regs = um->registers;
+        jit->um = um;
+        jit->mem = um->mem;
+        jit->layout = memory_layout();
+        jit->trace = um->trace;
+        jit->blocks = NULL;
+        jit->translated = NULL;
+        jit->budget = 0;
+        jit->waiting = 0;
+
+        jit->code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(jit->code != MAP_FAILED);
+        jit->code_used = 0;
+
+        emit_stubs(jit);
+        jit->stubs_end = jit->code_used;
+
+        flush(jit);
+        return jit;
+}
+
+/*
+ * Returns native code for the block starting at program_counter,
+ * translating it first if needed. All blocks are thrown away once
+ * segment 0 has been replaced or a translated word has been overwritten
+ */
+extern void *jit_block(Jit jit, uint32_t program_counter)
+{
+        if ( jit->stale || program_version(jit->mem) != jit->version ) {
+                flush(jit);
+        }
+
+        assert(program_counter <= jit->program_length);
+
+        if ( jit->blocks[program_counter] == NULL ) {
+                /* the start of a block, its first instruction and exit */
+                if ( CODE_SIZE - jit->code_used < 
+                     4 * MAX_INSTRUCTION_BYTES ) {
+                        flush(jit);
+                }
+                jit->blocks[program_counter] = compile_block(jit,
+                                                       program_counter);
+        }
+
+        return jit->blocks[program_counter];
+}
+
+/*
+ * Runs native code until it reaches an instruction it leaves to the
+ * interpreter, and returns the program counter of that instruction
+ */
+extern uint32_t jit_run(Jit jit, void *block)
+{
+        Enter enter;
+        uint8_t *code = jit->code;
+        memcpy(&enter, &code, sizeof(enter));
+
+        return enter(jit, block);
+}
+
+/* 
+ * Executes the instruction at the program counter in C, noting whether it
+ * overwrote translated code. Returns 0 if it is an input that has to wait
+ */
+extern int jit_step(Jit jit)
+{
+        instruction decoded = &jit->program[jit->um->program_counter];
+        struct instruction first;
+
+        /* native code runs superinstructions one word at a time */
+        if ( decoded->opcode >= MOVE ) {
+                unfuse(decoded, &first);
+                decoded = &first;
+        }
+
+        if ( writes_code(jit, decoded) ) {
+                jit->stale = 1;
+        }
+
+        return execute_instruction(decoded, jit->um);
+}
+
+/* 
+ * Starts a run of at most max_steps steps, after the steps the UM has 
+ * taken so far
+ */
+extern void jit_start_run(Jit jit, uint64_t max_steps)
+{
+        jit->budget = max_steps;
+        jit->last_step = jit->um->steps + max_steps;
+}
+
+/* Sets the number of steps that native code may take */
+extern void jit_set_budget(Jit jit, uint64_t max_steps)
+{
+        jit->budget = max_steps;
+}
+
+/* 
+ * Returns the steps left. Native code takes only the words that ran, and
+ * leaves a block that does not fit in them without running any of it
+ */
+extern uint64_t jit_budget(Jit jit)
+{
+        return jit->budget;
+}
+
+/* 
+ * Returns whether native code left at an input that has to wait, which 
+ * leaves the program counter of the UM state on that input, and forgets it
+ */
+extern int jit_waiting(Jit jit)
+{
+        int waiting = jit->waiting;
+        jit->waiting = 0;
+        return waiting;
+}
+
+extern void jit_free(Jit *jit)
+{
+        munmap((*jit)->code, CODE_SIZE);
+        free((*jit)->blocks);
+        free((*jit)->translated);
+        free(*jit);
+        *jit = NULL;
+}
+
+/* Forgets every translated block and picks up the current segment 0 */
+static void flush(Jit jit)
+{
+        jit->program = program_instructions(jit->mem, &jit->program_length);
+        jit->version = program_version(jit->mem);
+
+        /* one more entry for the illegal word after the end of segment 0 */
+        free(jit->blocks);
+        jit->blocks = calloc(jit->program_length + 1, sizeof(void *));
+        assert(jit->blocks);
+
+        free(jit->translated);
+        jit->translated = calloc(jit->program_length + 1, 1);
+        assert(jit->translated);
+        jit->stale = 0;
+
+        jit->code_used = jit->stubs_end;
+}
+
+/*
+ * Translates instructions starting at program_counter until one ends the
+ * block, the block is as long as it may be or the buffer is nearly full.
+ * The sentinel after segment 0 guarantees that a block always ends
+ */
+static void *compile_block(Jit jit, uint32_t program_counter)
+{
+        void *block = jit->code + jit->code_used;
+        uint32_t block_start = program_counter;
+        size_t patches[3];
+        int ended = 0;
+        unsigned i;
+
+        emit_charge(jit, program_counter, patches);
+
+        for ( i = 0; i < MAX_BLOCK_INSTRUCTIONS && !ended; 
+              i++, program_counter++ ) {
+                if ( CODE_SIZE - jit->code_used < 
+                     2 * MAX_INSTRUCTION_BYTES ) {
+                        break;
+                }
+
+                instruction decoded = &jit->program[program_counter];
+                struct instruction first;
+                size_t start = jit->code_used;
+                jit->translated[program_counter] = 1;
+
+                if ( decoded->opcode >= MOVE ) {
+                        unfuse(decoded, &first);
+                        decoded = &first;
+                }
+
+                switch ( decoded->opcode ) {
+                        case CONDMOVE:
+                        case ADD:
+                        case MULTI:
+                        case DIVIDE:
+                        case NAND:
+                        case LOADVAL:
+                                emit_arithmetic(jit, decoded,
+                                                program_counter);
+                                break;
+                        case SEGLOAD:
+                        case SEGSTORE:
+                                emit_segment(jit, decoded, program_counter);
+                                break;
+                        case MAPSEG:
+                        case UNMAPSEG:
+                                /* traced ones go through the interpreter */
+                                if ( jit->trace == NULL ) {
+                                        emit_map(jit, decoded, 
+                                                 program_counter);
+                                        break;
+                                }
+                                emit_call(jit, program_counter);
+                                break;
+                        case OUT:
+                        case IN:
+                                emit_call(jit, program_counter);
+                                break;
+                        case LOADPROG:
+                                emit_load_program(jit, decoded,
+                                                  program_counter);
+                                ended = 1;
+                                break;
+                        default:
+                                /* halt, or not a legal UM instruction */
+                                emit_exit(jit, program_counter);
+                                ended = 1;
+                }
+
+                /* the room left above relies on this bound */
+                assert(jit->code_used - start <= MAX_INSTRUCTION_BYTES);
+                (void)start;
+        }
+
+        if ( !ended ) {
+                emit_exit(jit, program_counter);
+        }
+
+        /* i is now the number of words the block covers */
+        uint32_t steps = i;
+        uint32_t block_end = block_start + steps;
+
+        memcpy(jit->code + patches[0], &steps, sizeof(steps));
+        memcpy(jit->code + patches[1], &steps, sizeof(steps));
+        memcpy(jit->code + patches[2], &block_end, sizeof(block_end));
+        return block;
+}
+
+/*
+ * Called from native code to execute one instruction in C. Returns
+ * nonzero if the instruction overwrote translated code, because the rest
+ * of the block may no longer match the program, or if it is an input 
+ * that has to wait, whose step is given back
+ */
+static uint32_t execute_call(Jit jit, uint32_t program_counter)
+{
+        /* the block took the steps from here to its end when it started */
+        jit->um->program_counter = program_counter;
+        jit->um->input_step = jit->last_step - 
+                              (jit->budget + jit->block_end - program_counter);
+
+        if ( !jit_step(jit) ) {
+                jit->waiting = 1;
+                jit->budget++;
+                return 1;
+        }
+        return jit->stale;
+}
+
+/*
+ * Called from native code to store value at word offset of segment 0. 
+ * Returns nonzero if the word is part of a translated block, because the
+ * rest of the block may no longer match the program
+ */
+static uint32_t store_program(Jit jit, uint32_t offset, uint32_t value)
+{
+        store_word(jit->mem, 0, offset, value);
+
+        if ( jit->translated[offset] ) {
+                jit->stale = 1;
+        }
+        return jit->stale;
+}
+
+/* 
+ * Returns whether a decoded instruction is a store into a word of 
+ * segment 0 that belongs to a translated block. Stores into the rest of 
+ * segment 0 are only data, and the predecoded program already follows them
+ */
+static int writes_code(Jit jit, instruction decoded)
+{
+        if ( decoded->opcode != SEGSTORE || jit->regs[decoded->ra] != 0 ) {
+                return 0;
+        }
+
+        uint32_t offset = jit->regs[decoded->rb];
+        return offset < jit->program_length && jit->translated[offset];
+}
+
+
+/*   C O D E   G E N E R A T I O N   */
+
+/*
+ * Emits the code shared by all blocks at the start of the buffer: an
+ * entry called from C as enter(jit, block), which loads the UM registers
+ * and jumps to the block, and an exit that gives back the steps of the
+ * words from the program counter to the end of the block, stores the 
+ * registers and returns the program counter in eax
+ */
+static void emit_stubs(Jit jit)
+{
+        static const uint8_t prologue[] = {
+                0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,
+                0x48, 0x83, 0xec, 0x08
+        };
+        static const uint8_t epilogue[] = {
+                0x48, 0x83, 0xc4, 0x08,
+                0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b,
+                0xc3
+        };
+        unsigned i;
+
+        for ( i = 0; i < sizeof(prologue); i++ ) {
+                emit_byte(jit, prologue[i]);
+        }
+        emit_rr(jit, MOV_RM_R | WIDE, EDI, EBP);
+        emit_rm(jit, MOV_R_RM | WIDE, EBX, EBP, offsetof(struct Jit, regs));
+        emit_reload(jit, 8);
+        emit_rr(jit, GROUP5, 4, ESI);
+
+        jit->leave = jit->code + jit->code_used;
+        emit_rm(jit, MOV_R_RM, EDX, EBP, offsetof(struct Jit, block_end));
+        emit_rr(jit, SUB_RM_R, EAX, EDX);
+        emit_rm(jit, ADD_RM_R | WIDE, EDX, EBP, offsetof(struct Jit, budget));
+        emit_spill(jit, 8);
+        for ( i = 0; i < sizeof(epilogue); i++ ) {
+                emit_byte(jit, epilogue[i]);
+        }
+}
+
+/*
+ * Emits the start of a block, which takes the length of the block from 
+ * the budget and notes where the block ends for the exits to give back 
+ * what did not run, or leaves without running the block if the budget is
+ * not enough. The length is filled in at the first two offsets stored in
+ * patches once the block is translated, and the end at the third
+ */
+static void emit_charge(Jit jit, uint32_t program_counter, size_t patches[3])
+{
+        size_t enough;
+
+        emit_rm(jit, GROUP1 | WIDE, 7, EBP, offsetof(struct Jit, budget));
+        patches[0] = jit->code_used;
+        emit_u32(jit, 0);
+        enough = emit_jump(jit, JAE);
+
+        /* none of the block ran, so there is nothing to give back */
+        emit_rm(jit, MOV_RM_I, 0, EBP, offsetof(struct Jit, block_end));
+        emit_u32(jit, program_counter);
+        emit_exit(jit, program_counter);
+
+        patch_jump(jit, enough);
+        emit_rm(jit, GROUP1 | WIDE, 5, EBP, offsetof(struct Jit, budget));
+        patches[1] = jit->code_used;
+        emit_u32(jit, 0);
+        emit_rm(jit, MOV_RM_I, 0, EBP, offsetof(struct Jit, block_end));
+        patches[2] = jit->code_used;
+        emit_u32(jit, 0);
+}
+
+static void emit_arithmetic(Jit jit, instruction decoded,
+                            uint32_t program_counter)
+{
+        unsigned ra = HOST(decoded->ra);
+        unsigned rb = HOST(decoded->rb);
+        unsigned rc = HOST(decoded->rc);
+        size_t jump;
+
+        switch ( decoded->opcode ) {
+                case CONDMOVE:
+                        emit_rr(jit, TEST_RM_R, rc, rc);
+                        emit_rr(jit, CMOVNE, ra, rb);
+                        return;
+                case LOADVAL:
+                        emit_byte(jit, 0x41);
+                        emit_byte(jit, 0xb8 + (ra & 7));
+                        emit_u32(jit, decoded->value);
+                        return;
+                case DIVIDE:
+                        /* the interpreter reports division by zero */
+                        emit_rr(jit, TEST_RM_R, rc, rc);
+                        jump = emit_jump(jit, JNZ);
+                        emit_exit(jit, program_counter);
+                        patch_jump(jit, jump);
+                        break;
+        }
+
+        emit_rr(jit, MOV_RM_R, rb, EAX);
+
+        switch ( decoded->opcode ) {
+                case ADD:
+                        emit_rr(jit, ADD_RM_R, rc, EAX);
+                        break;
+                case MULTI:
+                        emit_rr(jit, IMUL_R_RM, EAX, rc);
+                        break;
+                case DIVIDE:
+                        emit_rr(jit, XOR_RM_R, EDX, EDX);
+                        emit_rr(jit, GROUP3, 6, rc);
+                        break;
+                case NAND:
+                        emit_rr(jit, AND_RM_R, rc, EAX);
+                        emit_rr(jit, GROUP3, 2, EAX);
+                        break;
+        }
+
+        emit_rr(jit, MOV_RM_R, EAX, ra);
+}
+
+/*
+ * Emits a segmented load or store that looks its segment up in the 
+ * segment table itself. An ID or offset that fails a check, or a store
+ * into the segment that segment 0 shares its words with, leaves native 
+ * code so that the interpreter faults or gives the segment its own 
+ * words. Stores into segment 0 go through store_program instead, so 
+ * that the predecoded program and the translated code follow them
+ */
+static void emit_segment(Jit jit, instruction decoded, 
+                         uint32_t program_counter)
+{
+        int store = decoded->opcode == SEGSTORE;
+        unsigned id = HOST(store ? decoded->ra : decoded->rb);
+        unsigned offset = HOST(store ? decoded->rb : decoded->rc);
+        unsigned value = HOST(store ? decoded->rc : decoded->ra);
+        size_t segment_zero = 0, failed[4], done;
+        unsigned checks = 0, i;
+
+        if ( store ) {
+                emit_rr(jit, TEST_RM_R, id, id);
+                segment_zero = emit_jump(jit, JZ);
+        }
+
+        emit_rm(jit, MOV_R_RM | WIDE, EDI, EBP, offsetof(struct Jit, mem));
+        emit_rm(jit, CMP_R_RM, id, EDI, jit->layout.high);
+        failed[checks++] = emit_jump(jit, JAE);
+        if ( store ) {
+                emit_rm(jit, CMP_R_RM, id, EDI, jit->layout.program_source);
+                failed[checks++] = emit_jump(jit, JZ);
+        }
+
+        /* rax = the segment, or NULL if the ID is unmapped */
+        emit_rm(jit, MOV_R_RM | WIDE, EDI, EDI, jit->layout.segments);
+        emit_rr(jit, MOV_RM_R, id, EAX);
+        emit_rsib(jit, MOV_R_RM | WIDE, EAX, EDI, EAX, 3, 0);
+        emit_rr(jit, TEST_RM_R | WIDE, EAX, EAX);
+        failed[checks++] = emit_jump(jit, JZ);
+
+        emit_rm(jit, CMP_R_RM, offset, EAX, offsetof(struct Segment, length));
+        failed[checks++] = emit_jump(jit, JAE);
+
+        emit_rr(jit, MOV_RM_R, offset, EDX);
+        emit_rsib(jit, store ? MOV_RM_R : MOV_R_RM, value, EAX, EDX, 2,
+                  offsetof(struct Segment, words));
+        done = emit_jump(jit, JMP);
+
+        for ( i = 0; i < checks; i++ ) {
+                patch_jump(jit, failed[i]);
+        }
+        emit_exit(jit, program_counter);
+
+        if ( store ) {
+                patch_jump(jit, segment_zero);
+                emit_store_program(jit, decoded, program_counter);
+        }
+        patch_jump(jit, done);
+}
+
+/* 
+ * Emits store_program(jit, rb, rc) for a store into segment 0, which 
+ * leaves native code after the store if it overwrote translated code
+ */
+static void emit_store_program(Jit jit, instruction decoded,
+                               uint32_t program_counter)
+{
+        size_t jump;
+
+        emit_spill(jit, CALLER_SAVED);
+        emit_rr(jit, MOV_RM_R, HOST(decoded->rb), ESI);
+        emit_rr(jit, MOV_RM_R, HOST(decoded->rc), EDX);
+        emit_rr(jit, MOV_RM_R | WIDE, EBP, EDI);
+        emit_host_call(jit, (uint64_t)(uintptr_t)store_program);
+        emit_reload(jit, CALLER_SAVED);
+
+        emit_rr(jit, TEST_RM_R, EAX, EAX);
+        jump = emit_jump(jit, JZ);
+        emit_exit(jit, program_counter + 1);
+        patch_jump(jit, jump);
+}
+
+/*
+ * Emits a call straight to map_segment or unmap_segment, which only
+ * touch the UM registers they are given. The program counter is stored 
+ * first, for a MAPSEG that faults on a memory limit
+ */
+static void emit_map(Jit jit, instruction decoded, uint32_t program_counter)
+{
+        uint64_t function = decoded->opcode == MAPSEG 
+                            ? (uint64_t)(uintptr_t)map_segment
+                            : (uint64_t)(uintptr_t)unmap_segment;
+
+        emit_rm(jit, MOV_RM_I, 0, EBX, offsetof(struct Um_state, 
+                                                program_counter));
+        emit_u32(jit, program_counter);
+
+        emit_spill(jit, CALLER_SAVED);
+        if ( decoded->rc >= CALLER_SAVED ) {
+                emit_rm(jit, MOV_RM_R, HOST(decoded->rc), EBX, 
+                        decoded->rc * sizeof(uint32_t));
+        }
+
+        /* map_segment(rb, rc, um) or unmap_segment(rc, um) */
+        if ( decoded->opcode == MAPSEG ) {
+                emit_byte(jit, 0xb8 + EDI);
+                emit_u32(jit, decoded->rb);
+                emit_byte(jit, 0xb8 + ESI);
+                emit_u32(jit, decoded->rc);
+                emit_rm(jit, MOV_R_RM | WIDE, EDX, EBP, 
+                        offsetof(struct Jit, um));
+        } else {
+                emit_byte(jit, 0xb8 + EDI);
+                emit_u32(jit, decoded->rc);
+                emit_rm(jit, MOV_R_RM | WIDE, ESI, EBP, 
+                        offsetof(struct Jit, um));
+        }
+        emit_host_call(jit, function);
+
+        emit_reload(jit, CALLER_SAVED);
+        if ( decoded->opcode == MAPSEG && decoded->rb >= CALLER_SAVED ) {
+                emit_rm(jit, MOV_R_RM, HOST(decoded->rb), EBX, 
+                        decoded->rb * sizeof(uint32_t));
+        }
+}
+
+/* Emits a call to execute_call for the instruction at program_counter */
+static void emit_call(Jit jit, uint32_t program_counter)
+{
+        size_t jump;
+
+        emit_spill(jit, 8);
+        emit_rr(jit, MOV_RM_R | WIDE, EBP, EDI);
+        emit_byte(jit, 0xb8 + ESI);
+        emit_u32(jit, program_counter);
+        emit_host_call(jit, (uint64_t)(uintptr_t)execute_call);
+        emit_reload(jit, 8);
+
+        emit_rr(jit, TEST_RM_R, EAX, EAX);
+        jump = emit_jump(jit, JZ);
+        emit_exit(jit, program_counter + 1);
+        patch_jump(jit, jump);
+}
+
+/*
+ * Emits a jump within segment 0, straight to the target block if it has
+ * already been translated. Loads from other segments, jumps out of range
+ * and jumps to untranslated blocks go back to the interpreter, which
+ * traces them itself
+ */
+static void emit_load_program(Jit jit, instruction decoded,
+                              uint32_t program_counter)
+{
+        unsigned rb = HOST(decoded->rb);
+        unsigned rc = HOST(decoded->rc);
+        size_t other_segment, out_of_range, untranslated;
+
+        emit_rr(jit, TEST_RM_R, rb, rb);
+        other_segment = emit_jump(jit, JNZ);
+
+        emit_rr(jit, MOV_RM_R, rc, EAX);
+        emit_rm(jit, CMP_R_RM, EAX, EBP,
+                offsetof(struct Jit, program_length));
+        out_of_range = emit_jump(jit, JAE);
+
+        /* mov rcx, [rbp + blocks]; mov rcx, [rcx + rax * 8] */
+        emit_rm(jit, MOV_R_RM | WIDE, ECX, EBP, offsetof(struct Jit, blocks));
+        emit_byte(jit, 0x48);
+        emit_byte(jit, MOV_R_RM);
+        emit_byte(jit, 0x0c);
+        emit_byte(jit, 0xc1);
+        emit_rr(jit, TEST_RM_R | WIDE, ECX, ECX);
+        untranslated = emit_jump(jit, JZ);
+        if ( jit->trace != NULL ) {
+                emit_trace_jump(jit, decoded, program_counter);
+        }
+        emit_rr(jit, GROUP5, 4, ECX);
+
+        patch_jump(jit, other_segment);
+        patch_jump(jit, out_of_range);
+        patch_jump(jit, untranslated);
+        emit_exit(jit, program_counter);
+}
+
+/*
+ * Emits trace_event for the jump at program_counter, leaving rcx and the
+ * UM registers as they were
+ */
+static void emit_trace_jump(Jit jit, instruction decoded,
+                            uint32_t program_counter)
+{
+        emit_rm(jit, MOV_R_RM | WIDE, EDI, EBP, offsetof(struct Jit, trace));
+        emit_rm(jit, MOV_R_RM | WIDE, EAX, EDI, 
+                offsetof(struct Trace, events));
+        emit_rm(jit, MOV_R_RM, EDX, EDI, offsetof(struct Trace, mask));
+        emit_rr(jit, AND_RM_R, EAX, EDX);
+
+        /* shl edx, 4 */
+        emit_byte(jit, 0xc1);
+        emit_byte(jit, 0xe0 | EDX);
+        emit_byte(jit, 4);
+        emit_rm(jit, MOV_R_RM | WIDE, ESI, EDI, 
+                offsetof(struct Trace, records));
+        emit_rr(jit, ADD_RM_R | WIDE, ESI, EDX);
+
+        emit_rm(jit, MOV_RM_I, 0, EDX, 
+                offsetof(Trace_record, program_counter));
+        emit_u32(jit, program_counter);
+        emit_rm(jit, MOV_RM_I, 0, EDX, offsetof(Trace_record, opcode));
+        emit_u32(jit, LOADPROG);
+        emit_rm(jit, MOV_RM_R, HOST(decoded->rb), EDX, 
+                offsetof(Trace_record, a));
+        emit_rm(jit, MOV_RM_R, HOST(decoded->rc), EDX, 
+                offsetof(Trace_record, b));
+
+        emit_rr(jit, GROUP1 | WIDE, 0, EAX);
+        emit_u32(jit, 1);
+        emit_rm(jit, MOV_RM_R | WIDE, EAX, EDI, 
+                offsetof(struct Trace, events));
+}
+
+/* Emits a call to a C function through rax, which it may overwrite */
+static void emit_host_call(Jit jit, uint64_t function)
+{
+        unsigned i;
+
+        emit_byte(jit, 0x48);
+        emit_byte(jit, 0xb8 + EAX);
+        for ( i = 0; i < 64; i += 8 ) {
+                emit_byte(jit, function >> i);
+        }
+        emit_rr(jit, GROUP5, 2, EAX);
+}
+
+/* Leaves native code so the interpreter executes program_counter next */
+static void emit_exit(Jit jit, uint32_t program_counter)
+{
+        emit_byte(jit, 0xb8 + EAX);
+        emit_u32(jit, program_counter);
+        emit_byte(jit, 0xe9);
+        emit_u32(jit, jit->leave - (jit->code + jit->code_used + 4));
+}
+
+/* Stores the host copies of the first count UM registers in memory */
+static void emit_spill(Jit jit, unsigned count)
+{
+        unsigned i;
+        for ( i = 0; i < count; i++ ) {
+                emit_rm(jit, MOV_RM_R, HOST(i), EBX, i * sizeof(uint32_t));
+        }
+}
+
+/* Loads the first count UM registers from memory into host registers */
+static void emit_reload(Jit jit, unsigned count)
+{
+        unsigned i;
+        for ( i = 0; i < count; i++ ) {
+                emit_rm(jit, MOV_R_RM, HOST(i), EBX, i * sizeof(uint32_t));
+        }
+}
+
+
+/*   I N S T R U C T I O N   E N C O D I N G   */
+
+static void emit_byte(Jit jit, uint8_t byte)
+{
+        jit->code[jit->code_used++] = byte;
+}
+
+static void emit_u32(Jit jit, uint32_t value)
+{
+        unsigned i;
+        for ( i = 0; i < 32; i += 8 ) {
+                emit_byte(jit, value >> i);
+        }
+}
+
+/* Emits the REX prefix, if any, and opcode of a register instruction */
+static void emit_op(Jit jit, unsigned op, unsigned reg, unsigned base)
+{
+        unsigned rex = 0x40 | ((reg >> 3) << 2) | (base >> 3);
+        if ( op & WIDE ) {
+                rex |= 0x08;
+        }
+        if ( rex != 0x40 ) {
+                emit_byte(jit, rex);
+        }
+        if ( (op & 0xffff) > 0xff ) {
+                emit_byte(jit, (op >> 8) & 0xff);
+        }
+        emit_byte(jit, op & 0xff);
+}
+
+/* Emits op with two register operands */
+static void emit_rr(Jit jit, unsigned op, unsigned reg, unsigned rm)
+{
+        emit_op(jit, op, reg, rm);
+        emit_byte(jit, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* Emits op with a register and a memory operand at [base + disp] */
+static void emit_rm(Jit jit, unsigned op, unsigned reg, unsigned base,
+                    size_t disp)
+{
+        assert(disp < 128 && base != ESP);
+        emit_op(jit, op, reg, base);
+        emit_byte(jit, 0x40 | ((reg & 7) << 3) | (base & 7));
+        emit_byte(jit, disp);
+}
+
+/* 
+ * Emits op with a register and a memory operand at 
+ * [base + index * 2^scale + disp], where index is one of the first eight
+ * host registers
+ */
+static void emit_rsib(Jit jit, unsigned op, unsigned reg, unsigned base,
+                      unsigned index, unsigned scale, size_t disp)
+{
+        assert(disp < 128 && index < 8 && scale < 4);
+        emit_op(jit, op, reg, base);
+        emit_byte(jit, 0x44 | ((reg & 7) << 3));
+        emit_byte(jit, (scale << 6) | (index << 3) | (base & 7));
+        emit_byte(jit, disp);
+}
+
+/* Emits a short conditional jump whose target is filled in later */
+static size_t emit_jump(Jit jit, uint8_t condition)
+{
+        emit_byte(jit, condition);
+        emit_byte(jit, 0);
+        return jit->code_used;
+}
+
+/* Points a jump made by emit_jump at the next instruction emitted */
+static void patch_jump(Jit jit, size_t jump)
+{
+        size_t distance = jit->code_used - jump;
+        assert(distance < 128);
+        jit->code[jump - 1] = distance;
+}
@@ -0,0 +1,46 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                               jit                                 *
+ *                                                                   *
+ *                File: jit.h                                        *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Header for the jit module, which translates  *
+ *                      basic blocks of segment 0 into x86-64 code   *
+ *                      that keeps the eight UM registers in host    *
+ *                      registers. Used by interpret when the UM is  *
+ *                      compiled with -DUM_JIT                       *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef JIT_INCLUDED
+#define JIT_INCLUDED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "state.h"
+
+typedef struct Jit *Jit;
+
+
+extern Jit      jit_new   (Um_state um);
+
+extern void    *jit_block (Jit jit, uint32_t program_counter);
+
+extern uint32_t jit_run   (Jit jit, void *block);
+
+extern int      jit_step  (Jit jit);
+
+extern void     jit_start_run  (Jit jit, uint64_t max_steps);
+
+extern void     jit_set_budget (Jit jit, uint64_t max_steps);
+
+extern uint64_t jit_budget     (Jit jit);
+
+extern int      jit_waiting    (Jit jit);
+
+extern void     jit_free  (Jit *jit);
+
+#endif
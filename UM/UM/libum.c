@@ -0,0 +1,419 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                               libum                               *
+ *                                                                   *
+ *                File: libum.c                                      *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Keeps everything a UM needs behind one       *
+ *                      handle so that a program can run many of     *
+ *                      them, and runs them through the interpreter  *
+ *                      a budget of steps at a time. A UM program    *
+ *                      that fails one of the checks in fault.h is   *
+ *                      reported as a fault rather than ending the   *
+ *                      host, and UMs may run on different threads   *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+
+#include "assert.h"
+#include "fault.h"
+#include "libum.h"
+#include "state.h"
+#include "managemem.h"
+#include "alu.h"
+#include "io.h"
+#include "interpret.h"
+#include "profile.h"
+#include "jit.h"
+#include "image.h"
+#include "snapshot.h"
+#include "trace.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   S T R U C T U R E   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+struct Um {
+        /* first, so that it starts on the cache line the handle is on */
+        struct Um_state state;
+
+        /* set once the UM has halted or faulted, or has no program */
+        int stopped;
+        Um_status stop_status;
+
+        /* set while um_run or um_profile is executing instructions */
+        volatile sig_atomic_t running;
+
+        /* where the UM faulted, if faulted is set */
+        int faulted;
+        Um_fault fault;
+
+        /* given to the memory of every program the UM loads */
+        uint64_t max_words;
+        uint64_t max_segments;
+};
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N S   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static void reset        (Um vm);
+
+static void release      (Um vm);
+
+static void stop         (Um vm, Um_status status);
+
+static void limit        (Um vm);
+
+static void record_fault (Um vm);
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+extern Um um_new(const Um_io *io)
+{
+        Um vm;
+
+        if ( posix_memalign((void **)&vm, 64, sizeof(*vm)) != 0 ) {
+                return NULL;
+        }
+
+        vm->state.mem = NULL;
+        vm->state.io = io_new(io);
+        vm->state.jit = NULL;
+        vm->state.trace = NULL;
+        vm->state.program_counter = 0;
+        vm->running = 0;
+        vm->state.steps = 0;
+        vm->faulted = 0;
+        vm->max_words = UM_NO_LIMIT;
+        vm->max_segments = UM_NO_LIMIT;
+
+        stop(vm, UM_FAULT);
+        return vm;
+}
+
+/*
+ * Converts the big-endian words of the image straight into a new segment
+ * 0, and throws away whatever the UM was running before
+ */
+extern int um_load_buffer(Um vm, const void *image, size_t size)
+{
+        Um_state um = &vm->state;
+
+        if ( size % 4 != 0 || size / 4 > UINT32_MAX ) {
+                return -1;
+        }
+
+        uint32_t length = size / 4;
+
+        reset(vm);
+        load_value(0, length, um);
+        map_segment(1, 0, um);
+
+        if ( length > 0 ) {
+                swap_words(writable_segment_word(um->mem, 0, 0), image,
+                           length);
+        }
+
+        load_value(0, 0, um);
+        load_value(1, 0, um);
+
+        /* decode segment 0 once instead of on every fetch */
+        predecode_program(um->mem);
+        limit(vm);
+
+        vm->stopped = 0;
+        return 0;
+}
+
+/*
+ * Loads the image like um_load_buffer, but into a segment 0 that shares
+ * its words and predecoded instructions with every other UM that loaded
+ * the same words this way
+ */
+extern int um_load_shared(Um vm, const void *image, size_t size)
+{
+        return um_load_cached(vm, image, size, NULL);
+}
+
+extern int um_load_cached(Um vm, const void *image, size_t size,
+                          const char *cache_path)
+{
+        if ( size % 4 != 0 || size / 4 > UINT32_MAX ) {
+                return -1;
+        }
+
+        reset(vm);
+        if ( load_image(vm->state.mem, image, size, cache_path) != 0 ) {
+                stop(vm, UM_FAULT);
+                return -1;
+        }
+        limit(vm);
+
+        vm->stopped = 0;
+        return 0;
+}
+
+extern Um_status um_run(Um vm, uint64_t max_steps)
+{
+        volatile Um_status status = UM_FAULT;
+        uint64_t budget = max_steps;
+
+        if ( vm->stopped ) {
+                return vm->stop_status;
+        }
+        if ( max_steps == 0 ) {
+                return UM_BUDGET_EXHAUSTED;
+        }
+
+        jmp_buf handler;
+        jmp_buf *previous = catch_faults(&handler);
+
+        vm->running = 1;
+        if ( setjmp(handler) == 0 ) {
+                status = interpret(&vm->state, &budget);
+                vm->state.steps += max_steps - budget;
+        } else {
+                record_fault(vm);
+        }
+        vm->running = 0;
+        catch_faults(previous);
+
+        flush_output(vm->state.io);
+
+        if ( status == UM_HALTED || status == UM_FAULT ) {
+                stop(vm, status);
+        }
+        return status;
+}
+
+extern Um_status um_profile(Um vm, const char *report_path)
+{
+        volatile Um_status status = UM_FAULT;
+
+        if ( vm->stopped ) {
+                return vm->stop_status;
+        }
+
+        FILE *report = fopen(report_path, "w");
+
+        if ( report == NULL ) {
+                return UM_FAULT;
+        }
+
+        jmp_buf handler;
+        jmp_buf *previous = catch_faults(&handler);
+
+        vm->running = 1;
+        if ( setjmp(handler) == 0 ) {
+                status = profile(&vm->state, report);
+        } else {
+                record_fault(vm);
+        }
+        vm->running = 0;
+        catch_faults(previous);
+
+        flush_output(vm->state.io);
+
+        if ( status == UM_HALTED || status == UM_FAULT ) {
+                stop(vm, status);
+        }
+        return status;
+}
+
+/*
+ * Saves the UM between two of the steps that um_run counts. Its output
+ * has already been written out by um_run
+ */
+extern int um_checkpoint(Um vm, const char *path)
+{
+        if ( vm->stopped ) {
+                return -1;
+        }
+        return snapshot_save(&vm->state, path);
+}
+
+extern int um_restore(Um vm, const char *path)
+{
+        release(vm);
+
+        if ( snapshot_load(&vm->state, path) != 0 ) {
+                stop(vm, UM_FAULT);
+                return -1;
+        }
+        limit(vm);
+
+        vm->stopped = 0;
+        return 0;
+}
+
+/*
+ * Starts keeping the last records - 1 traced instructions of the UM, or
+ * stops tracing it if records is 0. Translated code is thrown away, 
+ * since it records jumps into the trace it was translated with
+ */
+extern int um_trace(Um vm, uint32_t records)
+{
+        Um_state um = &vm->state;
+
+        if ( records == 1 || (records & (records - 1)) != 0 ) {
+                return -1;
+        }
+
+        if ( um->jit != NULL ) {
+                jit_free(&um->jit);
+        }
+        if ( um->trace != NULL ) {
+                trace_free(&um->trace);
+        }
+        if ( records != 0 ) {
+                um->trace = trace_new(records);
+        }
+        return 0;
+}
+
+extern int um_trace_dump(Um vm, const char *path)
+{
+        Trace_reason reason = TRACE_PAUSED;
+
+        if ( vm->state.trace == NULL ) {
+                return -1;
+        }
+
+        if ( vm->running ) {
+                reason = TRACE_RUNNING;
+        } else if ( vm->stopped && vm->stop_status == UM_HALTED ) {
+                reason = TRACE_HALTED;
+        } else if ( vm->stopped ) {
+                reason = TRACE_FAULTED;
+        }
+        return trace_dump(vm->state.trace, &vm->state, reason, path);
+}
+
+extern int um_record_input(Um vm, const char *path)
+{
+        return record_input(vm->state.io, path);
+}
+
+extern int um_replay_input(Um vm, const char *path)
+{
+        return replay_input(vm->state.io, path);
+}
+
+extern uint64_t um_steps(Um vm)
+{
+        return vm->state.steps;
+}
+
+extern uint32_t um_registers(Um vm, uint32_t registers[8])
+{
+        memcpy(registers, vm->state.registers, 
+               sizeof(vm->state.registers));
+        return vm->state.program_counter;
+}
+
+extern int um_fault_info(Um vm, Um_fault *report)
+{
+        if ( !vm->faulted ) {
+                return -1;
+        }
+        *report = vm->fault;
+        return 0;
+}
+
+extern int um_memory_stats(Um vm, Um_memory_stats *stats)
+{
+        if ( vm->state.mem == NULL ) {
+                return -1;
+        }
+        memory_stats(vm->state.mem, stats);
+        return 0;
+}
+
+extern void um_limit_memory(Um vm, uint64_t max_words, 
+                            uint64_t max_segments)
+{
+        vm->max_words = max_words;
+        vm->max_segments = max_segments;
+        limit(vm);
+}
+
+extern void um_free(Um *vm)
+{
+        release(*vm);
+        if ( (*vm)->state.trace != NULL ) {
+                trace_free(&(*vm)->state.trace);
+        }
+        io_free(&(*vm)->state.io);
+        free(*vm);
+        *vm = NULL;
+}
+
+/* Gives a UM fresh memory and registers */
+static void reset(Um vm)
+{
+        Um_state um = &vm->state;
+        int i;
+
+        release(vm);
+
+        um->mem = initialize_memory();
+        um->program_counter = 0;
+        um->steps = 0;
+        for ( i = 0; i < NUM_REGISTERS; i++ ) {
+                um->registers[i] = 0;
+        }
+}
+
+/* Frees the memory and translated code of a UM, if it has any */
+static void release(Um vm)
+{
+        Um_state um = &vm->state;
+
+        if ( um->jit != NULL ) {
+                jit_free(&um->jit);
+        }
+        if ( um->mem != NULL ) {
+                free_memory(um->mem);
+                um->mem = NULL;
+        }
+        vm->faulted = 0;
+}
+
+static void stop(Um vm, Um_status status)
+{
+        vm->stopped = 1;
+        vm->stop_status = status;
+}
+
+/* 
+ * Notes where the UM failed, on the way back from fault.c, which both a 
+ * failed check and a read of the NULL segment jump from
+ */
+static void record_fault(Um vm)
+{
+        describe_fault(&vm->state, &vm->fault);
+        vm->faulted = 1;
+}
+
+/* Gives the memory of the UM its limits, once its program is loaded */
+static void limit(Um vm)
+{
+        if ( vm->state.mem != NULL ) {
+                limit_memory(vm->state.mem, vm->max_words, 
+                             vm->max_segments);
+        }
+}
@@ -0,0 +1,273 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                               libum                               *
+ *                                                                   *
+ *                File: libum.h                                      *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Interface for running UMs inside another     *
+ *                      program. Each UM is independent of the       *
+ *                      others, runs for a bounded number of steps   *
+ *                      at a time, and reads and writes through      *
+ *                      callbacks supplied by its host:              *
+ *                                                                   *
+ *                        Um vm = um_new(&io);                       *
+ *                        um_load_buffer(vm, image, size);           *
+ *                        while ( um_run(vm, 1000000) ==             *
+ *                                UM_BUDGET_EXHAUSTED ) {            *
+ *                                ...                                *
+ *                        }                                          *
+ *                        um_free(&vm);                              *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef LIBUM_INCLUDED
+#define LIBUM_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Um *Um;
+
+typedef enum Um_status {
+        UM_HALTED,
+        UM_BUDGET_EXHAUSTED,
+        UM_WAITING_FOR_INPUT,
+        UM_FAULT
+} Um_status;
+
+/* max_steps for a UM that should run until it stops by itself */
+#define UM_NO_LIMIT UINT64_MAX
+
+/* what a read callback returns when it has no byte to give */
+#define UM_EOF      (-1)
+#define UM_NO_INPUT (-2)
+
+/*
+ * Where a UM's input comes from and where its output goes. read returns
+ * the next byte, UM_EOF once the input has ended, or UM_NO_INPUT if none
+ * is ready yet, in which case um_run returns UM_WAITING_FOR_INPUT and the
+ * input instruction runs again on the next call. write is given the
+ * output in batches, at the latest when um_run returns
+ */
+typedef struct Um_io {
+        int  (*read) (void *closure);
+        void (*write)(void *closure, const uint8_t *bytes, size_t count);
+        void *closure;
+} Um_io;
+
+/* segments of length 0, and of each number of bits a length can have */
+#define UM_SIZE_BUCKETS 33
+
+/*
+ * The memory of a UM since its program was loaded or restored. Mapped 
+ * words and segments are as the program sees them, segment 0 included,
+ * even where segments share their words
+ */
+typedef struct Um_memory_stats {
+        uint64_t mapped_words;
+        uint64_t peak_mapped_words;
+        uint32_t live_segments;
+        uint32_t peak_live_segments;
+
+        /* live segments by the bits in their length: bucket 0 holds the 
+         * empty ones and bucket i those of 2^(i-1) to 2^i - 1 words */
+        uint32_t segment_sizes[UM_SIZE_BUCKETS];
+
+        /* slots in the segment ID table, IDs from here up never handed 
+         * out, and unmapped IDs waiting to be handed out again */
+        uint32_t id_capacity;
+        uint32_t id_high;
+        uint32_t free_ids;
+
+        /* bytes of the ID table and of the decoded copy of segment 0 */
+        uint64_t table_bytes;
+        uint64_t program_bytes;
+
+        /* bytes the segment heap has taken, and how many of them are in
+         * unmapped segments waiting to be reused */
+        uint64_t heap_bytes;
+        uint64_t heap_free_bytes;
+
+        /* heap and table bytes that do not hold words of a segment: 
+         * headers, rounding up to size classes, free segments, unused 
+         * arena space and the ID table */
+        uint64_t overhead_bytes;
+
+        /* set once MAPSEG has faulted because of a limit, or the UM 
+         * because there was no memory for a segment */
+        int over_limit;
+} Um_memory_stats;
+
+/* the opcode of a fault report for a UM that ran past segment 0 */
+#define UM_PAST_END 16
+
+/*
+ * Where a UM faulted: the word of segment 0 that failed and its opcode, 
+ * or the word after the last with UM_PAST_END for a UM that ran off the
+ * end. A load, store or LOADPROG that failed also gives the segment and 
+ * offset it reached for, and an UNMAPSEG the segment
+ */
+typedef struct Um_fault {
+        uint32_t program_counter;
+        unsigned opcode;
+
+        /* set if segment, and offset for all but UNMAPSEG, are given */
+        int access;
+        uint32_t segment;
+        uint32_t offset;
+} Um_fault;
+
+
+/*
+ * Returns a UM with no program, which reads and writes through io, or
+ * through standard input and output if io is NULL. Only one UM at a time
+ * may use standard input. Returns NULL if there is no memory for it
+ */
+extern Um        um_new         (const Um_io *io);
+
+/*
+ * Loads a UM binary, a sequence of big-endian words, into segment 0 and
+ * starts the UM over at its first word. Returns 0, or -1 if size is not
+ * a whole number of words
+ */
+extern int       um_load_buffer (Um vm, const void *image, size_t size);
+
+/*
+ * Loads a UM binary like um_load_buffer, except that UMs in this process
+ * that load the same words this way share one copy of segment 0 and of
+ * its decoded instructions. A UM that writes to segment 0 gets its own
+ * copy of each page it writes
+ */
+extern int       um_load_shared (Um vm, const void *image, size_t size);
+
+/*
+ * Loads a UM binary like um_load_shared, but takes segment 0 and its 
+ * decoded instructions from the .umx image cache file at cache_path if
+ * it was written for the same words by the same build, mapping it in 
+ * one go instead of converting and decoding the words. Otherwise the
+ * file is written for next time. A cache file that cannot be written 
+ * is skipped. Returns 0, or -1 if size is not a whole number of words
+ * or there was no room to build the shared copy
+ */
+extern int       um_load_cached (Um vm, const void *image, size_t size,
+                                 const char *cache_path);
+
+/*
+ * Runs the UM until it halts, faults, waits for input or has taken 
+ * max_steps steps. Every word of segment 0 that runs is a step, halt 
+ * included, so a UM run in slices goes through exactly the states it 
+ * would run in one go. An input that has to wait is not a step, and runs
+ * again on the next call. A UM that has halted or faulted stays that way
+ * until another program is loaded. Different UMs may run on different
+ * threads at the same time
+ */
+extern Um_status um_run         (Um vm, uint64_t max_steps);
+
+/* 
+ * Returns the steps um_run and um_profile have taken since the program 
+ * was loaded, those of the UM a restored one was saved from included
+ */
+extern uint64_t  um_steps       (Um vm);
+
+/* 
+ * Copies the eight registers of the UM into registers and returns its
+ * program counter
+ */
+extern uint32_t  um_registers   (Um vm, uint32_t registers[8]);
+
+/*
+ * Fills in report with where the UM faulted, in a -DUM_GUARDED build as 
+ * in any other. Returns 0, or -1 if it has not faulted since its program
+ * was loaded or restored
+ */
+extern int       um_fault_info  (Um vm, Um_fault *report);
+
+/*
+ * Runs the UM to the end like um_run, counting every instruction, and
+ * writes the counts as JSON to report_path, a UM that faults included.
+ * Returns UM_FAULT without running the UM, which um_fault_info has 
+ * nothing to report for, if report_path cannot be written
+ */
+extern Um_status um_profile     (Um vm, const char *report_path);
+
+/*
+ * Writes everything needed to carry on running the UM to a snapshot file
+ * at path: its registers, its mapped segments, the IDs it has unmapped,
+ * how much input it has read and the steps it has taken. The previous file at path is only 
+ * replaced once the new one is complete. Returns 0, or -1 if the file 
+ * cannot be written or the UM has halted, faulted or has no program
+ */
+extern int       um_checkpoint  (Um vm, const char *path);
+
+/*
+ * Replaces whatever the UM was running with the UM saved at path, which
+ * carries on from where it was saved when um_run is next called. The 
+ * file is mapped rather than read, so segments are only read in when 
+ * the UM touches them, and it must not be changed in place while the UM 
+ * runs. The UM first reads and throws away as much input as the saved 
+ * UM had read, so it should be given the same input again. Returns 0, 
+ * or -1 if path is not a snapshot, leaving the UM with no program
+ */
+extern int       um_restore     (Um vm, const char *path);
+
+/*
+ * Starts tracing the UM from the next instruction: the last records - 1
+ * instructions that jumped, mapped or unmapped a segment, or did io are
+ * kept in a ring, which must hold a power of 2 records. Loads and stores
+ * are not, so the segments they used are not in the trace. A records of 
+ * 0 stops tracing. Returns 0, or -1 if records is not a power of 2
+ */
+extern int       um_trace       (Um vm, uint32_t records);
+
+/*
+ * Writes the registers of the UM and its trace to a new file at path,
+ * which umtrace prints. Only makes system calls that are safe in a 
+ * signal handler, so it may be called from one that interrupted um_run 
+ * on the UM's own thread. Returns 0, or -1 if the UM is not being traced
+ * or the file cannot be written
+ */
+extern int       um_trace_dump  (Um vm, const char *path);
+
+/*
+ * Starts writing every byte of input the UM reads from now on to a new 
+ * input log at path, together with the steps the UM had taken when it
+ * read it, as um_steps counts them, end of input included. A path of NULL 
+ * finishes the log. Returns 0, or -1 if the log cannot be opened or, 
+ * when finishing it, could not all be written
+ */
+extern int       um_record_input (Um vm, const char *path);
+
+/*
+ * Reads the whole input log at path into memory and gives it to the UM
+ * as its input from now on, byte for byte, without calling the read 
+ * callback or reading standard input. The input ends where the log does.
+ * The UM faults if it reads a byte after other than the steps it read it
+ * after when the log was recorded, except for the bytes that a restored
+ * UM throws away. A path of NULL goes back to 
+ * the read callback. Returns 0, or -1 if path is not an input log
+ */
+extern int       um_replay_input (Um vm, const char *path);
+
+/*
+ * Fills in stats for the memory of the UM, which it keeps after it halts
+ * or faults. Walks the segment table and the heap, so it costs time in 
+ * proportion to them. Returns 0, or -1 if the UM has no program
+ */
+extern int       um_memory_stats (Um vm, Um_memory_stats *stats);
+
+/*
+ * Makes a MAPSEG that would take the UM past max_words mapped words or
+ * max_segments live segments fault instead, from now on and for every 
+ * program loaded or restored later, with over_limit set in its stats. 
+ * Either may be UM_NO_LIMIT. Segment 0 counts, but LOADPROG and loading 
+ * a program are not limited. -DUM_GUARDED builds reserve address space 
+ * for a slot per segment the limit allows, and without a segment limit 
+ * allow 16M segments
+ */
+extern void      um_limit_memory (Um vm, uint64_t max_words, 
+                                  uint64_t max_segments);
+
+extern void      um_free        (Um *vm);
+
+#endif
@@ -14,7 +14,14 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 
+#define _DEFAULT_SOURCE
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
 #include "managemem.h"
+#include "fault.h"
 
 
 
@@ -23,22 +30,107 @@
  * * * * * * * * * * * * * * * * * * * * * * * * */
 
 struct Memory {
-        Seq_T segments;
-        Seq_T unused_ids;
+        /* indexed by segment ID, NULL where an ID is unmapped */
+        Segment *segments;
+        uint32_t capacity;
+
+        /* IDs from here up have not been handed out since the table grew
+         * or shrank past them */
+        uint32_t high;
+
+#ifdef UM_GUARDED
+        /* IDs the table has slots for, with one more slot past them */
+        uint32_t reserved;
+#endif
+
+        /* unmapped IDs, the most recently unmapped on top. Entries at or
+         * above high are stale and skipped */
+        uint32_t *free_ids;
+        uint32_t num_free;
+
+        Segheap heap;
+        
+        /* segment 0 decoded once, patched on every store into segment 0 */
+        instruction program;
+        uint32_t program_length;
+
+        /* changes whenever segment 0 is replaced */
+        uint32_t program_version;
+
+        /* while nonzero, segment 0 shares its words with this segment and
+         * whichever of the two is written first gets a copy */
+        Um_segmentID program_source;
+
+        /* while not NULL, segment 0 and the predecoded program are a 
+         * copy-on-write mapping of this image */
+        Image image;
+
+        /* while not NULL, a snapshot that some segments were restored 
+         * into, mapped privately so that writes to them are not saved */
+        void *snapshot;
+        size_t snapshot_size;
+
+        /* the segments the UM has mapped, counted as it maps them */
+        uint64_t mapped_words;
+        uint64_t peak_words;
+        uint32_t live_segments;
+        uint32_t peak_segments;
+
+        /* what MAPSEG may not go past, and whether it tried to */
+        uint64_t max_words;
+        uint64_t max_segments;
+        int over_limit;
 };
 
+/* 
+ * How a memory is laid out in a snapshot, starting on a multiple of 8 
+ * bytes: this header, the free IDs padded to a multiple of 8 bytes, the
+ * file offset of each segment below high or 0 where an ID is unmapped,
+ * and then each segment with its length in front of its words
+ */
+typedef struct Saved_memory {
+        uint32_t high;
+        uint32_t num_free;
+        uint32_t program_source;
+        uint32_t padding;
+} Saved_memory;
+
+
 
 
+const uint32_t INITIAL_TABLE_SIZE = 128;
 
-const unsigned INITAL_SEQUENCE_SIZE = 100;
+/* 
+ * -DUM_GUARDED builds reserve a slot in the segment table up front for 
+ * every ID below the segment limit, or below GUARDED_SEGMENTS for a UM 
+ * without one, so that an ID can be looked up without checking it first.
+ * IDs past that all read the slot after the last, which stays NULL
+ */
+#ifdef UM_GUARDED
+const uint32_t GUARDED_SEGMENTS = 1 << 24;
+#endif
 
 /* * * * * * * * * * * * * * * * * * * * * * * *
  *   F U N C T I O N   D E C L A R A T I O N   *
  * * * * * * * * * * * * * * * * * * * * * * * */
 
-static void initialize_segment(UArray_T segment); 
-static UArray_T copy_segment(UArray_T copied_segment, UArray_T segment_zero);
-static void addSequenceIndices(Memory mem, Um_segmentID nextID);
+static Um_segmentID new_segment_id     (Memory mem);
+static void         release_segment_id (Memory mem, Um_segmentID segID);
+static void         resize_table       (Memory mem, uint32_t capacity);
+#ifdef UM_GUARDED
+static void         reserve_table      (Memory mem, uint32_t slots);
+#endif
+static Segment      mapped_segment     (Memory mem, Um_segmentID segID);
+static void         unshare_segment    (Memory mem, Um_segmentID segID);
+static void         add_segment        (Memory mem, uint32_t length);
+static void         remove_segment     (Memory mem, uint32_t length);
+static unsigned     size_bucket        (uint32_t length);
+static void         drop_image         (Memory mem);
+static int          restore_segments   (Memory mem, uint8_t *view, 
+                                        size_t size, size_t offset);
+static size_t       padded             (size_t size);
+static int          write_bytes        (FILE *file, const void *bytes, 
+                                        size_t size);
 
 
 /* * * * * * * * * * * * * * * * * * 
@@ -48,206 +140,823 @@ static void addSequenceIndices(Memory mem, Um_segmentID nextID);
 extern Memory initialize_memory() {
         
         Memory mem = malloc(sizeof(*mem)); 
-        mem->segments = Seq_new(INITAL_SEQUENCE_SIZE);
-        assert(mem->segments);
-        
-        mem->unused_ids = Seq_new(INITAL_SEQUENCE_SIZE);
-        assert(mem->unused_ids);
-     
-        addSequenceIndices(mem, 0);
+        assert(mem);
+
+        mem->segments = NULL;
+        mem->free_ids = NULL;
+        mem->high = 0;
+
+#ifdef UM_GUARDED
+        /* unmapped IDs read as NULL, which fault.c catches on use */
+        reserve_table(mem, GUARDED_SEGMENTS);
+        guard_null_segments();
+#endif
+
+        mem->num_free = 0;
+        resize_table(mem, INITIAL_TABLE_SIZE);
+
+        mem->heap = segheap_new();
+
+        mem->program = NULL;
+        mem->program_length = 0;
+        mem->program_version = 0;
+        mem->program_source = 0;
+        mem->image = NULL;
+        mem->snapshot = NULL;
+        mem->snapshot_size = 0;
+
+        mem->mapped_words = 0;
+        mem->peak_words = 0;
+        mem->live_segments = 0;
+        mem->peak_segments = 0;
+        mem->max_words = UM_NO_LIMIT;
+        mem->max_segments = UM_NO_LIMIT;
+        mem->over_limit = 0;
         
         return mem;
         
 }
 
-/* Adds additional sequences once unused_id and segment sequences 
- * have been filled 
+/* Returns the most recently unmapped ID, or a fresh one if there is none */
+static Um_segmentID new_segment_id(Memory mem)
+{
+        while ( mem->num_free > 0 ) {
+                Um_segmentID segID = mem->free_ids[--mem->num_free];
+
+                if ( segID < mem->high ) {
+                        return segID;
+                }
+        }
+
+        if ( mem->high == mem->capacity ) {
+                assert(mem->capacity <= UINT32_MAX / 2);
+                resize_table(mem, mem->capacity * 2);
+        }
+        return mem->high++;
+}
+
+/* 
+ * Makes an unmapped ID available again. Unmapping the highest ID instead
+ * gives back every free slot at the end of the table, and the table
+ * shrinks once it is mostly unused
  */
-void addSequenceIndices(Memory mem, Um_segmentID nextID) {
+static void release_segment_id(Memory mem, Um_segmentID segID)
+{
+        mem->segments[segID] = NULL;
 
-        unsigned i;     
-        for ( i = 0; i < INITAL_SEQUENCE_SIZE; i++ ) {
-                Seq_addhi(mem->segments, NULL);
+        if ( segID + 1 != mem->high ) {
+                mem->free_ids[mem->num_free++] = segID;
+                return;
         }
-        
-        for ( i = 0; i < INITAL_SEQUENCE_SIZE; i++ ) {       
-                Seq_addhi(mem->unused_ids, (void *)(uintptr_t)nextID);
-                nextID++;
+
+        while ( mem->high > 0 && mem->segments[mem->high - 1] == NULL ) {
+                mem->high--;
+        }
+
+        if ( mem->capacity > INITIAL_TABLE_SIZE && 
+             mem->high < mem->capacity / 4 ) {
+                resize_table(mem, mem->capacity / 2);
+        }
+}
+
+/* Reallocates the segment table and free ID stack to hold capacity IDs */
+static void resize_table(Memory mem, uint32_t capacity)
+{
+        uint32_t i;
+        uint32_t kept = 0;
+
+        /* drop stale IDs so that the stack fits the smaller table */
+        for ( i = 0; i < mem->num_free; i++ ) {
+                if ( mem->free_ids[i] < mem->high ) {
+                        mem->free_ids[kept++] = mem->free_ids[i];
+                }
+        }
+        mem->num_free = kept;
+
+#ifndef UM_GUARDED
+        mem->segments = realloc(mem->segments, 
+                                capacity * sizeof(*mem->segments));
+#endif
+        mem->free_ids = realloc(mem->free_ids, 
+                                capacity * sizeof(*mem->free_ids));
+        assert(mem->segments && mem->free_ids);
+
+        /* slots from high up are filled in as their IDs are handed out */
+        mem->capacity = capacity;
+}
+
+#ifdef UM_GUARDED
+/* 
+ * Reserves table slots for IDs below slots, which must not be below high,
+ * and moves the slots in use over from the table it replaces
+ */
+static void reserve_table(Memory mem, uint32_t slots)
+{
+        Segment *segments = mmap(NULL, ((size_t)slots + 1) * sizeof(Segment),
+                                 PROT_READ | PROT_WRITE, 
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                 -1, 0);
+        assert(segments != MAP_FAILED && slots >= mem->high);
+
+        if ( mem->segments != NULL ) {
+                memcpy(segments, mem->segments, 
+                       mem->high * sizeof(*segments));
+                munmap(mem->segments, 
+                       ((size_t)mem->reserved + 1) * sizeof(Segment));
+        }
+        mem->segments = segments;
+        mem->reserved = slots;
+}
+#endif
+
+/* 
+ * Decodes all of segment zero so that instructions are not decoded again 
+ * each time they are executed, and fuses common sequences into 
+ * superinstructions. Must be called once segment zero is loaded
+ */
+extern void predecode_program(Memory mem)
+{
+        Segment segment_zero = mem->segments[0];
+        assert(segment_zero);
+
+        uint32_t length = segment_zero->length;
+
+        free(mem->program);
+        mem->program = malloc((length + 1) * sizeof(*mem->program));
+        assert(mem->program);
+        mem->program_length = length;
+        mem->program_version++;
+
+        decode_program(segment_zero->words, length, mem->program);
+}
+
+/*
+ * Makes a UM binary of size bytes segment zero of a memory that has no 
+ * segments yet. Its words and predecoded instructions are shared with 
+ * other memories that loaded the same words, until they are written, 
+ * and are taken from the image cache file at cache_path if it is not 
+ * NULL and holds them. Returns 0, or -1 if the image could not be built
+ */
+extern int load_image(Memory mem, const void *bytes, size_t size,
+                      const char *cache_path)
+{
+        assert(mem->high == 0 && mem->program == NULL);
+
+        mem->image = image_acquire(bytes, size, cache_path);
+        if ( mem->image == NULL ) {
+                return -1;
+        }
+
+        Segment segment = image_map(mem->image, &mem->program);
+        if ( segment == NULL ) {
+                image_release(&mem->image);
+                return -1;
+        }
+
+        Um_segmentID segID = new_segment_id(mem);
+
+        mem->segments[segID] = segment;
+        mem->program_length = mem->segments[segID]->length;
+        mem->program_version++;
+        add_segment(mem, mem->program_length);
+        return 0;
+}
+
+/*
+ * Writes every mapped segment and the free IDs to file, starting at its
+ * current position, which must be a multiple of 8. Segment 0 is written 
+ * once even while it shares its words. Returns 0, or -1 if a write fails
+ */
+extern int save_memory(Memory mem, FILE *file)
+{
+        Saved_memory saved = { 0, 0, mem->program_source, 0 };
+        uint32_t high = mem->high;
+        uint32_t i;
+
+        saved.high = high;
+        for ( i = 0; i < mem->num_free; i++ ) {
+                saved.num_free += mem->free_ids[i] < high;
+        }
+
+        size_t ids_size = saved.num_free * sizeof(uint32_t);
+        uint64_t *offsets = calloc(high, sizeof(*offsets));
+        uint64_t next = (uint64_t)ftell(file) + sizeof(saved) + 
+                        padded(ids_size) + (uint64_t)high * sizeof(*offsets);
+        assert(offsets);
+
+        for ( i = 0; i < high; i++ ) {
+                Segment segment = mem->segments[i];
+
+                if ( segment != NULL && 
+                     (i != 0 || mem->program_source == 0) ) {
+                        offsets[i] = next;
+                        next += padded(sizeof(*segment) + 
+                                       segment->length * sizeof(uint32_t));
+                }
+        }
+        offsets[0] = offsets[mem->program_source];
+
+        /* the stack keeps its order, so IDs are handed out as before */
+        int failed = write_bytes(file, &saved, sizeof(saved));
+
+        for ( i = 0; i < mem->num_free; i++ ) {
+                if ( mem->free_ids[i] < high ) {
+                        failed |= write_bytes(file, &mem->free_ids[i], 
+                                              sizeof(uint32_t));
+                }
+        }
+        failed |= write_bytes(file, NULL, padded(ids_size) - ids_size);
+        failed |= write_bytes(file, offsets, high * sizeof(*offsets));
+
+        for ( i = 0; i < high && !failed; i++ ) {
+                Segment segment = mem->segments[i];
+
+                if ( segment == NULL || (i == 0 && mem->program_source != 0) ) {
+                        continue;
+                }
+
+                struct Segment header = { segment->length, FOREIGN_CLASS };
+                size_t size = sizeof(header) + 
+                              (size_t)segment->length * sizeof(uint32_t);
+
+                failed |= write_bytes(file, &header, sizeof(header));
+                failed |= write_bytes(file, segment->words, 
+                                      size - sizeof(header));
+                failed |= write_bytes(file, NULL, padded(size) - size);
+        }
+
+        free(offsets);
+        return failed ? -1 : 0;
+}
+
+/*
+ * Returns a memory whose segments are those saved at offset in a snapshot
+ * mapped privately at view, which it unmaps once it is freed. Segments 
+ * stay where they are in the mapping, so pages are only read from the 
+ * file when the UM touches them. Returns NULL if the snapshot does not 
+ * hold a whole memory
+ */
+extern Memory restore_memory(void *view, size_t size, size_t offset)
+{
+        Memory mem = initialize_memory();
+
+        if ( restore_segments(mem, view, size, offset) != 0 ) {
+                /* nothing restored belongs to the heap */
+                mem->high = 0;
+                free_memory(mem);
+                return NULL;
+        }
+
+        mem->snapshot = view;
+        mem->snapshot_size = size;
+        predecode_program(mem);
+
+        uint32_t i;
+
+        for ( i = 0; i < mem->high; i++ ) {
+                if ( mem->segments[i] != NULL ) {
+                        add_segment(mem, mem->segments[i]->length);
+                }
+        }
+        return mem;
+}
+
+/* 
+ * Returns the predecoded instructions of segment zero and their number. The
+ * array stays valid until segment zero is replaced by load_program
+ */
+extern instruction program_instructions(Memory mem, uint32_t *length)
+{
+        assert(mem->program);
+        *length = mem->program_length;
+        return mem->program;
+}
+
+/* 
+ * Returns a number that changes every time segment zero is replaced, so 
+ * that anything holding on to its predecoded instructions can tell they 
+ * are stale
+ */
+extern uint32_t program_version(Memory mem)
+{
+        return mem->program_version;
+}
+
+extern Memory_layout memory_layout(void)
+{
+        Memory_layout layout = {
+                offsetof(struct Memory, segments),
+                offsetof(struct Memory, high),
+                offsetof(struct Memory, program_source)
+        };
+        return layout;
+}
+
+/* 
+ * Fills in stats for a memory. Only what limits and peaks need is kept 
+ * up to date as the UM runs: the rest is found by walking the segment 
+ * table and heap
+ */
+extern void memory_stats(Memory mem, Um_memory_stats *stats)
+{
+        uint64_t heap_words = 0;
+        uint32_t i;
+
+        stats->mapped_words = mem->mapped_words;
+        stats->peak_mapped_words = mem->peak_words;
+        stats->live_segments = mem->live_segments;
+        stats->peak_live_segments = mem->peak_segments;
+        memset(stats->segment_sizes, 0, sizeof(stats->segment_sizes));
+
+        stats->id_capacity = mem->capacity;
+        stats->id_high = mem->high;
+        stats->free_ids = 0;
+        for ( i = 0; i < mem->num_free; i++ ) {
+                stats->free_ids += mem->free_ids[i] < mem->high;
+        }
+
+        /* -DUM_GUARDED builds only touch the table as far as high */
+#ifdef UM_GUARDED
+        stats->table_bytes = (uint64_t)mem->high * sizeof(Segment);
+#else
+        stats->table_bytes = (uint64_t)mem->capacity * sizeof(Segment);
+#endif
+        stats->table_bytes += (uint64_t)mem->capacity * sizeof(uint32_t);
+
+        /* a program mapped from an image is shared with other UMs */
+        stats->program_bytes = 0;
+        if ( mem->image == NULL && mem->program != NULL ) {
+                stats->program_bytes = ((uint64_t)mem->program_length + 1) *
+                                       sizeof(*mem->program);
+        }
+
+        segheap_stats(mem->heap, &stats->heap_bytes, 
+                      &stats->heap_free_bytes);
+
+        for ( i = 0; i < mem->high; i++ ) {
+                Segment segment = mem->segments[i];
+
+                if ( segment == NULL ) {
+                        continue;
+                }
+                stats->segment_sizes[size_bucket(segment->length)]++;
+
+                /* segment 0 is not in the heap while it is in an image 
+                 * or shares the words of its source */
+                if ( segment->size_class != FOREIGN_CLASS &&
+                     (i != 0 || (mem->image == NULL && 
+                                 mem->program_source == 0)) ) {
+                        heap_words += segment->length;
+                }
+        }
+
+        stats->overhead_bytes = stats->heap_bytes + stats->table_bytes - 
+                                heap_words * sizeof(uint32_t);
+        stats->over_limit = mem->over_limit;
+}
+
+/* Makes MAPSEG fault rather than go past max_words or max_segments */
+extern void limit_memory(Memory mem, uint64_t max_words, 
+                         uint64_t max_segments)
+{
+        mem->max_words = max_words;
+        mem->max_segments = max_segments;
+
+#ifdef UM_GUARDED
+        uint64_t slots = max_segments == UM_NO_LIMIT ? GUARDED_SEGMENTS
+                                                     : max_segments;
+
+        if ( slots > UINT32_MAX ) {
+                slots = UINT32_MAX;
+        }
+        if ( slots < mem->high ) {
+                slots = mem->high;
         }
+        if ( slots != mem->reserved ) {
+                reserve_table(mem, slots);
+        }
+#endif
+}
+
+/* 
+ * Returns the segment with an ID, failing a check if it is not mapped. 
+ * -DUM_GUARDED builds check neither the ID nor the segment here: an 
+ * unmapped ID gives NULL, and the first read of the length of the NULL
+ * segment faults on the page at address 0, which fault.c turns into a 
+ * failed check. IDs past the reserved slots read the NULL slot after them
+ */
+static inline Segment mapped_segment(Memory mem, Um_segmentID segID)
+{
+#ifdef UM_GUARDED
+        return mem->segments[segID < mem->reserved ? segID : mem->reserved];
+#else
+        check(segID < mem->high);
+
+        Segment segment = mem->segments[segID];
+
+        check(segment);
+        return segment;
+#endif
 }
 
-/* Retrieves 32 bit codeword from segment zero */
-extern Um_instruction fetch_instruction(uint32_t *program_counter, Memory mem) 
+/* Returns the address of word offset of a mapped segment, for loading */
+extern uint32_t *segment_word(Memory mem, Um_segmentID segID, 
+                              uint32_t offset)
 {
-        UArray_T segment_zero = Seq_get(mem->segments, 0);
-        assert(*program_counter < (unsigned)UArray_length(segment_zero));
-           
-        Um_instruction instruct = *((Um_instruction*)UArray_at(segment_zero,
-                                                            *program_counter));
+        Segment segment = mapped_segment(mem, segID);
+
+        check(offset < segment->length);
 
-                                                            
-        return instruct;
+        return &segment->words[offset];
+}
+
+/* 
+ * Returns the address of word offset of a mapped segment, for storing. 
+ * Stores into segment 0 must go through store_word instead so that the
+ * predecoded program follows them
+ */
+extern uint32_t *writable_segment_word(Memory mem, Um_segmentID segID, 
+                                       uint32_t offset)
+{
+        if ( mem->program_source != 0 ) {
+                unshare_segment(mem, segID);
+        }
+
+        return segment_word(mem, segID, offset);
 }
 
 /* Access segmented memory at segment b offset c and loads into register a*/
 extern void segmented_load(unsigned ra, unsigned rb, unsigned rc, 
-                           UArray_T registers, Memory mem) 
+                           Um_state um) 
 {
-        word register_a = UArray_at(registers, ra); // value
-        word register_b = UArray_at(registers, rb); // seg ID
-        word register_c = UArray_at(registers, rc); // offset
+        Memory mem = um->mem;
+        word register_a = &um->registers[ra]; // value
+        word register_b = &um->registers[rb]; // seg ID
+        word register_c = &um->registers[rc]; // offset
         
-        assert(*register_b < (unsigned)Seq_length(mem->segments));
+        Segment segment = mapped_segment(mem, *register_b);
         
-        UArray_T segment = Seq_get(mem->segments, *register_b);
-        
-        assert(segment);        
+        check(*register_c < segment->length);
 
-        word value = UArray_at(segment, *register_c);
-        
-        *register_a = *value;    
+        *register_a = segment->words[*register_c];
 }
 
 /* Stores value at register c into segmented memory */
 extern void segmented_store(unsigned ra, unsigned rb, unsigned rc, 
-                            UArray_T registers, Memory mem)
+                            Um_state um)
+{
+        store_word(um->mem, um->registers[ra], um->registers[rb], 
+                   um->registers[rc]);
+}
+
+/* 
+ * Stores value at word offset of a mapped segment, keeping segment 0 and 
+ * the segment it shares its words with apart
+ */
+extern void store_word(Memory mem, Um_segmentID segID, uint32_t offset, 
+                       uint32_t value)
 {
-        word register_a = UArray_at(registers, ra); // segment ID
-        word register_b = UArray_at(registers, rb); // offset 
-        word register_c = UArray_at(registers, rc); // value     
-              
-        assert(*register_a < (unsigned)Seq_length(mem->segments)); 
+        /* does nothing to IDs that are not segment 0's */
+        if ( mem->program_source != 0 ) {
+                unshare_segment(mem, segID);
+        }
                
-        UArray_T segment = Seq_get(mem->segments, *register_a);
+        Segment segment = mapped_segment(mem, segID);
         
-        assert(segment);
-        assert(*register_b < (unsigned)UArray_length(segment));
-        word value = UArray_at(segment, *register_b);
+        check(offset < segment->length);
         
-        *value = *register_c;  
+        /* 
+         * keep the predecoded copy of segment zero in step with its words.
+         * Programs often store data into segment zero, and often the same 
+         * value again
+         */
+        if ( segID == 0 && mem->program != NULL &&
+             segment->words[offset] != value ) {
+                redecode_word(value, segment->length, mem->program, offset);
+        }
+
+        segment->words[offset] = value;
 }
 
 /* Creates a new segment with a number of words equal to the value in register 
  * a
  */
-extern void map_segment(unsigned rb, unsigned rc, 
-                        UArray_T registers, Memory mem)
+extern void map_segment(unsigned rb, unsigned rc, Um_state um)
 {
-        uint32_t *seg_length = UArray_at(registers, rc);
+        Memory mem = um->mem;
+        uint32_t *seg_length = &um->registers[rc];
         Um_segmentID curr_ID;
-    
-        UArray_T new_segment = UArray_new(*seg_length, sizeof(*seg_length));
-        assert(new_segment);        
 
-        if( Seq_length(mem->unused_ids) == 1 ) {
-                Um_segmentID nextID = Seq_length(mem->segments);
-                addSequenceIndices(mem, nextID);
-        }       
-        curr_ID = (Um_segmentID)(uintptr_t)Seq_remlo(mem->unused_ids);
-        
-        initialize_segment(new_segment);
+        if ( mem->mapped_words + *seg_length > mem->max_words ||
+             mem->live_segments >= mem->max_segments ) {
+                mem->over_limit = 1;
+                fault();
+        }
+
+#ifdef UM_GUARDED
+        /* every ID below the live segments is in use, so a new one is 
+         * below them too only while they are fewer than the slots */
+        if ( mem->live_segments >= mem->reserved ) {
+                mem->over_limit = 1;
+                fault();
+        }
+#endif
+        /* the heap hands back segments already filled with 0 */
+        Segment new_segment = segment_new(mem->heap, *seg_length);
+
+        if ( new_segment == NULL ) {
+                mem->over_limit = 1;
+                fault();
+        }
+        add_segment(mem, *seg_length);
+
+        curr_ID = new_segment_id(mem);
      
-        Seq_put(mem->segments, curr_ID, new_segment);
+        mem->segments[curr_ID] = new_segment;
       
                
-        word rb_register = UArray_at(registers, rb);
-        *rb_register = curr_ID;
+        um->registers[rb] = curr_ID;
         
        
 }
-/* initializes segment to hold words containing 0 */
-static void initialize_segment(UArray_T segment) 
-{
-        uint32_t i;
-        for ( i = 0; i < (uint32_t)UArray_length(segment); i++ ) {
-                word value = UArray_at(segment, i);
-                *value = 0;      
-        }
-}
-
 /* Frees segmented memory associated with segID at register ra, then stores 
  * segID for later use 
  */
-extern void unmap_segment(unsigned rc, UArray_T registers, Memory mem)
+extern void unmap_segment(unsigned rc, Um_state um)
 {
         
-        
-        Um_segmentID segID = *((Um_segmentID *)(UArray_at(registers, rc)));
+        Memory mem = um->mem;
+        Um_segmentID segID = um->registers[rc];
   
-        assert((segID < (unsigned)Seq_length(mem->segments)) && segID != 0 );
+        check(segID < mem->high && segID != 0);
         
-        UArray_T removed_segment = (UArray_T)Seq_get(mem->segments, segID);
-        assert(removed_segment);
+        Segment removed_segment = mem->segments[segID];
+        check(removed_segment);
 
-        UArray_free(&removed_segment);
-        
-        Seq_put(mem->segments, segID, NULL);
+        remove_segment(mem, removed_segment->length);
 
-        Seq_addlo(mem->unused_ids, (void *)(uintptr_t)segID);        
+        /* segment 0 keeps the words it shared */
+        if ( segID == mem->program_source ) {
+                mem->program_source = 0;
+        } else {
+                segment_free(mem->heap, removed_segment);
+        }
+        
+        release_segment_id(mem, segID);
 }
 
-/* Segmented memory associated with segID at register ra is duplicated and
- * stored into segment zero 
+/* Segmented memory associated with segID at register rb replaces segment
+ * zero. The two share their words until either one is written, so none
+ * are copied here. A segment that segment 0 does not already share is 
+ * still decoded in full, in time linear in its length; only a jump within
+ * segment 0, or loading the segment it shares again, takes constant time
  */
-extern void load_program(unsigned rb, unsigned rc, UArray_T registers, 
-                        Memory mem, uint32_t *program_counter)
+extern void load_program(unsigned rb, unsigned rc, Um_state um)
 {                
-        uint32_t *value_c = UArray_at(registers, rc);
-        *program_counter = *value_c;
-        
-        Um_segmentID segID = *((Um_segmentID *)UArray_at(registers, rb));   
+        Memory mem = um->mem;
+        uint32_t target = um->registers[rc];
+        Um_segmentID segID = um->registers[rb];   
         
-        if ( segID == 0 ) {
+        /* everything is checked before the UM changes, so that a fault 
+         * leaves it on the LOADPROG for the report */
+        if ( segID == 0 || segID == mem->program_source ) {
+                check(target < mem->program_length);
+                um->program_counter = target;
                 return;
         }
         
-        UArray_T copied_segment = (Seq_get(mem->segments, segID));
-        assert(copied_segment);
+        check(segID < mem->high);
+
+        Segment copied_segment = mem->segments[segID];
+        check(copied_segment);
+        check(target < copied_segment->length);
         
-        UArray_T segment_zero = (Seq_get(mem->segments, 0));
-    
+        Segment segment_zero = mem->segments[0];
+
         if ( segment_zero != NULL ) {
-                UArray_free(&segment_zero);
+                remove_segment(mem, segment_zero->length);
+        }
+        add_segment(mem, copied_segment->length);
+    
+        if ( mem->image != NULL ) {
+                drop_image(mem);
+        } else if ( segment_zero != NULL && mem->program_source == 0 ) {
+                segment_free(mem->heap, segment_zero);
         }
         
-        segment_zero = copy_segment(copied_segment, segment_zero);
-        
+        mem->segments[0] = copied_segment;
+        mem->program_source = segID;
+
+        predecode_program(mem);
+        um->program_counter = target;
 }
 
-/* Copies the value of one segment into segment zero */
-static UArray_T copy_segment(UArray_T copied_segment, UArray_T segment_zero)
+/* Gives the segment about to be written its own copy of the shared words */
+static void unshare_segment(Memory mem, Um_segmentID segID)
 {
-        int i;
-        int segment_length = UArray_length(copied_segment);
-        
-        segment_zero = UArray_new(segment_length, UArray_size(copied_segment));
-        
-        for ( i = 0; i < segment_length; i++ ) {
-                word value = *((word*)UArray_at(copied_segment, i));
-               
-                word *duplicate_value = (word *)UArray_at(segment_zero, i);
-                *duplicate_value = value;
+        if ( segID != 0 && segID != mem->program_source ) {
+                return;
+        }
+
+        Segment shared = mem->segments[0];
+        Segment copy = segment_new(mem->heap, shared->length);
+
+        if ( copy == NULL ) {
+                mem->over_limit = 1;
+                fault();
+        }
+        memcpy(copy->words, shared->words, shared->length * sizeof(uint32_t));
+        mem->segments[segID] = copy;
+        mem->program_source = 0;
+}
+
+/* Counts a segment the UM has mapped, and the peaks it reaches */
+static inline void add_segment(Memory mem, uint32_t length)
+{
+        mem->mapped_words += length;
+        mem->live_segments++;
+
+        if ( mem->mapped_words > mem->peak_words ) {
+                mem->peak_words = mem->mapped_words;
+        }
+        if ( mem->live_segments > mem->peak_segments ) {
+                mem->peak_segments = mem->live_segments;
         }
-        return segment_zero;
+}
+
+static inline void remove_segment(Memory mem, uint32_t length)
+{
+        mem->mapped_words -= length;
+        mem->live_segments--;
+}
+
+/* Returns the number of bits in length, the bucket it is counted in */
+static unsigned size_bucket(uint32_t length)
+{
+        return length == 0 ? 0 : 32 - __builtin_clz(length);
+}
+
+/* 
+ * Points the segment table of an empty memory at the segments saved in a
+ * snapshot, checking that each lies within it. Returns 0, or -1 if the
+ * snapshot is cut short or inconsistent
+ */
+static int restore_segments(Memory mem, uint8_t *view, size_t size, 
+                            size_t offset)
+{
+        Saved_memory saved;
+        uint32_t capacity = INITIAL_TABLE_SIZE;
+        uint32_t i;
+
+        if ( size < offset || size - offset < sizeof(saved) ) {
+                return -1;
+        }
+        memcpy(&saved, view + offset, sizeof(saved));
+        offset += sizeof(saved);
+
+        size_t ids_size = padded(saved.num_free * sizeof(uint32_t));
+        uint64_t table_size = (uint64_t)saved.high * sizeof(uint64_t);
+
+        if ( saved.high == 0 || saved.high > UINT32_MAX / 2 + 1 ||
+             saved.num_free >= saved.high ||
+             saved.program_source >= saved.high || 
+             size - offset < ids_size + table_size ) {
+                return -1;
+        }
+
+        while ( capacity < saved.high ) {
+                capacity *= 2;
+        }
+        resize_table(mem, capacity);
+
+#ifdef UM_GUARDED
+        if ( saved.high > mem->reserved ) {
+                reserve_table(mem, saved.high);
+        }
+#endif
+
+        const uint32_t *free_ids = (const uint32_t *)(view + offset);
+        const uint64_t *offsets = (const uint64_t *)(view + offset + 
+                                                     ids_size);
+
+        for ( i = 0; i < saved.high; i++ ) {
+                uint64_t at = offsets[i];
+
+                mem->segments[i] = NULL;
+                if ( at == 0 ) {
+                        continue;
+                }
+                if ( at % 8 != 0 || at > size - sizeof(struct Segment) ) {
+                        return -1;
+                }
+
+                Segment segment = (Segment)(view + at);
+
+                if ( segment->size_class != FOREIGN_CLASS || 
+                     (size - at - sizeof(*segment)) / sizeof(uint32_t) < 
+                     segment->length ) {
+                        return -1;
+                }
+                mem->segments[i] = segment;
+        }
+        mem->high = saved.high;
+
+        /* each free ID is marked as it is taken, so that one listed twice
+         * is caught, and the marks are cleared again afterwards */
+        uint32_t taken;
+
+        for ( taken = 0; taken < saved.num_free; taken++ ) {
+                Um_segmentID segID = free_ids[taken];
+
+                if ( segID >= saved.high || mem->segments[segID] != NULL ) {
+                        break;
+                }
+                mem->segments[segID] = (Segment)view;
+                mem->free_ids[taken] = segID;
+        }
+        for ( i = 0; i < taken; i++ ) {
+                mem->segments[mem->free_ids[i]] = NULL;
+        }
+        if ( taken < saved.num_free ) {
+                return -1;
+        }
+        mem->num_free = saved.num_free;
+
+        if ( mem->segments[0] == NULL ||
+             (saved.program_source != 0 && 
+              mem->segments[0] != mem->segments[saved.program_source]) ) {
+                return -1;
+        }
+        mem->program_source = saved.program_source;
+
+        return 0;
+}
+
+/* Rounds size up to a multiple of 8, so that what follows is aligned */
+static size_t padded(size_t size)
+{
+        return (size + 7) & ~(size_t)7;
+}
+
+/* 
+ * Writes size bytes, or size zeros if bytes is NULL. Returns 0, or 1 if 
+ * they could not all be written
+ */
+static int write_bytes(FILE *file, const void *bytes, size_t size)
+{
+        static const uint8_t zeros[8];
+
+        if ( bytes == NULL ) {
+                assert(size <= sizeof(zeros));
+                bytes = zeros;
+        }
+        return size > 0 && fwrite(bytes, 1, size, file) != size;
+}
+
+/* Unmaps a segment zero loaded by load_image */
+static void drop_image(Memory mem)
+{
+        image_unmap(mem->image, mem->segments[0]);
+        image_release(&mem->image);
+
+        mem->segments[0] = NULL;
+        mem->program = NULL;
 }
 
 /* If you love it, set it free */
 extern void free_memory(Memory mem) {
         
 
-        int i;
+        uint32_t i;
+
+        /* shared words belong to the source segment */
+        if ( mem->program_source != 0 ) {
+                mem->segments[0] = NULL;
+        }
+        if ( mem->image != NULL ) {
+                drop_image(mem);
+        }
         
-        for (i = 0; i < Seq_length(mem->segments); i++) {
-                if (Seq_get(mem->segments, i) != NULL) {
-                        UArray_T segment = Seq_get(mem->segments, i); 
-                        UArray_free(&segment);
+        for (i = 0; i < mem->high; i++) {
+                if (mem->segments[i] != NULL) {
+                        segment_free(mem->heap, mem->segments[i]);
                 }
         }
         
 
         
-        Seq_free(&(mem->segments));
-        Seq_free(&(mem->unused_ids));
+#ifdef UM_GUARDED
+        munmap(mem->segments, ((size_t)mem->reserved + 1) * sizeof(Segment));
+#else
+        free(mem->segments);
+#endif
+        free(mem->free_ids);
+        segheap_free(&mem->heap);
+        free(mem->program);
+
+        if ( mem->snapshot != NULL ) {
+                munmap(mem->snapshot, mem->snapshot_size);
+        }
         
         free(mem);
 }
@@ -14,6 +14,9 @@
  *                                                                   *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#ifndef MANAGEMEM_INCLUDED
+#define MANAGEMEM_INCLUDED
+
 /* * * * * * * * * * * * * *
  *   D I R E C T I V E S   *
  * * * * * * * * * * * * * */
@@ -21,10 +24,13 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-#include "uarray.h"
-#include "seq.h"
 #include "assert.h"
 #include "bitpack.h"
+#include "decoder.h"
+#include "state.h"
+#include "segheap.h"
+#include "image.h"
+#include "libum.h"
 
 
 typedef uint32_t Um_instruction;
@@ -33,6 +39,17 @@ typedef uint32_t Um_segmentID;
 
 typedef struct Memory *Memory;
 
+/* 
+ * Where a Memory keeps its segment table, the IDs below which the table
+ * may hold a segment, and the segment that segment 0 shares its words 
+ * with, for translated code that looks segments up itself
+ */
+typedef struct Memory_layout {
+        size_t segments;
+        size_t high;
+        size_t program_source;
+} Memory_layout;
+
 
 // TODO: MOVE THIS STRUCTURE DECLARATION
 
@@ -45,23 +62,50 @@ typedef struct Memory *Memory;
 
 extern Memory initialize_memory();
 
-extern Um_instruction fetch_instruction(uint32_t *program_counter, Memory mem);
+extern void predecode_program(Memory mem);
+
+extern int  load_image(Memory mem, const void *bytes, size_t size,
+                       const char *cache_path);
+
+extern int save_memory(Memory mem, FILE *file);
+
+extern Memory restore_memory(void *view, size_t size, size_t offset);
+
+extern instruction program_instructions(Memory mem, uint32_t *length);
+
+extern uint32_t program_version(Memory mem);
+
+extern Memory_layout memory_layout(void);
+
+extern void memory_stats(Memory mem, Um_memory_stats *stats);
+
+extern void limit_memory(Memory mem, uint64_t max_words, 
+                         uint64_t max_segments);
+
+extern uint32_t *segment_word(Memory mem, Um_segmentID segID, 
+                              uint32_t offset);
+
+extern uint32_t *writable_segment_word(Memory mem, Um_segmentID segID, 
+                                       uint32_t offset);
+
+extern void store_word(Memory mem, Um_segmentID segID, uint32_t offset,
+                       uint32_t value);
 
 
 /*   U M   I N S T R U C T I O N S   */
 
 extern void segmented_load  (unsigned ra, unsigned rb, unsigned rc, 
-                             UArray_T registers, Memory mem);
+                             Um_state um);
 
 extern void segmented_store (unsigned ra, unsigned rb, unsigned rc, 
-                             UArray_T registers, Memory mem);
+                             Um_state um);
+
+extern void map_segment     (unsigned rb, unsigned rc, Um_state um);
 
-extern void map_segment     (unsigned ra, unsigned rb, 
-                             UArray_T registers, Memory mem);
+extern void unmap_segment   (unsigned rc, Um_state um);
 
-extern void unmap_segment   (unsigned ra, UArray_T registers, Memory mem);
+extern void load_program    (unsigned rb, unsigned rc, Um_state um);
 
-extern void load_program    (unsigned ra, unsigned rb, UArray_T registers, 
-                             Memory mem, uint32_t *program_counter);
+extern void free_memory     (Memory mem);
 
-extern void free_memory     (Memory mem);
\ No newline at end of file
+#endif
@@ -0,0 +1,283 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                              profile                              *
+ *                                                                   *
+ *                File: profile.c                                    *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Executes the UM one instruction at a time    *
+ *                      like the switch interpreter, counting every  *
+ *                      instruction by opcode and by its position in *
+ *                      segment 0. The counts by position start over *
+ *                      whenever LOADPROG replaces segment 0, and    *
+ *                      the report keeps one set for each program.   *
+ *                      Superinstructions are run one word at a time *
+ *                      so that the counts stay exact, and are       *
+ *                      counted on their own                         *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <time.h>
+#include <setjmp.h>
+
+#include "profile.h"
+#include "interpret.h"
+#include "fault.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   S T R U C T U R E   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/* opcodes that a UM word can hold, below the superinstructions */
+#define NUM_WORD_OPCODES MOVE
+#define NUM_FUSED        (NUM_OPCODES - NUM_WORD_OPCODES)
+
+static const char *const OPCODE_NAMES[NUM_OPCODES] = {
+        "condmove", "segload", "segstore", "add", "multiply", "divide", 
+        "nand", "halt", "mapseg", "unmapseg", "output", "input", 
+        "loadprog", "loadval", "illegal14", "illegal15", 
+        "move", "and", "sub", "sub_nand", "loadval_segload", 
+        "loadval_segstore"
+};
+
+/* 
+ * The counts so far, kept off the stack so that they are still there 
+ * when a fault jumps back to profile
+ */
+typedef struct Profile {
+        FILE *report;
+        uint64_t counts[NUM_WORD_OPCODES];
+        uint64_t fused[NUM_FUSED];
+        uint64_t program_loads;
+
+        /* counts by program counter of the program in segment 0, with 
+         * one more for the illegal word after its end */
+        uint64_t *hits;
+        uint32_t length;
+} *Profile;
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * */
+
+static Um_status count_instructions (Um_state um, Profile counted);
+
+static void write_report (Profile counted, double seconds, int faulted);
+
+static void write_hits (FILE *report, const uint64_t *hits, 
+                        uint32_t length, int first);
+
+static double seconds_since (const struct timespec *start);
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+/* 
+ * Runs the UM until it halts, faults or waits for input, then writes the
+ * rest of the report and closes it. A fault is caught here so that the 
+ * report is finished and the counts freed, and then faults again for the
+ * caller
+ */
+extern Um_status profile(Um_state um, FILE *report)
+{
+        Profile counted = calloc(1, sizeof(*counted));
+        assert(counted);
+
+        counted->report = report;
+        program_instructions(um->mem, &counted->length);
+        counted->hits = calloc(counted->length + 1, sizeof(*counted->hits));
+        assert(counted->hits);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        fprintf(report, "{\n  \"programs\": [");
+
+        volatile Um_status status = UM_FAULT;
+        jmp_buf handler;
+        jmp_buf *previous = catch_faults(&handler);
+
+        if ( setjmp(handler) == 0 ) {
+                status = count_instructions(um, counted);
+        }
+        catch_faults(previous);
+
+        write_report(counted, seconds_since(&start), status == UM_FAULT);
+        fclose(report);
+        free(counted->hits);
+        free(counted);
+
+        if ( status == UM_FAULT ) {
+                fault();
+        }
+        return status;
+}
+
+/* 
+ * Executes the UM one word at a time. The counts by program counter are 
+ * written out as each program is replaced, so they come first in the 
+ * report. Every word that runs is added to the steps of the UM, as 
+ * um_run adds them
+ */
+static Um_status count_instructions(Um_state um, Profile counted)
+{
+        /* words left of the superinstruction being run word by word */
+        unsigned covered = 0;
+
+        instruction program = program_instructions(um->mem, 
+                                                   &counted->length);
+        uint32_t version = program_version(um->mem);
+
+        for (;;) {
+                assert(um->program_counter <= counted->length);
+                instruction decoded = &program[um->program_counter];
+                struct instruction first;
+
+                if ( decoded->opcode >= MOVE ) {
+                        if ( covered == 0 ) {
+                                counted->fused[decoded->opcode - MOVE]++;
+                                covered = fused_length(decoded->opcode);
+                        }
+                        unfuse(decoded, &first);
+                        decoded = &first;
+                }
+                if ( covered > 0 ) {
+                        covered--;
+                }
+
+                unsigned opcode = decoded->opcode;
+
+                counted->counts[opcode]++;
+                counted->hits[um->program_counter]++;
+
+                if ( opcode == HALT ) {
+                        um->steps++;
+                        return UM_HALTED;
+                }
+                if ( opcode == IN ) {
+                        um->input_step = um->steps;
+                }
+
+                if ( !execute_instruction(decoded, um) ) {
+                        return UM_WAITING_FOR_INPUT;
+                }
+                um->steps++;
+
+                if ( opcode == LOADPROG && 
+                     program_version(um->mem) != version ) {
+                        write_hits(counted->report, counted->hits, 
+                                   counted->length, 
+                                   counted->program_loads == 0);
+                        counted->program_loads++;
+
+                        program = program_instructions(um->mem, 
+                                                       &counted->length);
+                        version = program_version(um->mem);
+
+                        free(counted->hits);
+                        counted->hits = calloc(counted->length + 1, 
+                                               sizeof(*counted->hits));
+                        assert(counted->hits);
+                }
+        }
+}
+
+/* 
+ * Writes the counts by program counter of the last program and the 
+ * totals, finishing the report
+ */
+static void write_report(Profile counted, double seconds, int faulted)
+{
+        FILE *report = counted->report;
+        const uint64_t *counts = counted->counts;
+        uint64_t instructions = 0;
+        uint64_t dispatches = 0;
+        unsigned i;
+
+        write_hits(report, counted->hits, counted->length, 
+                   counted->program_loads == 0);
+        fprintf(report, "\n  ],\n");
+
+        fprintf(report, "  \"opcodes\": {");
+        for ( i = 0; i < NUM_WORD_OPCODES; i++ ) {
+                instructions += counts[i];
+                fprintf(report, "%s\n    \"%s\": %llu", i == 0 ? "" : ",", 
+                        OPCODE_NAMES[i], (unsigned long long)counts[i]);
+        }
+        fprintf(report, "\n  },\n");
+
+        /* 
+         * superinstructions reached at their first word, and the 
+         * dispatches the interpreter makes once they cover their sequence 
+         */
+        dispatches = instructions;
+        fprintf(report, "  \"superinstructions\": {");
+        for ( i = 0; i < NUM_FUSED; i++ ) {
+                dispatches -= counted->fused[i] * 
+                              (fused_length(MOVE + i) - 1);
+                fprintf(report, "%s\n    \"%s\": %llu", i == 0 ? "" : ",", 
+                        OPCODE_NAMES[MOVE + i], 
+                        (unsigned long long)counted->fused[i]);
+        }
+        fprintf(report, "\n  },\n");
+        fprintf(report, "  \"dispatches\": %llu,\n", 
+                (unsigned long long)dispatches);
+
+        fprintf(report, "  \"events\": {\n");
+        fprintf(report, "    \"map\": %llu,\n", 
+                (unsigned long long)counts[MAPSEG]);
+        fprintf(report, "    \"unmap\": %llu,\n", 
+                (unsigned long long)counts[UNMAPSEG]);
+        fprintf(report, "    \"loadprog\": %llu,\n", 
+                (unsigned long long)counts[LOADPROG]);
+        fprintf(report, "    \"program_replaced\": %llu\n  },\n", 
+                (unsigned long long)counted->program_loads);
+
+        fprintf(report, "  \"faulted\": %s,\n", faulted ? "true" : "false");
+        fprintf(report, "  \"instructions\": %llu,\n", 
+                (unsigned long long)instructions);
+        fprintf(report, "  \"seconds\": %.6f,\n", seconds);
+        fprintf(report, "  \"instructions_per_second\": %.0f\n}\n", 
+                seconds > 0 ? instructions / seconds : 0);
+}
+
+/* 
+ * Writes the counts by program counter of one program as pairs of 
+ * program counter and count, leaving out instructions never executed
+ */
+static void write_hits(FILE *report, const uint64_t *hits, uint32_t length,
+                       int first)
+{
+        uint32_t pc;
+        int first_hit = 1;
+
+        fprintf(report, "%s\n    { \"length\": %u, \"hits\": [", 
+                first ? "" : ",", length);
+
+        for ( pc = 0; pc <= length; pc++ ) {
+                if ( hits[pc] == 0 ) {
+                        continue;
+                }
+                fprintf(report, "%s\n      [%u, %llu]", 
+                        first_hit ? "" : ",", pc, 
+                        (unsigned long long)hits[pc]);
+                first_hit = 0;
+        }
+
+        fprintf(report, "\n    ] }");
+}
+
+static double seconds_since(const struct timespec *start)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (now.tv_sec - start->tv_sec) + 
+               (now.tv_nsec - start->tv_nsec) / 1e9;
+}
@@ -0,0 +1,33 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                              profile                              *
+ *                                                                   *
+ *                File: profile.h                                    *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Header for the profile module, which runs    *
+ *                      the UM in a loop of its own that counts      *
+ *                      executions by opcode and by program counter  *
+ *                      and writes a JSON report when the UM stops.  *
+ *                      um --profile report.json prog.um selects it, *
+ *                      so interpret pays nothing for it             *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef PROFILE_INCLUDED
+#define PROFILE_INCLUDED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "state.h"
+#include "libum.h"
+
+/* 
+ * Writes the report to report, which it closes, even if the UM faults,
+ * and then passes the fault on
+ */
+extern Um_status profile (Um_state um, FILE *report);
+
+#endif
@@ -0,0 +1,487 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                             scheduler                             *
+ *                                                                   *
+ *                File: scheduler.c                                  *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Runs UMs on a pool of worker threads. Every  *
+ *                      worker has a deque of runnable tasks: it     *
+ *                      takes from the front and puts a task whose   *
+ *                      slice ran out at the back, and other workers *
+ *                      steal from the back once their own deques    *
+ *                      are empty. A slice is meant to be many       *
+ *                      thousands of steps, so each deque is guarded *
+ *                      by a plain lock that is seldom contended.    *
+ *                      Workers with nothing to run or steal sleep   *
+ *                      until a task is queued                       *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "assert.h"
+#include "scheduler.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   S T R U C T U R E   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define INITIAL_DEQUE_SIZE 64
+
+/*
+ * A task moves from RUNNABLE to RUNNING when a worker takes it. A wake
+ * while it runs leaves it WOKEN, so that it is queued again rather than
+ * parked if it then asks for input
+ */
+enum { RUNNABLE, RUNNING, PARKED, WOKEN, FINISHED };
+
+struct Sched_task {
+        Um vm;
+        Sched_done done;
+        void *closure;
+        int state;
+
+        /* every task spawned, newest first, so sched_free can free them */
+        Sched_task next_spawned;
+};
+
+/* each worker on its own cache lines, since it locks its deque often */
+typedef struct Worker {
+        Sched sched;
+        pthread_t thread;
+
+        pthread_mutex_t lock;
+        Sched_task *tasks;
+        size_t capacity;
+        size_t front;
+        size_t count;
+} __attribute__((aligned(64))) *Worker;
+
+struct Sched {
+        Worker workers;
+        unsigned num_workers;
+
+        /* workers whose threads were started, for sched_free to join */
+        unsigned started;
+        uint64_t slice;
+
+        /* the worker that the next task queued from outside goes to */
+        unsigned next_worker;
+
+        /* tasks in some deque, and tasks spawned but not finished */
+        uint64_t runnable;
+        uint64_t live;
+
+        Sched_task spawned;
+
+        /* workers sleep on work, sched_wait on finished */
+        pthread_mutex_t lock;
+        pthread_cond_t work;
+        pthread_cond_t finished;
+        unsigned sleeping;
+        int stopping;
+};
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N S   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static void      *work          (void *closure);
+static Sched_task next_task     (Worker worker);
+static void       run           (Worker worker, Sched_task task);
+static void       park          (Worker worker, Sched_task task);
+static void       finish        (Sched sched, Sched_task task,
+                                 Um_status status);
+
+static void       push          (Worker worker, Sched_task task);
+static Sched_task take_front    (Worker worker);
+static Sched_task take_back     (Worker worker);
+static int        wait_for_work (Sched sched);
+static Worker     any_worker    (Sched sched);
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+extern Sched sched_new(unsigned workers, uint64_t slice)
+{
+        Sched sched = malloc(sizeof(*sched));
+        unsigned i;
+
+        assert(sched);
+        assert(slice > 0);
+
+        if ( workers == 0 ) {
+                long cores = sysconf(_SC_NPROCESSORS_ONLN);
+                workers = cores > 0 ? cores : 1;
+        }
+
+        if ( posix_memalign((void **)&sched->workers, 64,
+                            workers * sizeof(*sched->workers)) != 0 ) {
+                free(sched);
+                return NULL;
+        }
+
+        sched->num_workers = workers;
+        sched->started = 0;
+        sched->slice = slice;
+        sched->next_worker = 0;
+        sched->runnable = 0;
+        sched->live = 0;
+        sched->spawned = NULL;
+        sched->sleeping = 0;
+        sched->stopping = 0;
+        pthread_mutex_init(&sched->lock, NULL);
+        pthread_cond_init(&sched->work, NULL);
+        pthread_cond_init(&sched->finished, NULL);
+
+        for ( i = 0; i < workers; i++ ) {
+                Worker worker = &sched->workers[i];
+
+                worker->sched = sched;
+                worker->capacity = INITIAL_DEQUE_SIZE;
+                worker->front = 0;
+                worker->count = 0;
+                worker->tasks = malloc(worker->capacity *
+                                       sizeof(*worker->tasks));
+                assert(worker->tasks);
+                pthread_mutex_init(&worker->lock, NULL);
+        }
+
+        /* every deque is ready before any worker looks at another */
+        for ( i = 0; i < workers; i++ ) {
+                Worker worker = &sched->workers[i];
+
+                if ( pthread_create(&worker->thread, NULL, work,
+                                    worker) != 0 ) {
+                        sched_free(&sched);
+                        return NULL;
+                }
+                sched->started++;
+        }
+
+        return sched;
+}
+
+extern Sched_task sched_spawn(Sched sched, Um vm, Sched_done done,
+                              void *closure)
+{
+        Sched_task task = malloc(sizeof(*task));
+        assert(task);
+
+        task->vm = vm;
+        task->done = done;
+        task->closure = closure;
+        task->state = RUNNABLE;
+
+        task->next_spawned = __atomic_load_n(&sched->spawned,
+                                             __ATOMIC_RELAXED);
+        while ( !__atomic_compare_exchange_n(&sched->spawned,
+                                             &task->next_spawned, task, 0,
+                                             __ATOMIC_SEQ_CST,
+                                             __ATOMIC_RELAXED) ) {
+                /* next_spawned now holds whichever task got in first */
+        }
+
+        __atomic_add_fetch(&sched->live, 1, __ATOMIC_SEQ_CST);
+        push(any_worker(sched), task);
+
+        return task;
+}
+
+extern void sched_wake(Sched sched, Sched_task task)
+{
+        for (;;) {
+                int state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+
+                if ( state == PARKED ) {
+                        if ( __atomic_compare_exchange_n(&task->state,
+                                                         &state, RUNNABLE,
+                                                         0, __ATOMIC_SEQ_CST,
+                                                         __ATOMIC_ACQUIRE) ) {
+                                push(any_worker(sched), task);
+                                return;
+                        }
+                } else if ( state == RUNNING ) {
+                        if ( __atomic_compare_exchange_n(&task->state,
+                                                         &state, WOKEN,
+                                                         0, __ATOMIC_SEQ_CST,
+                                                         __ATOMIC_ACQUIRE) ) {
+                                return;
+                        }
+                } else {
+                        return;
+                }
+        }
+}
+
+extern void sched_wait(Sched sched)
+{
+        pthread_mutex_lock(&sched->lock);
+        while ( __atomic_load_n(&sched->live, __ATOMIC_SEQ_CST) > 0 ) {
+                pthread_cond_wait(&sched->finished, &sched->lock);
+        }
+        pthread_mutex_unlock(&sched->lock);
+}
+
+extern void sched_free(Sched *sched)
+{
+        Sched s = *sched;
+        unsigned i;
+
+        pthread_mutex_lock(&s->lock);
+        s->stopping = 1;
+        pthread_cond_broadcast(&s->work);
+        pthread_mutex_unlock(&s->lock);
+
+        for ( i = 0; i < s->started; i++ ) {
+                pthread_join(s->workers[i].thread, NULL);
+        }
+
+        /* only now that no worker can steal from them */
+        for ( i = 0; i < s->num_workers; i++ ) {
+                Worker worker = &s->workers[i];
+
+                pthread_mutex_destroy(&worker->lock);
+                free(worker->tasks);
+        }
+
+        while ( s->spawned != NULL ) {
+                Sched_task task = s->spawned;
+
+                s->spawned = task->next_spawned;
+                free(task);
+        }
+
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->work);
+        pthread_cond_destroy(&s->finished);
+        free(s->workers);
+        free(s);
+        *sched = NULL;
+}
+
+/* Runs tasks until the scheduler is stopped and nothing is left to run */
+static void *work(void *closure)
+{
+        Worker worker = closure;
+        Sched_task task;
+
+        while ( (task = next_task(worker)) != NULL ) {
+                run(worker, task);
+        }
+
+        return NULL;
+}
+
+/*
+ * Returns a task from the worker's own deque, or else one stolen from
+ * another worker, sleeping while there are none. Returns NULL once the
+ * scheduler is stopping and no task is left
+ */
+static Sched_task next_task(Worker worker)
+{
+        Sched sched = worker->sched;
+        unsigned index = worker - sched->workers;
+        unsigned i;
+
+        for (;;) {
+                Sched_task task = take_front(worker);
+
+                if ( task != NULL ) {
+                        return task;
+                }
+
+                for ( i = 1; i < sched->num_workers; i++ ) {
+                        Worker victim = &sched->workers[(index + i) %
+                                                        sched->num_workers];
+
+                        task = take_back(victim);
+                        if ( task != NULL ) {
+                                return task;
+                        }
+                }
+
+                if ( !wait_for_work(sched) ) {
+                        return NULL;
+                }
+        }
+}
+
+/* Runs a task for one slice and decides where it goes next */
+static void run(Worker worker, Sched_task task)
+{
+        Sched sched = worker->sched;
+
+        __atomic_store_n(&task->state, RUNNING, __ATOMIC_SEQ_CST);
+
+        Um_status status = um_run(task->vm, sched->slice);
+
+        switch ( status ) {
+                case UM_BUDGET_EXHAUSTED:
+                        __atomic_store_n(&task->state, RUNNABLE,
+                                         __ATOMIC_SEQ_CST);
+                        push(worker, task);
+                        break;
+                case UM_WAITING_FOR_INPUT:
+                        park(worker, task);
+                        break;
+                default:
+                        finish(sched, task, status);
+        }
+}
+
+/*
+ * Sets a task aside until it is woken, unless it was woken while it was
+ * running, in which case its input may already be there
+ */
+static void park(Worker worker, Sched_task task)
+{
+        int state = RUNNING;
+
+        if ( __atomic_compare_exchange_n(&task->state, &state, PARKED, 0,
+                                         __ATOMIC_SEQ_CST,
+                                         __ATOMIC_ACQUIRE) ) {
+                return;
+        }
+
+        assert(state == WOKEN);
+        __atomic_store_n(&task->state, RUNNABLE, __ATOMIC_SEQ_CST);
+        push(worker, task);
+}
+
+/* Hands a UM that has stopped back to its host */
+static void finish(Sched sched, Sched_task task, Um_status status)
+{
+        __atomic_store_n(&task->state, FINISHED, __ATOMIC_SEQ_CST);
+        task->done(task->vm, status, task->closure);
+
+        if ( __atomic_sub_fetch(&sched->live, 1, __ATOMIC_SEQ_CST) == 0 ) {
+                pthread_mutex_lock(&sched->lock);
+                pthread_cond_broadcast(&sched->finished);
+                pthread_mutex_unlock(&sched->lock);
+        }
+}
+
+/*
+ * Puts a task at the back of a deque, and wakes a sleeping worker to
+ * steal it. The count goes up before the sleepers are checked, and a
+ * worker counts itself as sleeping before it checks the count, so one
+ * of the two always sees the other
+ */
+static void push(Worker worker, Sched_task task)
+{
+        Sched sched = worker->sched;
+
+        pthread_mutex_lock(&worker->lock);
+
+        if ( worker->count == worker->capacity ) {
+                size_t i;
+                Sched_task *tasks = malloc(2 * worker->capacity *
+                                           sizeof(*tasks));
+                assert(tasks);
+
+                for ( i = 0; i < worker->count; i++ ) {
+                        tasks[i] = worker->tasks[(worker->front + i) %
+                                                 worker->capacity];
+                }
+
+                free(worker->tasks);
+                worker->tasks = tasks;
+                worker->capacity *= 2;
+                worker->front = 0;
+        }
+
+        worker->tasks[(worker->front + worker->count) % worker->capacity] =
+                task;
+        worker->count++;
+        __atomic_add_fetch(&sched->runnable, 1, __ATOMIC_SEQ_CST);
+
+        pthread_mutex_unlock(&worker->lock);
+
+        if ( __atomic_load_n(&sched->sleeping, __ATOMIC_SEQ_CST) > 0 ) {
+                pthread_mutex_lock(&sched->lock);
+                pthread_cond_signal(&sched->work);
+                pthread_mutex_unlock(&sched->lock);
+        }
+}
+
+/* The owner takes the task that has waited longest, so UMs take turns */
+static Sched_task take_front(Worker worker)
+{
+        Sched_task task = NULL;
+
+        pthread_mutex_lock(&worker->lock);
+
+        if ( worker->count > 0 ) {
+                task = worker->tasks[worker->front];
+                worker->front = (worker->front + 1) % worker->capacity;
+                worker->count--;
+                __atomic_sub_fetch(&worker->sched->runnable, 1,
+                                   __ATOMIC_SEQ_CST);
+        }
+
+        pthread_mutex_unlock(&worker->lock);
+        return task;
+}
+
+/* Thieves take the task that would have run last */
+static Sched_task take_back(Worker worker)
+{
+        Sched_task task = NULL;
+
+        pthread_mutex_lock(&worker->lock);
+
+        if ( worker->count > 0 ) {
+                worker->count--;
+                task = worker->tasks[(worker->front + worker->count) %
+                                     worker->capacity];
+                __atomic_sub_fetch(&worker->sched->runnable, 1,
+                                   __ATOMIC_SEQ_CST);
+        }
+
+        pthread_mutex_unlock(&worker->lock);
+        return task;
+}
+
+/*
+ * Sleeps while no deque has a task in it. Returns 0 instead once the
+ * scheduler is stopping and there is nothing left to run
+ */
+static int wait_for_work(Sched sched)
+{
+        int more = 1;
+
+        pthread_mutex_lock(&sched->lock);
+        __atomic_add_fetch(&sched->sleeping, 1, __ATOMIC_SEQ_CST);
+
+        while ( __atomic_load_n(&sched->runnable, __ATOMIC_SEQ_CST) == 0 ) {
+                if ( sched->stopping ) {
+                        more = 0;
+                        break;
+                }
+                pthread_cond_wait(&sched->work, &sched->lock);
+        }
+
+        __atomic_sub_fetch(&sched->sleeping, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&sched->lock);
+
+        return more;
+}
+
+/* Spreads tasks queued from outside the workers over all of them */
+static Worker any_worker(Sched sched)
+{
+        unsigned next = __atomic_fetch_add(&sched->next_worker, 1,
+                                           __ATOMIC_RELAXED);
+
+        return &sched->workers[next % sched->num_workers];
+}
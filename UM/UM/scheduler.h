@@ -0,0 +1,73 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                             scheduler                             *
+ *                                                                   *
+ *                File: scheduler.h                                  *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Interface for running many UMs on a pool of  *
+ *                      worker threads, one per core. Each worker    *
+ *                      runs the UMs in its own queue a slice of     *
+ *                      steps at a time and takes UMs from the       *
+ *                      queues of the other workers once its own is  *
+ *                      empty. A UM waiting for input is put aside   *
+ *                      until its host wakes it:                     *
+ *                                                                   *
+ *                        Sched sched = sched_new(0, 1000000);       *
+ *                        sched_spawn(sched, vm, done, closure);     *
+ *                        ...                                        *
+ *                        sched_wait(sched);                         *
+ *                        sched_free(&sched);                        *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef SCHEDULER_INCLUDED
+#define SCHEDULER_INCLUDED
+
+#include <stdint.h>
+
+#include "libum.h"
+
+typedef struct Sched *Sched;
+typedef struct Sched_task *Sched_task;
+
+/*
+ * Called on a worker thread once a UM has halted or faulted. The
+ * scheduler does not touch the UM after that, so done may free it
+ */
+typedef void (*Sched_done)(Um vm, Um_status status, void *closure);
+
+
+/*
+ * Starts the given number of worker threads, or one per online core if
+ * workers is 0. Each runs a UM for slice steps before moving on. Returns
+ * NULL if the scheduler or one of its threads could not be made
+ */
+extern Sched      sched_new   (unsigned workers, uint64_t slice);
+
+/*
+ * Queues a UM with a program loaded. The UM must read and write through
+ * callbacks, not standard input and output. May be called from any
+ * thread, done included
+ */
+extern Sched_task sched_spawn (Sched sched, Um vm, Sched_done done,
+                               void *closure);
+
+/*
+ * Queues a task again once input has arrived for it. A task whose UM
+ * asks for input again before it is woken is put aside, and a wake that
+ * comes while it is still running is kept for it. Waking any other task
+ * does nothing
+ */
+extern void       sched_wake  (Sched sched, Sched_task task);
+
+/* Waits until every task spawned so far has finished */
+extern void       sched_wait  (Sched sched);
+
+/*
+ * Stops the workers once the queues are empty and frees every task. The
+ * UMs belong to the caller
+ */
+extern void       sched_free  (Sched *sched);
+
+#endif
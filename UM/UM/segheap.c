@@ -0,0 +1,265 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                             segheap                               *
+ *                                                                   *
+ *                File: segheap.c                                    *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Allocates UM segments. Each segment is       *
+ *                      rounded up to its size class, which are      *
+ *                      spaced four to every power of two so that    *
+ *                      rounding wastes at most a fifth of a         *
+ *                      segment. Small classes are carved out of     *
+ *                      4MB arenas and unmapped segments go on a     *
+ *                      free list for their class, so mapping and    *
+ *                      unmapping rarely reach malloc. Segments of   *
+ *                      the largest classes get pages of their own   *
+ *                      from the kernel, which fills them with 0     *
+ *                      only when they are first touched, so mapping *
+ *                      a huge segment costs nothing up front        *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "segheap.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   S T R U C T U R E   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define NUM_CLASSES 121
+
+/* arenas are chained together so that they can all be freed */
+typedef struct Arena {
+        struct Arena *next;
+        uint64_t bytes[];
+} *Arena;
+
+struct Segheap {
+        /* unmapped segments, linked through their first words */
+        Segment free_lists[NUM_CLASSES];
+
+        Arena arenas;
+        size_t arena_used;
+
+        /* bytes of the segments that have pages of their own */
+        uint64_t mapped_bytes;
+};
+
+
+const size_t   ARENA_SIZE           = 4 * 1024 * 1024;
+
+/* classes above this (65536 words) are mapped and unmapped directly */
+const unsigned LARGEST_ARENA_CLASS  = 56;
+
+/* mapped segments this big may be backed by huge pages, for fewer TLB 
+ * misses */
+const size_t   HUGE_PAGE_SIZE       = 2 * 1024 * 1024;
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * */
+
+static unsigned size_class    (uint32_t length);
+static size_t   capacity      (unsigned size_class);
+static size_t   segment_bytes (unsigned size_class);
+static Segment  carve         (Segheap heap, size_t bytes);
+static Segment  map_pages     (size_t bytes);
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+extern Segheap segheap_new(void)
+{
+        Segheap heap = calloc(1, sizeof(*heap));
+        assert(heap);
+        return heap;
+}
+
+/* 
+ * Returns a segment of length words, all of them 0, or NULL if there is
+ * no memory for it
+ */
+extern Segment segment_new(Segheap heap, uint32_t length)
+{
+        unsigned class = size_class(length);
+        Segment segment = heap->free_lists[class];
+
+        if ( class > LARGEST_ARENA_CLASS ) {
+                /* new pages are 0 already */
+                segment = map_pages(segment_bytes(class));
+                if ( segment == NULL ) {
+                        return NULL;
+                }
+                heap->mapped_bytes += segment_bytes(class);
+                segment->length = length;
+                segment->size_class = class;
+                return segment;
+        }
+
+        if ( segment != NULL ) {
+                memcpy(&heap->free_lists[class], segment->words,
+                       sizeof(Segment));
+        } else {
+                segment = carve(heap, segment_bytes(class));
+                if ( segment == NULL ) {
+                        return NULL;
+                }
+        }
+
+        segment->length = length;
+        segment->size_class = class;
+        memset(segment->words, 0, (size_t)length * sizeof(uint32_t));
+
+        return segment;
+}
+
+/* 
+ * Gives a segment back to the heap for reuse by its size class. Foreign
+ * segments go away with the memory they live in
+ */
+extern void segment_free(Segheap heap, Segment segment)
+{
+        unsigned class = segment->size_class;
+
+        if ( class == FOREIGN_CLASS ) {
+                return;
+        }
+        if ( class > LARGEST_ARENA_CLASS ) {
+                munmap(segment, segment_bytes(class));
+                heap->mapped_bytes -= segment_bytes(class);
+                return;
+        }
+
+        memcpy(segment->words, &heap->free_lists[class], sizeof(Segment));
+        heap->free_lists[class] = segment;
+}
+
+/* 
+ * Finds the bytes the heap has taken from malloc and the kernel, and how
+ * many of them are in segments waiting on the free lists. Walks every 
+ * arena and free list, so it is meant for statistics
+ */
+extern void segheap_stats(Segheap heap, uint64_t *bytes, 
+                          uint64_t *free_bytes)
+{
+        Arena arena;
+        unsigned class;
+
+        *bytes = heap->mapped_bytes;
+        for ( arena = heap->arenas; arena != NULL; arena = arena->next ) {
+                *bytes += sizeof(*arena) + ARENA_SIZE;
+        }
+
+        *free_bytes = 0;
+        for ( class = 0; class <= LARGEST_ARENA_CLASS; class++ ) {
+                Segment segment = heap->free_lists[class];
+
+                while ( segment != NULL ) {
+                        *free_bytes += segment_bytes(class);
+                        memcpy(&segment, segment->words, sizeof(Segment));
+                }
+        }
+}
+
+/* Frees every arena. Segments of the largest classes must be freed first */
+extern void segheap_free(Segheap *heap)
+{
+        Arena arena = (*heap)->arenas;
+
+        while ( arena != NULL ) {
+                Arena next = arena->next;
+                free(arena);
+                arena = next;
+        }
+
+        free(*heap);
+        *heap = NULL;
+}
+
+/* 
+ * Returns the smallest class whose segments hold length words. Above 4 
+ * words the classes go 5, 6, 7, 8, 10, 12, 14, 16, 20, ... 
+ */
+static unsigned size_class(uint32_t length)
+{
+        if ( length <= 4 ) {
+                return 0;
+        }
+
+        uint32_t last = length - 1;
+        unsigned shift = 0;
+
+        while ( (last >> shift) > 7 ) {
+                shift++;
+        }
+        return 4 * shift + (last >> shift) - 3;
+}
+
+/* Returns the number of words in segments of a class, at least 4 so that 
+ * a free segment can hold the free list link 
+ */
+static size_t capacity(unsigned size_class)
+{
+        return (size_t)(4 + size_class % 4) << (size_class / 4);
+}
+
+/* Returns the number of bytes segments of a class take, with their header */
+static size_t segment_bytes(unsigned size_class)
+{
+        return sizeof(struct Segment) + 
+               capacity(size_class) * sizeof(uint32_t);
+}
+
+/*
+ * Takes bytes from the current arena, starting a new one when it is full.
+ * The unused end of the old arena is never touched, so it costs no memory.
+ * Returns NULL if there is no memory for a new arena
+ */
+static Segment carve(Segheap heap, size_t bytes)
+{
+        if ( heap->arenas == NULL ||
+             heap->arena_used + bytes > ARENA_SIZE ) {
+                Arena arena = malloc(sizeof(*arena) + ARENA_SIZE);
+                if ( arena == NULL ) {
+                        return NULL;
+                }
+
+                arena->next = heap->arenas;
+                heap->arenas = arena;
+                heap->arena_used = 0;
+        }
+
+        Segment segment = (Segment)((uint8_t *)heap->arenas->bytes +
+                                    heap->arena_used);
+        heap->arena_used += bytes;
+
+        return segment;
+}
+
+/* 
+ * Maps fresh pages for a segment. The kernel backs them only as they are
+ * touched, with huge pages if the segment is big enough and it allows.
+ * Returns NULL if it has no room for them
+ */
+static Segment map_pages(size_t bytes)
+{
+        void *pages = mmap(NULL, bytes, PROT_READ | PROT_WRITE, 
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if ( pages == MAP_FAILED ) {
+                return NULL;
+        }
+
+        if ( bytes >= HUGE_PAGE_SIZE ) {
+                madvise(pages, bytes, MADV_HUGEPAGE);
+        }
+        return pages;
+}
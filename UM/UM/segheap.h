@@ -0,0 +1,50 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                             segheap                               *
+ *                                                                   *
+ *                File: segheap.h                                    *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Header for the segment heap, which hands     *
+ *                      out zeroed UM segments carved from large     *
+ *                      arenas and recycles unmapped segments by     *
+ *                      size class. The largest segments are pages   *
+ *                      of their own, zeroed as they are touched     *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef SEGHEAP_INCLUDED
+#define SEGHEAP_INCLUDED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "assert.h"
+
+/* a segment's length is stored right in front of its words */
+typedef struct Segment {
+        uint32_t length;
+        uint32_t size_class;
+        uint32_t words[];
+} *Segment;
+
+typedef struct Segheap *Segheap;
+
+/* the size class of segments in memory that the heap does not own, such
+ * as a mapped snapshot, which segment_free leaves alone */
+#define FOREIGN_CLASS UINT32_MAX
+
+
+extern Segheap segheap_new    (void);
+
+extern Segment segment_new    (Segheap heap, uint32_t length);
+
+extern void    segment_free   (Segheap heap, Segment segment);
+
+extern void    segheap_stats  (Segheap heap, uint64_t *bytes, 
+                               uint64_t *free_bytes);
+
+extern void    segheap_free   (Segheap *heap);
+
+#endif
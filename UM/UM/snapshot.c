@@ -0,0 +1,176 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                             snapshot                              *
+ *                                                                   *
+ *                File: snapshot.c                                   *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Saves a UM to a snapshot file and restores   *
+ *                      it. A snapshot is a header with the          *
+ *                      registers followed by the memory as          *
+ *                      save_memory lays it out, in the byte order   *
+ *                      of the machine that wrote it. Saving writes  *
+ *                      only the segments that are mapped, to a new  *
+ *                      file that replaces the old one once it is on *
+ *                      disk, so a crash leaves the last snapshot    *
+ *                      whole. Restoring maps the file instead of    *
+ *                      reading it, so the UM starts right away and  *
+ *                      its segments are read in as it touches them  *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "assert.h"
+#include "snapshot.h"
+#include "managemem.h"
+#include "io.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   S T R U C T U R E   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/* a multiple of 8 bytes, so the memory after it is aligned */
+typedef struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t registers[NUM_REGISTERS];
+        uint32_t program_counter;
+        uint32_t padding;
+        uint64_t input_position;
+
+        /* so that a replayed input log still matches the restored UM */
+        uint64_t steps;
+} Header;
+
+
+/* "UMSS" */
+static const uint32_t MAGIC       = 0x554d5353;
+static const uint32_t VERSION     = 2;
+
+static const size_t   BUFFER_SIZE = 1024 * 1024;
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+/*
+ * Writes a snapshot of a UM that is between two instructions and has no
+ * output waiting to path. Returns 0, or -1 if it could not be written,
+ * in which case whatever was at path before is still there
+ */
+extern int snapshot_save(Um_state um, const char *path)
+{
+        Header header;
+        size_t length = strlen(path);
+        char *temporary = malloc(length + sizeof(".tmp"));
+
+        assert(temporary);
+        memcpy(temporary, path, length);
+        memcpy(temporary + length, ".tmp", sizeof(".tmp"));
+
+        FILE *file = fopen(temporary, "wb");
+
+        if ( file == NULL ) {
+                free(temporary);
+                return -1;
+        }
+        setvbuf(file, NULL, _IOFBF, BUFFER_SIZE);
+
+        memset(&header, 0, sizeof(header));
+        header.magic = MAGIC;
+        header.version = VERSION;
+        memcpy(header.registers, um->registers, sizeof(header.registers));
+        header.program_counter = um->program_counter;
+        header.input_position = input_position(um->io);
+        header.steps = um->steps;
+
+        int failed = fwrite(&header, sizeof(header), 1, file) != 1;
+
+        failed |= save_memory(um->mem, file) != 0;
+        failed |= fflush(file) != 0;
+        failed |= fsync(fileno(file)) != 0;
+        failed |= fclose(file) != 0;
+
+        if ( !failed ) {
+                failed = rename(temporary, path) != 0;
+        }
+        if ( failed ) {
+                remove(temporary);
+        }
+
+        free(temporary);
+        return failed ? -1 : 0;
+}
+
+/*
+ * Restores the UM saved at path into a UM state that has no memory. Its
+ * io throws away the input the saved UM had read. Returns 0, or -1
+ * without touching the UM if path is not a snapshot
+ */
+extern int snapshot_load(Um_state um, const char *path)
+{
+        int file = open(path, O_RDONLY);
+        struct stat file_stats;
+        Header header;
+
+        assert(um->mem == NULL);
+
+        if ( file == -1 ) {
+                return -1;
+        }
+        if ( fstat(file, &file_stats) == -1 ||
+             (size_t)file_stats.st_size < sizeof(header) ) {
+                close(file);
+                return -1;
+        }
+
+        size_t size = file_stats.st_size;
+        void *view = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                          file, 0);
+
+        close(file);
+        if ( view == MAP_FAILED ) {
+                return -1;
+        }
+
+        memcpy(&header, view, sizeof(header));
+
+        Memory mem = NULL;
+
+        if ( header.magic == MAGIC && header.version == VERSION ) {
+                mem = restore_memory(view, size, sizeof(header));
+        }
+        if ( mem == NULL ) {
+                munmap(view, size);
+                return -1;
+        }
+
+        /* the view now belongs to mem, and goes with it */
+        uint32_t program_length;
+
+        program_instructions(mem, &program_length);
+        if ( header.program_counter >= program_length ) {
+                free_memory(mem);
+                return -1;
+        }
+
+        um->mem = mem;
+        memcpy(um->registers, header.registers, sizeof(um->registers));
+        um->program_counter = header.program_counter;
+        um->steps = header.steps;
+        skip_input(um->io, header.input_position);
+
+        return 0;
+}
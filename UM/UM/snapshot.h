@@ -0,0 +1,26 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                             snapshot                              *
+ *                                                                   *
+ *                File: snapshot.h                                   *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Header for the snapshot module, which saves  *
+ *                      a UM between two instructions to a file and  *
+ *                      restores it from one: its registers, program *
+ *                      counter, how much input it has read and all  *
+ *                      of its memory                                *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef SNAPSHOT_INCLUDED
+#define SNAPSHOT_INCLUDED
+
+#include "state.h"
+
+
+extern int snapshot_save (Um_state um, const char *path);
+
+extern int snapshot_load (Um_state um, const char *path);
+
+#endif
@@ -0,0 +1,48 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                              state                                *
+ *                                                                   *
+ *                File: state.h                                      *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: The state of a running UM: its eight         *
+ *                      registers, program counter, segmented        *
+ *                      memory, io and translated code, kept         *
+ *                      together in one cache line and passed to     *
+ *                      every module that executes UM instructions,  *
+ *                      and its trace                                *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef STATE_INCLUDED
+#define STATE_INCLUDED
+
+#include <stdint.h>
+
+#define NUM_REGISTERS 8
+
+struct Memory;
+struct Io;
+struct Jit;
+struct Trace;
+
+typedef struct Um_state {
+        uint32_t registers[NUM_REGISTERS];
+        uint32_t program_counter;
+        struct Memory *mem;
+        struct Io *io;
+
+        /* kept from one run to the next by -DUM_JIT builds, else NULL */
+        struct Jit *jit;
+
+        /* NULL unless the UM is being traced, past the first cache line */
+        struct Trace *trace;
+
+        /* steps taken since the program was loaded, up to the start of 
+         * the run going on, and the steps before the input instruction 
+         * being run, which the interpreter sets just before it reads */
+        uint64_t steps;
+        uint64_t input_step;
+} __attribute__((aligned(64))) *Um_state;
+
+#endif
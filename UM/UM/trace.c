@@ -0,0 +1,125 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                               trace                               *
+ *                                                                   *
+ *                File: trace.c                                      *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Keeps the ring of traced instructions of a   *
+ *                      UM and writes it out. Writing only uses      *
+ *                      calls that are safe in a signal handler, so  *
+ *                      a UM can be dumped from one while it runs    *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "assert.h"
+#include "trace.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N S   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static int write_all (int file, const void *bytes, size_t size);
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+/* Returns an empty ring for capacity records, which must be a power of 2 */
+extern Trace trace_new(uint32_t capacity)
+{
+        assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+
+        Trace trace = malloc(sizeof(*trace));
+        assert(trace);
+
+        trace->records = calloc(capacity, sizeof(*trace->records));
+        assert(trace->records);
+        trace->events = 0;
+        trace->mask = capacity - 1;
+
+        return trace;
+}
+
+/*
+ * Writes the registers of a UM and its trace to a new file at path. Only
+ * capacity - 1 records are kept, since the oldest may be being replaced.
+ * Returns 0, or -1 if the file could not be written
+ */
+extern int trace_dump(Trace trace, Um_state um, Trace_reason reason,
+                      const char *path)
+{
+        int saved_errno = errno;
+        int file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if ( file == -1 ) {
+                errno = saved_errno;
+                return -1;
+        }
+
+        Trace_header header;
+        uint64_t events = __atomic_load_n(&trace->events, __ATOMIC_ACQUIRE);
+        uint64_t count = events < trace->mask ? events : trace->mask;
+        uint32_t first = (events - count) & trace->mask;
+        uint64_t before_end = trace->mask + 1 - first;
+
+        memset(&header, 0, sizeof(header));
+        header.magic = TRACE_MAGIC;
+        header.version = TRACE_VERSION;
+        header.reason = reason;
+        header.program_counter = um->program_counter;
+        memcpy(header.registers, um->registers, sizeof(header.registers));
+        header.events = events;
+        header.count = count;
+
+        if ( before_end > count ) {
+                before_end = count;
+        }
+
+        int failed = write_all(file, &header, sizeof(header)) != 0;
+
+        failed |= write_all(file, &trace->records[first],
+                            before_end * sizeof(Trace_record)) != 0;
+        failed |= write_all(file, trace->records,
+                            (count - before_end) * sizeof(Trace_record)) != 0;
+        failed |= close(file) != 0;
+
+        errno = saved_errno;
+        return failed ? -1 : 0;
+}
+
+extern void trace_free(Trace *trace)
+{
+        free((*trace)->records);
+        free(*trace);
+        *trace = NULL;
+}
+
+static int write_all(int file, const void *bytes, size_t size)
+{
+        const char *next = bytes;
+
+        while ( size > 0 ) {
+                ssize_t written = write(file, next, size);
+
+                if ( written == -1 && errno == EINTR ) {
+                        continue;
+                }
+                if ( written <= 0 ) {
+                        return -1;
+                }
+                next += written;
+                size -= written;
+        }
+        return 0;
+}
@@ -0,0 +1,130 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                               trace                               *
+ *                                                                   *
+ *                File: trace.h                                      *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Header for the trace module, which keeps the *
+ *                      last instructions of a UM that jumped,       *
+ *                      mapped or unmapped a segment, or did io in a *
+ *                      ring in memory, and writes them to a trace   *
+ *                      file that umtrace prints. Every other        *
+ *                      instruction runs in a straight line between  *
+ *                      two jumps, so the records are enough to tell *
+ *                      which path the UM took                       *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef TRACE_INCLUDED
+#define TRACE_INCLUDED
+
+#include <stdint.h>
+
+#include "state.h"
+#include "decoder.h"
+
+
+/*
+ * One traced instruction. a and b are the registers it was about:
+ *   LOADPROG  segment, program counter it jumps to
+ *   MAPSEG    segment it mapped, number of words
+ *   UNMAPSEG  segment
+ *   OUT, IN   the byte, or all ones for the end of input
+ * SEGLOAD and SEGSTORE are not recorded, so a trace shows which segments
+ * existed but not which of them were read or written. They are a large
+ * share of what a UM runs, and a record for each would cost far more 
+ * than the few percent tracing is meant to
+ */
+typedef struct Trace_record {
+        uint32_t program_counter;
+        uint32_t opcode;
+        uint32_t a;
+        uint32_t b;
+} Trace_record;
+
+/* what the UM was doing when its trace was written */
+typedef enum Trace_reason {
+        TRACE_RUNNING,
+        TRACE_PAUSED,
+        TRACE_HALTED,
+        TRACE_FAULTED
+} Trace_reason;
+
+/*
+ * The start of a trace file, followed by count records, oldest first.
+ * The registers and program counter are as the UM last stored them,
+ * which for a UM that was running may be behind its last record
+ */
+typedef struct Trace_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t reason;
+        uint32_t program_counter;
+        uint32_t registers[NUM_REGISTERS];
+        uint64_t events;
+        uint64_t count;
+} Trace_header;
+
+#define TRACE_MAGIC   0x554d5452
+#define TRACE_VERSION 1
+
+/*
+ * Written only by the thread running the UM, which publishes each record
+ * by storing events after it, so a dump that interrupts it never needs a
+ * lock. The record at events itself may be half written
+ */
+typedef struct Trace {
+        uint64_t events;
+        uint32_t mask;
+        Trace_record *records;
+} *Trace;
+
+
+extern Trace trace_new  (uint32_t capacity);
+
+extern int   trace_dump (Trace trace, Um_state um, Trace_reason reason,
+                         const char *path);
+
+extern void  trace_free (Trace *trace);
+
+static inline void trace_event(Trace trace, uint32_t program_counter,
+                               unsigned opcode, uint32_t a, uint32_t b)
+{
+        uint64_t events = trace->events;
+        Trace_record *record = &trace->records[events & trace->mask];
+
+        record->program_counter = program_counter;
+        record->opcode = opcode;
+        record->a = a;
+        record->b = b;
+        __atomic_store_n(&trace->events, events + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Records the instruction at program_counter if the UM is being traced.
+ * LOADPROG is recorded before it runs, since it may fail or free the
+ * instruction, and the rest once they have run
+ */
+static inline void trace_instruction(Um_state um, uint32_t program_counter,
+                                     const struct instruction *decoded)
+{
+        Trace trace = um->trace;
+
+        if ( trace == NULL ) {
+                return;
+        }
+
+        unsigned opcode = decoded->opcode;
+
+        if ( opcode == MAPSEG || opcode == LOADPROG ) {
+                trace_event(trace, program_counter, opcode,
+                            um->registers[decoded->rb],
+                            um->registers[decoded->rc]);
+        } else {
+                trace_event(trace, program_counter, opcode,
+                            um->registers[decoded->rc], 0);
+        }
+}
+
+#endif
@@ -5,42 +5,93 @@
  *                File: um.c                                         *
  *             Authors: Andrew Burgos and Lucy Qin                   *
  *       Date Modified: November 13, 2014                            *
- *             Purpose: Initializes the UM and interacts with        *
- *                      various modules to execute                   *
- *                      UM instructions as well as interact with     *
- *                      the segmented memory.                        *
+ *             Purpose: Runs a UM binary on standard input and       *
+ *                      output through libum. Usage:                 *
  *                                                                   *
+ *                        um [--profile report.json] prog.um         *
+ *                        um [--checkpoint snap [--every steps]]     *
+ *                           prog.um                                 *
+ *                        um [--checkpoint snap ...] --restore snap  *
+ *                        um [--cache dir] prog.um                   *
+ *                        um [--trace trace] prog.um                 *
+ *                        um [--record log | --replay log] prog.um   *
+ *                        um [--memory report.json] [--max-words n]  *
+ *                           [--max-segments n] prog.um              *
+ *                                                                   *
+ *                      With --cache, the program is decoded into an *
+ *                      image cache file in dir, prog.umx for        *
+ *                      prog.um and prog.umz.umx for prog.umz, which *
+ *                      later runs of the same program given the     *
+ *                      same dir map instead of decoding it again.   *
+ *                      With --checkpoint, the UM is saved to snap   *
+ *                      when the process gets SIGUSR1, and about     *
+ *                      every given number of steps. --restore       *
+ *                      carries on from a snapshot instead of        *
+ *                      starting a program, reading and throwing     *
+ *                      away the input the UM had already read, so   *
+ *                      it should be given the same input again.     *
+ *                      With --trace, the last jumps, segment        *
+ *                      changes and io of the UM are written to      *
+ *                      trace for umtrace to print when it faults    *
+ *                      and when the process gets SIGUSR2, which     *
+ *                      leaves it running, or SIGINT or SIGTERM.     *
+ *                      --record writes every byte of input the UM   *
+ *                      reads to log, and --replay gives the UM the  *
+ *                      input from a log in place of standard input, *
+ *                      so that runs can be timed on the same input. *
+ *                      --memory writes what the UM had mapped, at   *
+ *                      its peak and when it stopped, and what the   *
+ *                      allocator took to hold it. --max-words and   *
+ *                      --max-segments make a MAPSEG that would go   *
+ *                      past them fail the program                   *
  *                                                                   *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
-#include "uarray.h"
-#include "bitpack.h"
-
-/*   U M   M O D U L E S   */
-#include "managemem.h"
-#include "alu.h"
-#include "io.h"
-#include "decoder.h"
+#include "assert.h"
+#include "libum.h"
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * *
  *   F U N C T I O N   D E C L A R A T I O N S   *
  * * * * * * * * * * * * * * * * * * * * * * * * */
 
-static void initialize_registers (UArray_T registers);
+static void      read_file    (int argc, char *argv[], Um vm, 
+                               const char *cache_dir);
+static char     *cache_path   (const char *cache_dir, 
+                               const char *program_path);
+
+static Um_status run          (Um vm, const char *checkpoint_path,
+                               uint64_t every);
+static void      request_save (int signal_number);
+static void      start_trace  (Um vm);
+static void      dump_trace   (int signal_number);
+static int       write_memory (Um vm, const char *path);
+static void      print_fault  (const Um_fault *report);
+
+
+/* how often a UM run with --checkpoint looks for SIGUSR1 */
+const uint64_t SIGNAL_SLICE = 10000000;
 
-static void read_file            (int argc, char *argv[], 
-                                    UArray_T registers, Memory mem);
+/* instructions kept by --trace, in 1 MB */
+const uint32_t TRACE_RECORDS = 65536;
 
-static void execute_instruction  (instruction decoded, UArray_T registers, 
-                                  Memory mem, uint32_t *program_counter);
+static volatile sig_atomic_t save_requested = 0;
 
-static void free_um_memory       (UArray_T registers, Memory mem);
+/* the UM that dump_trace writes out, and where to */
+static Um traced_vm = NULL;
+static const char *trace_path = NULL;
 
 
 /* * * * * * * * * * * * * * * * * * 
@@ -49,174 +100,371 @@ static void free_um_memory       (UArray_T registers, Memory mem);
 
 int main(int argc, char *argv[]) 
 {
-        /* initialize segmented memory */
-        Memory mem = initialize_memory();        
-        
-        /* create registers */
-        UArray_T registers = UArray_new(8, sizeof(uint32_t));  
-       
-        /* initialize program counter */
-        uint32_t pc_value = 0;
-        uint32_t *program_counter = &pc_value;
-        
-        read_file(argc, argv, registers, mem);
-
-        initialize_registers(registers);
-
-        /* load in 32-bit instructions */
-        Um_instruction codeword = (fetch_instruction(program_counter, mem));  
-        instruction decoded = malloc(sizeof(*decoded));
-        decode(codeword, decoded);
-        
-               
-
-
-        while ( decoded->opcode != HALT && (signed)decoded->opcode != -1 ) {
-          
-
-                execute_instruction(decoded, registers, mem, program_counter);
-                codeword = (fetch_instruction(program_counter, mem));
-              
-              
-                decode(codeword, decoded);
-
-        }   
-        free(decoded);
-        free_um_memory(registers, mem);
-   
-        
-  
-}
+        const char *report_path = NULL;
+        const char *checkpoint_path = NULL;
+        const char *restore_path = NULL;
+        const char *record_path = NULL;
+        const char *replay_path = NULL;
+        const char *memory_path = NULL;
+        uint64_t max_words = UM_NO_LIMIT;
+        uint64_t max_segments = UM_NO_LIMIT;
+        uint64_t every = 0;
+        const char *cache_dir = NULL;
+        Um_status status;
+
+        /* each option takes one argument */
+        while (argc > 2 && strncmp(argv[1], "--", 2) == 0) {
+                if (strcmp(argv[1], "--cache") == 0) {
+                        cache_dir = argv[2];
+                } else if (strcmp(argv[1], "--profile") == 0) {
+                        report_path = argv[2];
+                } else if (strcmp(argv[1], "--checkpoint") == 0) {
+                        checkpoint_path = argv[2];
+                } else if (strcmp(argv[1], "--every") == 0) {
+                        every = strtoull(argv[2], NULL, 10);
+                } else if (strcmp(argv[1], "--restore") == 0) {
+                        restore_path = argv[2];
+                } else if (strcmp(argv[1], "--trace") == 0) {
+                        trace_path = argv[2];
+                } else if (strcmp(argv[1], "--record") == 0) {
+                        record_path = argv[2];
+                } else if (strcmp(argv[1], "--replay") == 0) {
+                        replay_path = argv[2];
+                } else if (strcmp(argv[1], "--memory") == 0) {
+                        memory_path = argv[2];
+                } else if (strcmp(argv[1], "--max-words") == 0) {
+                        max_words = strtoull(argv[2], NULL, 10);
+                } else if (strcmp(argv[1], "--max-segments") == 0) {
+                        max_segments = strtoull(argv[2], NULL, 10);
+                } else {
+                        break;
+                }
+                argc -= 2;
+                argv += 2;
+        }
 
-static void initialize_registers(UArray_T registers) 
-{
-        int i;
-        for (i = 0; i < UArray_length(registers); i++) {
-                int *value = UArray_at(registers, i);
-                *value = 0; 
+        Um vm = um_new(NULL);
+
+        if (vm == NULL) {
+                fprintf(stderr, "Error: not enough memory for the UM\n");
+                exit(EXIT_FAILURE);
+        }
+        um_limit_memory(vm, max_words, max_segments);
+        if (restore_path == NULL) {
+                read_file(argc, argv, vm, cache_dir);
+        } else if (argc != 1 || um_restore(vm, restore_path) != 0) {
+                fprintf(stderr, "Error: cannot restore %s\n", restore_path);
+                um_free(&vm);
+                exit(EXIT_FAILURE);
+        }
+
+        if (trace_path != NULL) {
+                start_trace(vm);
+        }
+        if (record_path != NULL && um_record_input(vm, record_path) != 0) {
+                fprintf(stderr, "Error: cannot write %s\n", record_path);
+                um_free(&vm);
+                exit(EXIT_FAILURE);
+        }
+        if (replay_path != NULL && um_replay_input(vm, replay_path) != 0) {
+                fprintf(stderr, "Error: cannot replay %s\n", replay_path);
+                um_free(&vm);
+                exit(EXIT_FAILURE);
+        }
+
+        if (report_path != NULL) {
+                Um_fault fault;
+
+                status = um_profile(vm, report_path);
+                if (status == UM_FAULT && um_fault_info(vm, &fault) != 0) {
+                        fprintf(stderr, "Error: cannot write %s\n", 
+                                report_path);
+                        um_free(&vm);
+                        exit(EXIT_FAILURE);
+                }
+        } else if (checkpoint_path != NULL) {
+                status = run(vm, checkpoint_path, every);
+        } else {
+                status = um_run(vm, UM_NO_LIMIT);
+        }
+
+        if (status == UM_FAULT && trace_path != NULL &&
+            um_trace_dump(vm, trace_path) != 0) {
+                fprintf(stderr, "Error: cannot write %s\n", trace_path);
+        }
+
+        if (record_path != NULL && um_record_input(vm, NULL) != 0) {
+                fprintf(stderr, "Error: cannot write %s\n", record_path);
+        }
+        if (memory_path != NULL && write_memory(vm, memory_path) != 0) {
+                fprintf(stderr, "Error: cannot write %s\n", memory_path);
+        }
+
+        Um_memory_stats stats;
+        int over_limit = um_memory_stats(vm, &stats) == 0 && 
+                         stats.over_limit;
+        Um_fault report;
+        int described = um_fault_info(vm, &report) == 0;
+
+        /* a signal must not dump a UM that is being freed */
+        traced_vm = NULL;
+        um_free(&vm);
+
+        if (status == UM_FAULT && over_limit) {
+                fprintf(stderr, "Error: the UM program ran out of "
+                        "memory\n");
+                return EXIT_FAILURE;
+        } else if (status == UM_FAULT && described) {
+                print_fault(&report);
+                return EXIT_FAILURE;
+        } else if (status == UM_FAULT) {
+                fprintf(stderr, "Error: the UM program failed\n");
+                return EXIT_FAILURE;
         }
+        return EXIT_SUCCESS;
 }
 
 
-static void read_file(int argc, char *argv[], UArray_T registers, Memory mem) 
+/* 
+ * Maps the program file into memory and hands it to the UM, which 
+ * converts its big-endian words straight into segment 0 or maps them 
+ * from the image cache
+ */
+static void read_file(int argc, char *argv[], Um vm, const char *cache_dir) 
 {
         if (argc != 2) {
                 fprintf(stderr, "Error: please specify one file\n");
+                um_free(&vm);
                 exit(EXIT_FAILURE);
-                free_um_memory(registers, mem);
         }
 
-
-        FILE *file_ptr = fopen(argv[1], "r");
+        int file = open(argv[1], O_RDONLY);
 
         struct stat file_stats;
 
-        if(stat(argv[1], &file_stats) == -1) {
+        if (file == -1 || fstat(file, &file_stats) == -1) {
                 fprintf(stderr, "Error within file\n");
+                um_free(&vm);
                 exit(EXIT_FAILURE);
-                fclose(file_ptr);
-                free_um_memory(registers, mem);
         }
-        
-        if (file_stats.st_size % 4 != 0) {
+
+        const uint8_t *bytes = NULL;
+
+        if (file_stats.st_size > 0) {
+                bytes = mmap(NULL, file_stats.st_size, PROT_READ, 
+                             MAP_PRIVATE, file, 0);
+                assert(bytes != MAP_FAILED);
+                madvise((void *)bytes, file_stats.st_size, MADV_SEQUENTIAL);
+        }
+
+        char *cache = cache_dir != NULL ? cache_path(cache_dir, argv[1]) 
+                                        : NULL;
+        int result;
+
+        if (cache != NULL) {
+                result = um_load_cached(vm, bytes, file_stats.st_size, cache);
+        } else {
+                result = um_load_buffer(vm, bytes, file_stats.st_size);
+        }
+        free(cache);
+
+        if (result != 0) {
                 fprintf(stderr, "Error: File does not contain");
                 fprintf(stderr, "correctly formatted instruction\n");
+                close(file);
+                um_free(&vm);
                 exit(EXIT_FAILURE);
-                fclose(file_ptr);
-                free_um_memory(registers, mem);
-                
-        }
-        load_value(0, (file_stats.st_size / 4), registers);
-        map_segment(1, 0, registers, mem);
-
-        uint32_t instruct = 0;
-        uint32_t instruct_byte;
-        int instruction_count = 0;
-        unsigned lsb = 32;
-
-        while((instruct_byte = getc(file_ptr)) != (unsigned)EOF) {
-           
-                lsb = lsb - 8;
-                instruct = Bitpack_newu(instruct, 8, lsb, instruct_byte);
-                
-                if (lsb == 0) {
-                        load_value(0, instruct, registers);
-                        int *value2 = UArray_at(registers, 2);
-                        *value2 = instruction_count++;
-                        segmented_store(1, 2, 0, registers, mem);    
-                        lsb = 32;
+        }
+
+        if (bytes != NULL) {
+                munmap((void *)bytes, file_stats.st_size);
+        }
+        close(file);
+}
+
+/* 
+ * Returns where the image cache of a program goes in cache_dir, to be 
+ * freed. Programs with the same name share a file, which holds whichever
+ * was decoded last, since a cache file is only used for the program it 
+ * was written for
+ */
+static char *cache_path(const char *cache_dir, const char *program_path)
+{
+        const char *name = strrchr(program_path, '/');
+        name = name == NULL ? program_path : name + 1;
+
+        size_t dir_length = strlen(cache_dir);
+        size_t length = strlen(name);
+        char *path = malloc(dir_length + 1 + length + sizeof(".umx"));
+
+        assert(path);
+        memcpy(path, cache_dir, dir_length);
+        path[dir_length] = '/';
+        memcpy(path + dir_length + 1, name, length + 1);
+
+        if (length >= 3 && strcmp(name + length - 3, ".um") == 0) {
+                strcat(path, "x");
+        } else {
+                strcat(path, ".umx");
+        }
+        return path;
+}
+
+/* 
+ * Runs the UM a slice at a time, saving it between slices when SIGUSR1
+ * has come in or every steps have gone by since the last snapshot. A 
+ * snapshot that cannot be written is reported but does not stop the UM
+ */
+static Um_status run(Um vm, const char *checkpoint_path, uint64_t every)
+{
+        struct sigaction action;
+        uint64_t slice = SIGNAL_SLICE;
+        uint64_t since_saved = 0;
+        Um_status status;
+
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = request_save;
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &action, NULL);
+
+        if (every != 0 && every < slice) {
+                slice = every;
+        }
+
+        while ((status = um_run(vm, slice)) == UM_BUDGET_EXHAUSTED) {
+                since_saved += slice;
+
+                if (!save_requested && 
+                    (every == 0 || since_saved < every)) {
+                        continue;
+                }
+
+                save_requested = 0;
+                since_saved = 0;
+
+                if (um_checkpoint(vm, checkpoint_path) != 0) {
+                        fprintf(stderr, "Error: cannot write %s\n", 
+                                checkpoint_path);
                 }
         }
-        fclose(file_ptr);
+        return status;
 }
 
+static void request_save(int signal_number)
+{
+        (void)signal_number;
+        save_requested = 1;
+}
 
-static void free_um_memory(UArray_T registers, Memory mem) 
+/* 
+ * Traces the UM, writing it out to trace_path from SIGUSR2, SIGINT and 
+ * SIGTERM. The last two then end the process as they would have
+ */
+static void start_trace(Um vm)
 {
-        UArray_free(&registers);
-        free_memory(mem);
+        struct sigaction action;
+
+        if (um_trace(vm, TRACE_RECORDS) != 0) {
+                fprintf(stderr, "Error: cannot trace the UM\n");
+                um_free(&vm);
+                exit(EXIT_FAILURE);
+        }
+
+        traced_vm = vm;
+
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = dump_trace;
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR2, &action, NULL);
+
+        action.sa_flags = SA_RESETHAND;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
 }
 
-/* Executes UM instruction based off decoded opcode */
-static void execute_instruction(instruction decoded, UArray_T registers, 
-                                Memory mem, uint32_t *program_counter) 
+static void dump_trace(int signal_number)
 {
-        switch ( decoded->opcode ) {
-                case 0:
-                        cond_move(decoded->ra, decoded->rb, decoded->rc, 
-                                  registers);
-                        break;
-                case 1:
-                        segmented_load(decoded->ra, decoded->rb, decoded->rc,
-                                       registers, mem);
-                        break;
-                case 2: 
-                        segmented_store(decoded->ra, decoded->rb, decoded->rc,
-                                        registers, mem);
-                        break;
-                case 3:
-                        addition(decoded->ra, decoded->rb, decoded->rc, 
-                                 registers);
-                        break;
-                case 4:
-                        multiply(decoded->ra, decoded->rb, decoded->rc, 
-                                 registers);
-                        break;
-                case 5: 
-                        division(decoded->ra, decoded->rb, decoded->rc,
-                                 registers);
-                        break;
-                case 6: 
-                        nand(decoded->ra, decoded->rb, decoded->rc, registers);
-                        break;
-                case 7: 
-                        return;
-                case 8: 
-                        map_segment(decoded->rb, decoded->rc, registers, mem);
-                        break;
-                case 9: 
-                        unmap_segment(decoded->rc, registers, mem);
-                        break;
-                case 10: 
-                        output(decoded->rc, registers);
-                        break;
-                case 11: 
-                        input(decoded->rc, registers);
-                        break;
-                case 12: 
-                        load_program(decoded->rb, decoded->rc, registers, 
-                                     mem, program_counter); 
-                        break;
-                case 13: 
-                        load_value(decoded->ra, decoded->value, registers);
-                        break;
+        if (traced_vm != NULL) {
+                um_trace_dump(traced_vm, trace_path);
         }
-        
-        if (decoded->opcode != 12) {
-                *program_counter = *program_counter + 1;
-        
+
+        /* delivered with the default action once the handler returns */
+        if (signal_number != SIGUSR2) {
+                raise(signal_number);
         }
 }
 
+/* 
+ * Writes the memory statistics of the UM to path as JSON. Returns 0, or 
+ * -1 if the file cannot be written
+ */
+static int write_memory(Um vm, const char *path)
+{
+        Um_memory_stats stats;
+        FILE *report = fopen(path, "w");
+        int i;
+
+        if (report == NULL || um_memory_stats(vm, &stats) != 0) {
+                if (report != NULL) {
+                        fclose(report);
+                }
+                return -1;
+        }
 
+        fprintf(report, "{\n");
+        fprintf(report, "  \"mapped_words\": %llu,\n", 
+                (unsigned long long)stats.mapped_words);
+        fprintf(report, "  \"peak_mapped_words\": %llu,\n", 
+                (unsigned long long)stats.peak_mapped_words);
+        fprintf(report, "  \"live_segments\": %u,\n", stats.live_segments);
+        fprintf(report, "  \"peak_live_segments\": %u,\n", 
+                stats.peak_live_segments);
+
+        /* entry i counts the live segments with i bits in their length */
+        fprintf(report, "  \"segment_sizes\": [");
+        for (i = 0; i < UM_SIZE_BUCKETS; i++) {
+                fprintf(report, "%s%u", i == 0 ? "" : ", ", 
+                        stats.segment_sizes[i]);
+        }
+        fprintf(report, "],\n");
+
+        fprintf(report, "  \"id_capacity\": %u,\n", stats.id_capacity);
+        fprintf(report, "  \"id_high\": %u,\n", stats.id_high);
+        fprintf(report, "  \"free_ids\": %u,\n", stats.free_ids);
+        fprintf(report, "  \"table_bytes\": %llu,\n", 
+                (unsigned long long)stats.table_bytes);
+        fprintf(report, "  \"program_bytes\": %llu,\n", 
+                (unsigned long long)stats.program_bytes);
+        fprintf(report, "  \"heap_bytes\": %llu,\n", 
+                (unsigned long long)stats.heap_bytes);
+        fprintf(report, "  \"heap_free_bytes\": %llu,\n", 
+                (unsigned long long)stats.heap_free_bytes);
+        fprintf(report, "  \"overhead_bytes\": %llu,\n", 
+                (unsigned long long)stats.overhead_bytes);
+        fprintf(report, "  \"over_limit\": %s\n}\n", 
+                stats.over_limit ? "true" : "false");
+
+        return fclose(report) == 0 ? 0 : -1;
+}
 
+/* Says which instruction of the UM program failed, and on what */
+static void print_fault(const Um_fault *report)
+{
+        if (report->opcode == UM_PAST_END) {
+                fprintf(stderr, "Error: the UM program ran past the end "
+                        "of segment 0 at word %u\n", 
+                        report->program_counter);
+                return;
+        }
+
+        fprintf(stderr, "Error: the UM program failed at word %u, "
+                "opcode %u", report->program_counter, report->opcode);
+        /* an UNMAPSEG, opcode 9, names only a segment */
+        if (report->access && report->opcode == 9) {
+                fprintf(stderr, ", segment %u", report->segment);
+        } else if (report->access) {
+                fprintf(stderr, ", segment %u offset %u", report->segment,
+                        report->offset);
+        }
+        fprintf(stderr, "\n");
+}
@@ -0,0 +1,284 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                              umbatch                              *
+ *                                                                   *
+ *                File: umbatch.c                                    *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Runs a batch of UM binaries in one process   *
+ *                      on the scheduler in scheduler.h. Usage:      *
+ *                                                                   *
+ *                        umbatch [-j workers] [-s slice]            *
+ *                                [-n copies] [-i input] [-p]        *
+ *                                midmark.um sandmark.umz            *
+ *                                                                   *
+ *                      Every image is run copies times at once,     *
+ *                      each copy reading the whole input file if    *
+ *                      one is given. The copies share segment 0     *
+ *                      unless -p gives each its own. Output is not  *
+ *                      kept, but the copies of an image are checked *
+ *                      to have written the same bytes. Reports how  *
+ *                      long the batch took and exits with status 1  *
+ *                      if any UM faulted                            *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "assert.h"
+#include "libum.h"
+#include "scheduler.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   S T R U C T U R E   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+typedef struct File {
+        const uint8_t *bytes;
+        size_t size;
+} *File;
+
+/* one running copy of an image, and the closure of its callbacks */
+typedef struct Copy {
+        File input;
+        size_t input_used;
+
+        uint64_t output_bytes;
+        uint64_t output_hash;
+        Um_status status;
+} *Copy;
+
+
+const uint64_t DEFAULT_SLICE  = 1000000;
+const unsigned DEFAULT_COPIES = 1;
+
+/* FNV-1a */
+const uint64_t HASH_START     = 14695981039346656037ull;
+const uint64_t HASH_PRIME     = 1099511628211ull;
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N S   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static void   map_file     (const char *path, File file);
+static void   unmap_file   (File file);
+
+static int    read_input   (void *closure);
+static void   write_output (void *closure, const uint8_t *bytes,
+                            size_t count);
+static void   done         (Um vm, Um_status status, void *closure);
+
+static double seconds      (void);
+static void   usage        (void);
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+int main(int argc, char *argv[])
+{
+        unsigned workers = 0;
+        uint64_t slice = DEFAULT_SLICE;
+        unsigned copies = DEFAULT_COPIES;
+        const char *input_path = NULL;
+        int (*load)(Um, const void *, size_t) = um_load_shared;
+        int option;
+
+        while ( (option = getopt(argc, argv, "j:s:n:i:p")) != -1 ) {
+                switch ( option ) {
+                        case 'j': workers = atoi(optarg);             break;
+                        case 's': slice = strtoull(optarg, NULL, 10); break;
+                        case 'n': copies = atoi(optarg);              break;
+                        case 'i': input_path = optarg;                break;
+                        case 'p': load = um_load_buffer;              break;
+                        default:  usage();
+                }
+        }
+
+        if ( optind == argc || slice == 0 || copies == 0 ) {
+                usage();
+        }
+
+        unsigned num_images = argc - optind;
+        unsigned total = num_images * copies;
+        unsigned i, j;
+
+        struct File input = { NULL, 0 };
+        struct File *images = malloc(num_images * sizeof(*images));
+        struct Copy *batch = malloc(total * sizeof(*batch));
+
+        assert(images && batch);
+
+        if ( input_path != NULL ) {
+                map_file(input_path, &input);
+        }
+        for ( i = 0; i < num_images; i++ ) {
+                map_file(argv[optind + i], &images[i]);
+        }
+
+        Sched sched = sched_new(workers, slice);
+
+        if ( sched == NULL ) {
+                fprintf(stderr, "Error: cannot start the workers\n");
+                exit(EXIT_FAILURE);
+        }
+        double start = seconds();
+
+        for ( i = 0; i < total; i++ ) {
+                Copy copy = &batch[i];
+                File image = &images[i / copies];
+                Um_io io = { read_input, write_output, copy };
+
+                copy->input = &input;
+                copy->input_used = 0;
+                copy->output_bytes = 0;
+                copy->output_hash = HASH_START;
+                copy->status = UM_FAULT;
+
+                Um vm = um_new(&io);
+
+                if ( vm == NULL ) {
+                        fprintf(stderr, "Error: not enough memory for "
+                                        "the UMs\n");
+                        exit(EXIT_FAILURE);
+                }
+                if ( load(vm, image->bytes, image->size) != 0 ) {
+                        fprintf(stderr, "Error: %s is not a UM binary\n",
+                                argv[optind + i / copies]);
+                        exit(EXIT_FAILURE);
+                }
+                sched_spawn(sched, vm, done, copy);
+        }
+
+        sched_wait(sched);
+        double elapsed = seconds() - start;
+        sched_free(&sched);
+
+        int faulted = 0;
+
+        printf("%-24s %8s %8s %8s %14s %8s\n", "image", "copies", "halted",
+               "faulted", "output bytes", "same");
+
+        for ( i = 0; i < num_images; i++ ) {
+                Copy first = &batch[i * copies];
+                unsigned halted = 0;
+                int same = 1;
+
+                for ( j = 0; j < copies; j++ ) {
+                        Copy copy = &batch[i * copies + j];
+
+                        halted += copy->status == UM_HALTED;
+                        same &= copy->output_bytes == first->output_bytes &&
+                                copy->output_hash == first->output_hash;
+                }
+
+                printf("%-24s %8u %8u %8u %14llu %8s\n", argv[optind + i],
+                       copies, halted, copies - halted,
+                       (unsigned long long)first->output_bytes,
+                       same ? "yes" : "NO");
+                faulted |= halted < copies;
+        }
+
+        printf("\n%u UMs in %.3f s, %.2f UMs/s\n", total, elapsed,
+               total / elapsed);
+
+        for ( i = 0; i < num_images; i++ ) {
+                unmap_file(&images[i]);
+        }
+        unmap_file(&input);
+        free(images);
+        free(batch);
+
+        return faulted ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void map_file(const char *path, File file)
+{
+        int descriptor = open(path, O_RDONLY);
+        struct stat file_stats;
+
+        if ( descriptor == -1 || fstat(descriptor, &file_stats) == -1 ) {
+                fprintf(stderr, "Error: cannot read %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+
+        file->bytes = NULL;
+        file->size = file_stats.st_size;
+
+        if ( file->size > 0 ) {
+                file->bytes = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE,
+                                   descriptor, 0);
+                assert(file->bytes != MAP_FAILED);
+        }
+
+        close(descriptor);
+}
+
+static void unmap_file(File file)
+{
+        if ( file->bytes != NULL ) {
+                munmap((void *)file->bytes, file->size);
+        }
+}
+
+static int read_input(void *closure)
+{
+        Copy copy = closure;
+        File input = copy->input;
+
+        if ( copy->input_used == input->size ) {
+                return UM_EOF;
+        }
+        return input->bytes[copy->input_used++];
+}
+
+static void write_output(void *closure, const uint8_t *bytes, size_t count)
+{
+        Copy copy = closure;
+        uint64_t hash = copy->output_hash;
+        size_t i;
+
+        for ( i = 0; i < count; i++ ) {
+                hash = (hash ^ bytes[i]) * HASH_PRIME;
+        }
+
+        copy->output_hash = hash;
+        copy->output_bytes += count;
+}
+
+/* Frees each UM as soon as it stops, so a batch only holds live ones */
+static void done(Um vm, Um_status status, void *closure)
+{
+        Copy copy = closure;
+
+        copy->status = status;
+        um_free(&vm);
+}
+
+static double seconds(void)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void usage(void)
+{
+        fprintf(stderr, "Usage: umbatch [-j workers] [-s slice] [-n copies] "
+                "[-i input] [-p] image...\n");
+        exit(EXIT_FAILURE);
+}
@@ -0,0 +1,380 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                              umbench                              *
+ *                                                                   *
+ *                File: umbench.c                                    *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Benchmarks a um binary on a set of UM        *
+ *                      images. Usage:                               *
+ *                                                                   *
+ *                        umbench [-n runs] [-o new.json]            *
+ *                                [-b baseline.json] [-t percent]    *
+ *                                [-r log] ./um midmark.um           *
+ *                                sandmark.umz                       *
+ *                                                                   *
+ *                      Each image is run several times with its     *
+ *                      output thrown away, and once more under      *
+ *                      um --profile to count its instructions and   *
+ *                      segment operations. Images get no input, or  *
+ *                      with -r the input that um --record wrote to  *
+ *                      log, replayed from memory so that no run     *
+ *                      waits on it. Median wall time and            *
+ *                      peak RSS are compared against the baseline,  *
+ *                      and umbench exits with status 1 if either    *
+ *                      grew by more than the threshold              *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "assert.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   S T R U C T U R E   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+typedef struct Result {
+        const char *image;
+        double median_seconds;
+        long peak_rss_kb;
+        uint64_t instructions;
+        uint64_t maps;
+        uint64_t unmaps;
+        uint64_t loadprogs;
+} *Result;
+
+
+const unsigned DEFAULT_RUNS      = 5;
+const double   DEFAULT_THRESHOLD = 5.0;
+const unsigned MAX_LINE          = 1024;
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N S   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static void   measure       (const char *um, const char *image,
+                             const char *replay_path, unsigned runs,
+                             Result result);
+
+static double run           (char *const argv[], long *peak_rss_kb);
+
+static void   count         (const char *um, const char *image,
+                             const char *replay_path, Result result);
+
+static void   save          (const char *path, struct Result *results,
+                             unsigned count, unsigned runs);
+
+static int    compare       (const char *path, struct Result *results,
+                             unsigned count, double threshold);
+
+static int    by_seconds    (const void *a, const void *b);
+
+static void   usage         (void);
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+int main(int argc, char *argv[])
+{
+        unsigned runs = DEFAULT_RUNS;
+        double threshold = DEFAULT_THRESHOLD;
+        const char *save_path = NULL;
+        const char *baseline_path = NULL;
+        const char *replay_path = NULL;
+        int option;
+
+        while ( (option = getopt(argc, argv, "n:o:b:t:r:")) != -1 ) {
+                switch ( option ) {
+                        case 'n': runs = atoi(optarg);      break;
+                        case 'o': save_path = optarg;       break;
+                        case 'b': baseline_path = optarg;   break;
+                        case 't': threshold = atof(optarg); break;
+                        case 'r': replay_path = optarg;     break;
+                        default:  usage();
+                }
+        }
+
+        if ( argc - optind < 2 || runs == 0 ) {
+                usage();
+        }
+
+        const char *um = argv[optind];
+        unsigned count = argc - optind - 1;
+        unsigned i;
+
+        struct Result *results = calloc(count, sizeof(*results));
+        assert(results);
+
+        printf("%-24s %10s %14s %10s %10s %10s %10s\n", "image", "median s",
+               "instr/s", "rss KB", "map", "unmap", "loadprog");
+
+        for ( i = 0; i < count; i++ ) {
+                Result result = &results[i];
+
+                measure(um, argv[optind + 1 + i], replay_path, runs, 
+                        result);
+                printf("%-24s %10.3f %14.0f %10ld %10llu %10llu %10llu\n",
+                       result->image, result->median_seconds,
+                       result->instructions / result->median_seconds,
+                       result->peak_rss_kb,
+                       (unsigned long long)result->maps,
+                       (unsigned long long)result->unmaps,
+                       (unsigned long long)result->loadprogs);
+        }
+
+        int regressed = 0;
+
+        if ( baseline_path != NULL ) {
+                regressed = compare(baseline_path, results, count,
+                                    threshold);
+        }
+        if ( save_path != NULL ) {
+                save(save_path, results, count, runs);
+        }
+
+        free(results);
+        return regressed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* 
+ * Runs one image runs times and once under --profile, on the input 
+ * logged at replay_path unless it is NULL
+ */
+static void measure(const char *um, const char *image, 
+                    const char *replay_path, unsigned runs, Result result)
+{
+        char *plain[] = { (char *)um, (char *)image, NULL };
+        char *replayed[] = { (char *)um, "--replay", (char *)replay_path,
+                             (char *)image, NULL };
+        char *const *argv = replay_path != NULL ? replayed : plain;
+        double *seconds = malloc(runs * sizeof(*seconds));
+        unsigned i;
+
+        assert(seconds);
+        result->image = image;
+        result->peak_rss_kb = 0;
+
+        for ( i = 0; i < runs; i++ ) {
+                long peak_rss_kb;
+
+                seconds[i] = run(argv, &peak_rss_kb);
+                if ( seconds[i] < 0 ) {
+                        fprintf(stderr, "Error: %s %s failed\n", um, image);
+                        exit(EXIT_FAILURE);
+                }
+                if ( peak_rss_kb > result->peak_rss_kb ) {
+                        result->peak_rss_kb = peak_rss_kb;
+                }
+        }
+
+        qsort(seconds, runs, sizeof(*seconds), by_seconds);
+        result->median_seconds = runs % 2 == 1 ? seconds[runs / 2] :
+                                 (seconds[runs / 2 - 1] +
+                                  seconds[runs / 2]) / 2;
+        free(seconds);
+
+        count(um, image, replay_path, result);
+}
+
+/*
+ * Runs a command with standard input and output on /dev/null, and returns
+ * its wall time in seconds, or -1 if it failed
+ */
+static double run(char *const argv[], long *peak_rss_kb)
+{
+        struct timespec start, end;
+        struct rusage usage;
+        int status;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        pid_t child = fork();
+        assert(child != -1);
+
+        if ( child == 0 ) {
+                int null = open("/dev/null", O_RDWR);
+
+                dup2(null, STDIN_FILENO);
+                dup2(null, STDOUT_FILENO);
+                execvp(argv[0], argv);
+                _exit(127);
+        }
+
+        if ( wait4(child, &status, 0, &usage) != child ) {
+                return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+                return -1;
+        }
+
+        *peak_rss_kb = usage.ru_maxrss;
+        return (end.tv_sec - start.tv_sec) +
+               (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* 
+ * Reads the instruction and segment operation counts from a profile. They
+ * stay 0 for a um built before --profile existed
+ */
+static void count(const char *um, const char *image, 
+                  const char *replay_path, Result result)
+{
+        char report[] = "/tmp/umbench-XXXXXX";
+        int file = mkstemp(report);
+        assert(file != -1);
+        close(file);
+
+        char *plain[] = { (char *)um, "--profile", report, (char *)image,
+                          NULL };
+        char *replayed[] = { (char *)um, "--replay", (char *)replay_path,
+                             "--profile", report, (char *)image, NULL };
+        char *const *argv = replay_path != NULL ? replayed : plain;
+        long peak_rss_kb;
+        char line[MAX_LINE];
+
+        if ( run(argv, &peak_rss_kb) < 0 ) {
+                unlink(report);
+                return;
+        }
+
+        FILE *profile = fopen(report, "r");
+        assert(profile);
+
+        while ( fgets(line, MAX_LINE, profile) != NULL ) {
+                unsigned long long value;
+
+                if ( sscanf(line, " \"instructions\": %llu", &value) == 1 ) {
+                        result->instructions = value;
+                } else if ( sscanf(line, " \"map\": %llu", &value) == 1 ) {
+                        result->maps = value;
+                } else if ( sscanf(line, " \"unmap\": %llu", &value) == 1 ) {
+                        result->unmaps = value;
+                } else if ( sscanf(line, " \"loadprog\": %llu",
+                                   &value) == 1 ) {
+                        result->loadprogs = value;
+                }
+        }
+
+        fclose(profile);
+        unlink(report);
+}
+
+/* Writes the results as JSON, one image per line */
+static void save(const char *path, struct Result *results, unsigned count,
+                 unsigned runs)
+{
+        FILE *file = fopen(path, "w");
+        unsigned i;
+
+        if ( file == NULL ) {
+                fprintf(stderr, "Error: cannot write %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+
+        fprintf(file, "{\n  \"runs\": %u,\n  \"images\": [\n", runs);
+        for ( i = 0; i < count; i++ ) {
+                Result result = &results[i];
+
+                fprintf(file, "    {\"image\": \"%s\", \"median_seconds\": "
+                        "%.6f, \"peak_rss_kb\": %ld, \"instructions\": %llu, "
+                        "\"map\": %llu, \"unmap\": %llu, \"loadprog\": "
+                        "%llu}%s\n", result->image, result->median_seconds,
+                        result->peak_rss_kb,
+                        (unsigned long long)result->instructions,
+                        (unsigned long long)result->maps,
+                        (unsigned long long)result->unmaps,
+                        (unsigned long long)result->loadprogs,
+                        i + 1 < count ? "," : "");
+        }
+        fprintf(file, "  ]\n}\n");
+
+        fclose(file);
+}
+
+/*
+ * Reports each image whose median time or peak RSS grew by more than
+ * threshold percent over a baseline written by save, and returns whether
+ * there were any
+ */
+static int compare(const char *path, struct Result *results, unsigned count,
+                   double threshold)
+{
+        FILE *file = fopen(path, "r");
+        char line[MAX_LINE];
+        char image[MAX_LINE];
+        int regressed = 0;
+        unsigned i;
+
+        if ( file == NULL ) {
+                fprintf(stderr, "Error: cannot read %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+
+        printf("\ncompared with %s:\n", path);
+
+        while ( fgets(line, MAX_LINE, file) != NULL ) {
+                double seconds;
+                long peak_rss_kb;
+
+                if ( sscanf(line, " {\"image\": \"%[^\"]\", \"median_seconds\""
+                            ": %lf, \"peak_rss_kb\": %ld", image, &seconds,
+                            &peak_rss_kb) != 3 ) {
+                        continue;
+                }
+
+                for ( i = 0; i < count; i++ ) {
+                        Result result = &results[i];
+
+                        if ( strcmp(result->image, image) != 0 ) {
+                                continue;
+                        }
+
+                        double time_change = 100 * (result->median_seconds /
+                                                    seconds - 1);
+                        double rss_change = 100 * ((double)result->peak_rss_kb
+                                                   / peak_rss_kb - 1);
+                        int worse = time_change > threshold ||
+                                    rss_change > threshold;
+
+                        printf("%-24s time %+7.1f%%  rss %+7.1f%%%s\n",
+                               image, time_change, rss_change,
+                               worse ? "  REGRESSION" : "");
+                        regressed |= worse;
+                }
+        }
+
+        fclose(file);
+        return regressed;
+}
+
+static int by_seconds(const void *a, const void *b)
+{
+        double x = *(const double *)a;
+        double y = *(const double *)b;
+
+        return (x > y) - (x < y);
+}
+
+static void usage(void)
+{
+        fprintf(stderr, "Usage: umbench [-n runs] [-o new.json] "
+                "[-b baseline.json] [-t percent] [-r log] um image...\n");
+        exit(EXIT_FAILURE);
+}
@@ -0,0 +1,331 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                                umc                                *
+ *                                                                   *
+ *                File: umc.c                                        *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Ahead-of-time compiler that translates a UM  *
+ *                      binary into a C program with one case label  *
+ *                      per instruction. Usage:                      *
+ *                                                                   *
+ *                        umc prog.um > /tmp/prog.c                  *
+ *                        gcc -O2 -I. /tmp/prog.c interpret.o jit.o  *
+ *                            managemem.o segheap.o decoder.o io.o   *
+ *                            bitpack.o fault.o image.o trace.o      *
+ *                            $LIBS -o prog                          *
+ *                                                                   *
+ *                      The generated program hands over to the      *
+ *                      interpreter once it is about to execute a    *
+ *                      word of segment 0 that has been overwritten, *
+ *                      or once segment 0 is replaced                *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "bitpack_inline.h"
+#include "decoder.h"
+
+
+/* words of the UM binary in each function of the generated program */
+#define CHUNK 256
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N S   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static uint32_t *read_file        (int argc, char *argv[], uint32_t *length);
+
+static void      emit_program     (const char *name, const uint32_t *words,
+                                   uint32_t length);
+
+static void      emit_instruction (instruction decoded, uint32_t pc,
+                                   uint32_t first);
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+int main(int argc, char *argv[])
+{
+        uint32_t length;
+        uint32_t *words = read_file(argc, argv, &length);
+
+        emit_program(argv[1], words, length);
+
+        free(words);
+        return EXIT_SUCCESS;
+}
+
+/* Reads the big-endian words of a UM binary */
+static uint32_t *read_file(int argc, char *argv[], uint32_t *length)
+{
+        if (argc != 2) {
+                fprintf(stderr, "Error: please specify one file\n");
+                exit(EXIT_FAILURE);
+        }
+
+        struct stat file_stats;
+
+        if (stat(argv[1], &file_stats) == -1) {
+                fprintf(stderr, "Error within file\n");
+                exit(EXIT_FAILURE);
+        }
+
+        if (file_stats.st_size % 4 != 0) {
+                fprintf(stderr, "Error: File does not contain");
+                fprintf(stderr, "correctly formatted instruction\n");
+                exit(EXIT_FAILURE);
+        }
+
+        FILE *file_ptr = fopen(argv[1], "r");
+        assert(file_ptr);
+
+        *length = file_stats.st_size / 4;
+        uint32_t *words = malloc((*length + 1) * sizeof(*words));
+        uint8_t *bytes = malloc(file_stats.st_size + 1);
+        assert(words && bytes);
+
+        size_t num_bytes = fread(bytes, 1, file_stats.st_size, file_ptr);
+        fclose(file_ptr);
+        if (num_bytes != (size_t)file_stats.st_size) {
+                fprintf(stderr, "Error: cannot read %s\n", argv[1]);
+                exit(EXIT_FAILURE);
+        }
+
+        uint32_t i;
+
+        for (i = 0; i < *length; i++) {
+                const uint8_t *word = bytes + 4 * i;
+                uint64_t instruct = 0;
+
+                instruct = Bitpack_newu_inline(instruct, 8, 24, word[0]);
+                instruct = Bitpack_newu_inline(instruct, 8, 16, word[1]);
+                instruct = Bitpack_newu_inline(instruct, 8, 8, word[2]);
+                instruct = Bitpack_newu_inline(instruct, 8, 0, word[3]);
+                words[i] = instruct;
+        }
+        free(bytes);
+
+        return words;
+}
+
+/*
+ * Writes the C program for a UM binary to standard output. The program
+ * is split into chunks of CHUNK words, each a function with a switch on
+ * the program counter, so that gcc compiles many small functions rather
+ * than one huge one. Execution enters the switch at the case for the 
+ * program counter and falls through from one instruction to the next. 
+ * LOADPROG within segment 0 goes back through the switch if the target 
+ * is in the same chunk, and through main otherwise
+ */
+static void emit_program(const char *name, const uint32_t *words,
+                         uint32_t length)
+{
+        uint32_t pc, first;
+
+        printf("/* compiled from %s by umc */\n\n", name);
+        printf("#define _POSIX_C_SOURCE 200112L\n\n");
+        printf("#include <stdio.h>\n");
+        printf("#include <stdlib.h>\n");
+        printf("#include <stdint.h>\n\n");
+        printf("#include \"state.h\"\n");
+        printf("#include \"managemem.h\"\n");
+        printf("#include \"interpret.h\"\n");
+        printf("#include \"alu.h\"\n");
+        printf("#include \"io.h\"\n\n");
+
+        printf("/* each instruction falls through to the next one, and a "
+               "chunk need not\n * jump or use every variable */\n");
+        printf("#pragma GCC diagnostic ignored "
+               "\"-Wimplicit-fallthrough\"\n");
+        printf("#pragma GCC diagnostic ignored \"-Wunused-label\"\n\n");
+
+        printf("#define LENGTH %uu\n", length);
+        printf("#define CHUNK  %uu\n\n", CHUNK);
+
+        printf("/* what a chunk returns instead of the next program "
+               "counter */\n");
+        printf("#define HALTED   UINT32_MAX\n");
+        printf("#define FALLBACK (UINT32_MAX - 1)\n\n");
+
+        printf("static const uint32_t words[LENGTH + 1] = {\n");
+        for ( pc = 0; pc < length; pc++ ) {
+                printf("        0x%08xu,\n", words[pc]);
+        }
+        printf("        0\n};\n\n");
+
+        printf("/* words of segment 0 that no longer match words[] */\n");
+        printf("static uint8_t overwritten[LENGTH + 1];\n\n");
+
+        printf("/* hands the instruction at n over to the interpreter */\n");
+        printf("#define FALL_BACK(n) do { um->program_counter = n; "
+               "return FALLBACK; } while (0)\n");
+        printf("#define CHECK(n) if ( overwritten[n] ) FALL_BACK(n);\n\n");
+
+        for ( first = 0; first < length; first += CHUNK ) {
+                uint32_t end = length - first < CHUNK ? length 
+                                                      : first + CHUNK;
+
+                printf("static uint32_t chunk_%u(Um_state um, uint32_t pc)\n"
+                       "{\n", first / CHUNK);
+                printf("        Memory mem = um->mem;\n");
+                printf("        uint32_t *r = um->registers;\n\n");
+                printf("        (void)mem;\n");
+                printf("        (void)r;\n\n");
+                printf("dispatch:\n");
+                printf("        switch ( pc ) {\n");
+                for ( pc = first; pc < end; pc++ ) {
+                        struct instruction decoded;
+                        decode(words[pc], &decoded);
+                        emit_instruction(&decoded, pc, first);
+                }
+                printf("                return %uu;\n", end);
+                printf("        default:\n");
+                printf("                FALL_BACK(pc);\n");
+                printf("        }\n");
+                printf("}\n\n");
+        }
+
+        printf("static uint32_t (*const chunks[])(Um_state, uint32_t) = {\n");
+        for ( first = 0; first < length; first += CHUNK ) {
+                printf("        chunk_%u,\n", first / CHUNK);
+        }
+        printf("        NULL\n};\n\n");
+
+        printf("int main(void)\n{\n");
+        printf("        Um_state um;\n");
+        printf("        uint32_t pc = 0;\n");
+        printf("        uint32_t i;\n\n");
+
+        printf("        /* the state is aligned to a cache line */\n");
+        printf("        if ( posix_memalign((void **)&um, 64, "
+               "sizeof(*um)) != 0 ) {\n");
+        printf("                fprintf(stderr, \"Error: out of memory\\n\");"
+               "\n");
+        printf("                return EXIT_FAILURE;\n");
+        printf("        }\n");
+        printf("        Memory mem = initialize_memory();\n\n");
+
+        printf("        um->mem = mem;\n");
+        printf("        um->io = io_new(NULL);\n");
+        printf("        um->jit = NULL;\n");
+        printf("        um->trace = NULL;\n");
+        printf("        load_value(0, LENGTH, um);\n");
+        printf("        map_segment(1, 0, um);\n");
+        printf("        for ( i = 0; i < LENGTH; i++ ) {\n");
+        printf("                *segment_word(mem, 0, i) = words[i];\n");
+        printf("        }\n");
+        printf("        for ( i = 0; i < NUM_REGISTERS; i++ ) {\n");
+        printf("                um->registers[i] = 0;\n");
+        printf("        }\n");
+        printf("        predecode_program(mem);\n\n");
+
+        printf("        while ( pc < LENGTH ) {\n");
+        printf("                pc = chunks[pc / CHUNK](um, pc);\n");
+        printf("        }\n\n");
+
+        printf("        Um_status status = UM_HALTED;\n\n");
+        printf("        if ( pc != HALTED ) {\n");
+        printf("                if ( pc != FALLBACK ) {\n");
+        printf("                        um->program_counter = pc;\n");
+        printf("                }\n");
+        printf("                uint64_t budget = UM_NO_LIMIT;\n\n");
+        printf("                status = interpret(um, &budget);\n");
+        printf("        }\n\n");
+
+        printf("        io_free(&um->io);\n");
+        printf("        free_memory(mem);\n");
+        printf("        free(um);\n");
+        printf("        return status == UM_HALTED ? EXIT_SUCCESS "
+               ": EXIT_FAILURE;\n");
+        printf("}\n");
+}
+
+/* Writes the case for one instruction of the chunk starting at first */
+static void emit_instruction(instruction decoded, uint32_t pc, 
+                             uint32_t first)
+{
+        unsigned a = decoded->ra;
+        unsigned b = decoded->rb;
+        unsigned c = decoded->rc;
+
+        printf("        case %u: CHECK(%u)\n                ", pc, pc);
+
+        switch ( decoded->opcode ) {
+                case CONDMOVE:
+                        printf("if ( r[%u] != 0 ) r[%u] = r[%u];\n",
+                               c, a, b);
+                        break;
+                case SEGLOAD:
+                        printf("r[%u] = *segment_word(mem, r[%u], r[%u]);\n",
+                               a, b, c);
+                        break;
+                case SEGSTORE:
+                        /* keep the predecoded program in step as well */
+                        printf("if ( r[%u] != 0 ) "
+                               "*writable_segment_word(mem, r[%u], r[%u]) = "
+                               "r[%u];\n"
+                               "                else { segmented_store("
+                               "%u, %u, %u, um); "
+                               "overwritten[r[%u]] = "
+                               "r[%u] != words[r[%u]]; }\n",
+                               a, a, b, c, a, b, c, b, c, b);
+                        break;
+                case ADD:
+                        printf("r[%u] = r[%u] + r[%u];\n", a, b, c);
+                        break;
+                case MULTI:
+                        printf("r[%u] = r[%u] * r[%u];\n", a, b, c);
+                        break;
+                case DIVIDE:
+                        /* the interpreter reports division by zero */
+                        printf("if ( r[%u] == 0 ) FALL_BACK(%u);\n"
+                               "                r[%u] = r[%u] / r[%u];\n",
+                               c, pc, a, b, c);
+                        break;
+                case NAND:
+                        printf("r[%u] = ~(r[%u] & r[%u]);\n", a, b, c);
+                        break;
+                case HALT:
+                        printf("return HALTED;\n");
+                        break;
+                case MAPSEG:
+                        printf("map_segment(%u, %u, um);\n", b, c);
+                        break;
+                case UNMAPSEG:
+                        printf("unmap_segment(%u, um);\n", c);
+                        break;
+                case OUT:
+                        printf("output(%u, um);\n", c);
+                        break;
+                case IN:
+                        /* the interpreter reads it again if it waits */
+                        printf("um->program_counter = %u; "
+                               "if ( !input(%u, um) ) FALL_BACK(%u);\n",
+                               pc, c, pc);
+                        break;
+                case LOADPROG:
+                        printf("if ( r[%u] != 0 ) { load_program(%u, %u, "
+                               "um); return FALLBACK; }\n"
+                               "                pc = r[%u]; "
+                               "if ( pc >= LENGTH ) FALL_BACK(pc);\n"
+                               "                if ( pc - %uu < CHUNK ) "
+                               "goto dispatch;\n"
+                               "                return pc;\n",
+                               b, b, c, c, first);
+                        break;
+                case LOADVAL:
+                        printf("r[%u] = %uu;\n", a, decoded->value);
+                        break;
+                default:
+                        /* the interpreter reports the illegal word */
+                        printf("FALL_BACK(%u);\n", pc);
+        }
+}
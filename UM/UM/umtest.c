@@ -0,0 +1,1586 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                               umtest                              *
+ *                                                                   *
+ *                File: umtest.c                                     *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Runs small UM programs through libum and     *
+ *                      checks what they write. It is linked with    *
+ *                      the same objects as um, so building it with  *
+ *                      UMFLAGS="-DUM_THREADED" or "-DUM_JIT" tests  *
+ *                      that dispatch loop. A plain UM written here  *
+ *                      checks that each stops after exactly the     *
+ *                      steps it is given, and a field-by-field      *
+ *                      decoder checks decode and decode_segment     *
+ *                      on random words. Also checks the memory      *
+ *                      stats and limits. Usage:                     *
+ *                                                                   *
+ *                        umtest                                     *
+ *                                                                   *
+ *                      Prints each check that fails and exits with  *
+ *                      status 1 if any did                          *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "assert.h"
+#include "libum.h"
+#include "decoder.h"
+#include "bitpack.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   S T R U C T U R E   D E C L A R A T I O N   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/* UM words, laid out as the assembler lays them out */
+#define OP(opcode, a, b, c) ((uint32_t)(opcode) << 28 | (a) << 6 | \
+                             (b) << 3 | (c))
+#define LV(a, value)        ((uint32_t)LOADVAL << 28 | (a) << 25 | (value))
+
+#define LENGTH(words)       (sizeof(words) / sizeof((words)[0]))
+
+#define MAX_OUTPUT 256
+
+/* read_input skips this byte, saying that no input is ready yet */
+#define STALL '~'
+
+/* the input a test UM reads and the output it writes */
+typedef struct Exchange {
+        const char *input;
+        size_t input_used;
+
+        char output[MAX_OUTPUT + 1];
+        size_t output_used;
+} *Exchange;
+
+/* the slices test programs are run in: all at once, then a step at a
+ * time, then in short uneven slices */
+static const uint64_t SLICES[] = { UM_NO_LIMIT, 1, 7 };
+
+/* 
+ * A UM kept as simple as it can be, to check the real one against. It 
+ * takes a step per word and reads only the end of input. Test programs 
+ * keep at most one segment mapped besides segment 0, so that the IDs it
+ * hands out match
+ */
+#define MAX_SEGMENTS 4
+
+/* how many random words decode is checked on */
+#define DECODE_WORDS (1 << 20)
+
+typedef struct Reference {
+        uint32_t registers[8];
+        uint32_t program_counter;
+        uint32_t *segments[MAX_SEGMENTS];
+        uint32_t lengths[MAX_SEGMENTS];
+        int halted;
+} *Reference;
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N S   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static void      test_copy_on_write (void);
+static void      test_steps         (void);
+static void      test_fused_stores  (void);
+static void      test_waiting_input (void);
+static void      test_decode        (void);
+static void      test_memory        (void);
+static void      test_unmapped      (void);
+static void      test_fault_report  (void);
+static void      expect_fault       (const char *name, const uint32_t *words,
+                                     uint32_t length, Um_fault expected);
+static void      test_image_cache   (void);
+static void      test_snapshot      (void);
+static void      test_input_log     (void);
+static void      test_profile       (void);
+static Um        replaying          (const uint32_t *words, uint32_t length,
+                                     const char *log_path, 
+                                     Exchange exchange);
+static void      expect_cached      (const char *name, const char *path,
+                                     const uint32_t *words, 
+                                     uint32_t length, const char *expected);
+static void      write_word         (const char *name, const char *path,
+                                     long offset, uint32_t value);
+static void      flip_byte          (const char *name, const char *path,
+                                     long offset);
+static void      test_memory_limit  (const char *name, uint64_t max_words,
+                                     uint64_t max_segments, 
+                                     const char *expected);
+static void      test_out_of_memory (void);
+
+static void      expect_output (const char *name, const uint32_t *words,
+                                uint32_t length, const char *input,
+                                const char *expected);
+static Um_status run_program   (const uint32_t *words, uint32_t length,
+                                int shared, uint64_t slice,
+                                Exchange exchange);
+static void      fail          (const char *name, const char *format, ...);
+
+static Reference reference_new  (const uint32_t *words, uint32_t length);
+static void      reference_step (Reference ref);
+static void      reference_free (Reference ref);
+static void      reference_decode (uint32_t codeword, 
+                                   instruction decoded);
+static void      expect_state   (const char *name, Um vm, Reference ref,
+                                 uint64_t steps);
+
+static int       read_input    (void *closure);
+static void      write_output  (void *closure, const uint8_t *bytes,
+                                size_t count);
+static uint32_t  next_random   (uint32_t *state);
+
+
+static int failures = 0;
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+int main(void)
+{
+        test_copy_on_write();
+        test_steps();
+        test_fused_stores();
+        test_waiting_input();
+        test_decode();
+        test_memory();
+        test_unmapped();
+        test_fault_report();
+        test_image_cache();
+        test_snapshot();
+        test_input_log();
+        test_profile();
+
+        if ( failures > 0 ) {
+                fprintf(stderr, "%d checks failed\n", failures);
+                return EXIT_FAILURE;
+        }
+        printf("all checks passed\n");
+        return EXIT_SUCCESS;
+}
+
+
+/*   T E S T S   */
+
+/*
+ * Segment 0 shares its words with the segment LOADPROG loaded it from
+ * until either is written. Writes to one must not show in the other, in
+ * either order, and unmapping the source must leave segment 0 its words
+ */
+static void test_copy_on_write(void)
+{
+        enum { DATA = 43 };
+        static const uint32_t program[] = {
+                /*  0 */ LV(7, 1),
+                /*  1 */ LV(4, 0),
+                /*  2 */ LV(6, DATA + 1),
+                /*  3 */ OP(MAPSEG, 0, 1, 6),
+
+                /* copy segment 0 into segment r1, word r2 at a time */
+                /*  4 */ LV(2, 0),
+                /*  5 */ OP(SEGLOAD, 3, 4, 2),
+                /*  6 */ OP(SEGSTORE, 1, 2, 3),
+                /*  7 */ OP(ADD, 2, 2, 7),
+                /*  8 */ OP(NAND, 3, 6, 6),
+                /*  9 */ OP(ADD, 3, 3, 7),
+                /* 10 */ OP(ADD, 3, 3, 2),
+                /* 11 */ LV(0, 15),
+                /* 12 */ LV(5, 5),
+                /* 13 */ OP(CONDMOVE, 0, 5, 3),
+                /* 14 */ OP(LOADPROG, 0, 4, 0),
+
+                /* the source is written first */
+                /* 15 */ LV(0, 17),
+                /* 16 */ OP(LOADPROG, 0, 1, 0),
+                /* 17 */ LV(2, DATA),
+                /* 18 */ LV(3, 'X'),
+                /* 19 */ OP(SEGSTORE, 1, 2, 3),
+                /* 20 */ OP(SEGLOAD, 3, 4, 2),
+                /* 21 */ OP(OUT, 0, 0, 3),
+                /* 22 */ OP(SEGLOAD, 3, 1, 2),
+                /* 23 */ OP(OUT, 0, 0, 3),
+
+                /* segment 0 is written first */
+                /* 24 */ LV(0, 26),
+                /* 25 */ OP(LOADPROG, 0, 1, 0),
+                /* 26 */ LV(3, 'Y'),
+                /* 27 */ OP(SEGSTORE, 4, 2, 3),
+                /* 28 */ OP(SEGLOAD, 3, 1, 2),
+                /* 29 */ OP(OUT, 0, 0, 3),
+                /* 30 */ OP(SEGLOAD, 3, 4, 2),
+                /* 31 */ OP(OUT, 0, 0, 3),
+
+                /* the source is unmapped and its ID mapped again */
+                /* 32 */ LV(0, 34),
+                /* 33 */ OP(LOADPROG, 0, 1, 0),
+                /* 34 */ OP(UNMAPSEG, 0, 0, 1),
+                /* 35 */ OP(MAPSEG, 0, 1, 6),
+                /* 36 */ OP(SEGLOAD, 3, 4, 2),
+                /* 37 */ OP(OUT, 0, 0, 3),
+                /* 38 */ OP(SEGLOAD, 3, 1, 2),
+                /* 39 */ LV(5, '0'),
+                /* 40 */ OP(ADD, 3, 3, 5),
+                /* 41 */ OP(OUT, 0, 0, 3),
+                /* 42 */ OP(HALT, 0, 0, 0),
+
+                /* DATA */ 'A'
+        };
+
+        expect_output("copy on write", program, LENGTH(program), "",
+                      "AXXYX0");
+}
+
+
+/*
+ * A UM given n steps must stop where the reference stops after n steps,
+ * whether it takes them in one go or one at a time. The program covers 
+ * the sequences that are fused, so that some of them have to be split 
+ * where the steps run out, and overwrites a word the JIT has translated
+ */
+static void test_steps(void)
+{
+        enum { LOOP = 5, BUMP = 26, END = 31, PATCH = 33 };
+        static const uint32_t program[] = {
+                /*  0 */ LV(1, 40),
+                /*  1 */ LV(4, 0),
+                /*  2 */ LV(6, 3),
+                /*  3 */ OP(MAPSEG, 0, 2, 6),
+                /*  4 */ OP(IN, 0, 0, 3),
+
+                /* LOOP: through segment r2 and back */
+                /*  5 */ LV(5, 1),
+                /*  6 */ OP(SEGSTORE, 2, 5, 1),
+                /*  7 */ LV(5, 1),
+                /*  8 */ OP(SEGLOAD, 3, 2, 5),
+
+                /* 
+                 * r1 = r1 - r7 as the assembler's sub writes it, which
+                 * leaves r7 one less than it was
+                 */
+                /*  9 */ LV(7, 1),
+                /* 10 */ OP(NAND, 7, 7, 7),
+                /* 11 */ LV(5, 1),
+                /* 12 */ OP(ADD, 7, 5, 7),
+                /* 13 */ OP(ADD, 1, 1, 7),
+                /* 14 */ OP(NAND, 7, 7, 7),
+
+                /* r0 = r3 & r6, then r3 = r0, as and and mov write them */
+                /* 15 */ OP(NAND, 3, 3, 6),
+                /* 16 */ OP(NAND, 0, 3, 3),
+                /* 17 */ LV(3, 0),
+                /* 18 */ OP(ADD, 3, 3, 0),
+
+                /* 19 */ LV(5, 'a'),
+                /* 20 */ OP(ADD, 5, 5, 3),
+                /* 21 */ OP(OUT, 0, 0, 5),
+
+                /* copy the word at PATCH over BUMP */
+                /* 22 */ LV(5, PATCH),
+                /* 23 */ OP(SEGLOAD, 3, 4, 5),
+                /* 24 */ LV(5, BUMP),
+                /* 25 */ OP(SEGSTORE, 4, 5, 3),
+                /* 26 */ OP(ADD, 6, 6, 4),
+
+                /* 27 */ LV(0, END),
+                /* 28 */ LV(5, LOOP),
+                /* 29 */ OP(CONDMOVE, 0, 5, 1),
+                /* 30 */ OP(LOADPROG, 0, 4, 0),
+
+                /* END */
+                /* 31 */ OP(UNMAPSEG, 0, 0, 2),
+                /* 32 */ OP(HALT, 0, 0, 0),
+
+                /* PATCH */ OP(ADD, 6, 6, 1)
+        };
+        uint32_t length = LENGTH(program);
+        uint64_t total, n;
+
+        /* the steps the program takes to halt */
+        Reference ref = reference_new(program, length);
+        for ( total = 0; !ref->halted; total++ ) {
+                reference_step(ref);
+        }
+        reference_free(ref);
+
+        struct Exchange exchange;
+        Um_io io = { read_input, write_output, &exchange };
+        uint8_t *image = malloc(length * 4);
+        uint32_t i;
+
+        assert(image);
+        for ( i = 0; i < length; i++ ) {
+                image[4 * i]     = program[i] >> 24;
+                image[4 * i + 1] = program[i] >> 16;
+                image[4 * i + 2] = program[i] >> 8;
+                image[4 * i + 3] = program[i];
+        }
+        exchange.input = "";
+        exchange.input_used = 0;
+        exchange.output_used = 0;
+
+        /* n steps in one go */
+        ref = reference_new(program, length);
+        for ( n = 0; n <= total + 1; n++ ) {
+                Um vm = um_new(&io);
+
+                assert(vm);
+                um_load_buffer(vm, image, length * 4);
+
+                Um_status status = um_run(vm, n);
+                Um_status expected = n < total ? UM_BUDGET_EXHAUSTED 
+                                               : UM_HALTED;
+                if ( status != expected ) {
+                        fail("steps", "%llu steps ended with status %d",
+                             (unsigned long long)n, status);
+                }
+                expect_state("steps", vm, ref, n);
+
+                if ( !ref->halted ) {
+                        reference_step(ref);
+                }
+                um_free(&vm);
+        }
+        reference_free(ref);
+
+        /* the same steps one at a time */
+        Um vm = um_new(&io);
+        assert(vm);
+        um_load_buffer(vm, image, length * 4);
+
+        ref = reference_new(program, length);
+        for ( n = 1; n <= total; n++ ) {
+                um_run(vm, 1);
+                reference_step(ref);
+                expect_state("one step at a time", vm, ref, n);
+        }
+        if ( um_run(vm, 1) != UM_HALTED ) {
+                fail("one step at a time", "did not halt");
+        }
+        reference_free(ref);
+
+        um_free(&vm);
+        free(image);
+}
+
+
+/*
+ * Stores over the last word of a fused sub and of a fused and, after both
+ * have run once, must split them so that the next pass runs the new words
+ */
+static void test_fused_stores(void)
+{
+        enum { LOOP = 3, AGAIN = 20, END = 31, PATCH = 32 };
+        static const uint32_t program[] = {
+                /*  0 */ LV(1, 'z'),
+                /*  1 */ LV(2, 0),
+                /*  2 */ LV(6, 0x5f),
+
+                /* LOOP: r3 = r1 - r7 as the assembler's sub writes it */
+                /*  3 */ LV(7, 1),
+                /*  4 */ OP(NAND, 7, 7, 7),
+                /*  5 */ LV(5, 1),
+                /*  6 */ OP(ADD, 7, 5, 7),
+                /*  7 */ OP(ADD, 3, 1, 7),
+                /*  8 */ OP(NAND, 7, 7, 7),
+                /*  9 */ OP(OUT, 0, 0, 3),
+
+                /* r4 = r1 & r6 through r5 */
+                /* 10 */ OP(NAND, 5, 1, 6),
+                /* 11 */ OP(NAND, 4, 5, 5),
+                /* 12 */ OP(OUT, 0, 0, 4),
+
+                /* 13 */ LV(5, '0'),
+                /* 14 */ OP(ADD, 5, 5, 7),
+                /* 15 */ OP(OUT, 0, 0, 5),
+
+                /* 16 */ LV(5, END),
+                /* 17 */ LV(3, AGAIN),
+                /* 18 */ OP(CONDMOVE, 3, 5, 2),
+                /* 19 */ OP(LOADPROG, 0, 0, 3),
+
+                /* AGAIN: copy the words at PATCH over words 8 and 11 */
+                /* 20 */ LV(5, PATCH),
+                /* 21 */ OP(SEGLOAD, 3, 0, 5),
+                /* 22 */ LV(5, 8),
+                /* 23 */ OP(SEGSTORE, 0, 5, 3),
+                /* 24 */ LV(5, PATCH + 1),
+                /* 25 */ OP(SEGLOAD, 3, 0, 5),
+                /* 26 */ LV(5, 11),
+                /* 27 */ OP(SEGSTORE, 0, 5, 3),
+                /* 28 */ LV(2, 1),
+                /* 29 */ LV(3, LOOP),
+                /* 30 */ OP(LOADPROG, 0, 0, 3),
+
+                /* END */
+                /* 31 */ OP(HALT, 0, 0, 0),
+
+                /* PATCH */ LV(7, 5), LV(4, 'A')
+        };
+
+        expect_output("fused stores", program, LENGTH(program), "", 
+                      "yZ0yA5");
+}
+
+
+/*
+ * An input that has to wait is not a step, and the UM waits on it. The 
+ * steps before it in the same straight run are
+ */
+static void test_waiting_input(void)
+{
+        static const uint32_t program[] = {
+                /* 0 */ LV(1, 1),
+                /* 1 */ LV(2, 2),
+                /* 2 */ OP(IN, 0, 0, 3),
+                /* 3 */ OP(OUT, 0, 0, 3),
+                /* 4 */ OP(HALT, 0, 0, 0)
+        };
+        uint32_t length = LENGTH(program);
+        uint8_t image[sizeof(program)];
+        struct Exchange exchange = { "~A", 0, "", 0 };
+        Um_io io = { read_input, write_output, &exchange };
+        uint32_t registers[8];
+        uint32_t i;
+
+        for ( i = 0; i < length; i++ ) {
+                image[4 * i]     = program[i] >> 24;
+                image[4 * i + 1] = program[i] >> 16;
+                image[4 * i + 2] = program[i] >> 8;
+                image[4 * i + 3] = program[i];
+        }
+
+        Um vm = um_new(&io);
+        assert(vm);
+        um_load_buffer(vm, image, sizeof(image));
+
+        if ( um_run(vm, UM_NO_LIMIT) != UM_WAITING_FOR_INPUT ||
+             um_registers(vm, registers) != 2 || um_steps(vm) != 2 ) {
+                fail("waiting input", "did not wait on the input after "
+                     "2 steps");
+        }
+        if ( um_run(vm, UM_NO_LIMIT) != UM_HALTED || um_steps(vm) != 5 ||
+             strcmp(exchange.output, "A") != 0 ) {
+                fail("waiting input", "did not halt after 5 steps");
+        }
+
+        um_free(&vm);
+}
+
+
+/*
+ * decode must give the fields the reference extracts one by one, for any
+ * word, and decode_segment must give what decode does for every word of 
+ * a segment of any length and alignment, writing nothing past its end. 
+ * Built with -mavx2 this checks the vector decoder
+ */
+static void test_decode(void)
+{
+        enum { MAX_LENGTH = 40, MAX_OFFSET = 8 };
+        uint32_t words[MAX_LENGTH + MAX_OFFSET];
+        struct instruction decoded[MAX_LENGTH + 1], expected;
+        uint32_t state = 1;
+        uint32_t i, length, offset;
+
+        for ( i = 0; i < DECODE_WORDS; i++ ) {
+                uint32_t word = next_random(&state);
+
+                decode(word, &decoded[0]);
+                reference_decode(word, &expected);
+                if ( memcmp(&decoded[0], &expected, sizeof(expected)) ) {
+                        fail("decode", "0x%08x decoded to %u %u %u %u %u, "
+                             "not %u %u %u %u %u", word, decoded[0].opcode,
+                             decoded[0].ra, decoded[0].rb, decoded[0].rc, 
+                             decoded[0].value, expected.opcode, expected.ra,
+                             expected.rb, expected.rc, expected.value);
+                }
+        }
+
+        for ( i = 0; i < LENGTH(words); i++ ) {
+                words[i] = next_random(&state);
+        }
+        for ( offset = 0; offset < MAX_OFFSET; offset++ ) {
+                for ( length = 0; length < MAX_LENGTH; length++ ) {
+                        memset(decoded, 0x5a, sizeof(decoded));
+                        decode_segment(&words[offset], length, decoded);
+
+                        for ( i = 0; i < length; i++ ) {
+                                decode(words[offset + i], &expected);
+                                if ( memcmp(&decoded[i], &expected, 
+                                            sizeof(expected)) ) {
+                                        fail("decode_segment", "word %u of "
+                                             "%u at offset %u differs", i,
+                                             length, offset);
+                                }
+                        }
+                        if ( decoded[length].opcode != 0x5a ) {
+                                fail("decode_segment", "%u words at offset"
+                                     " %u wrote past the end", length, 
+                                     offset);
+                        }
+                }
+        }
+}
+
+
+/*
+ * The stats of a UM that maps two segments and unmaps one count what the
+ * program sees, and a MAPSEG past either limit faults with over_limit 
+ * set, having mapped nothing
+ */
+static void test_memory(void)
+{
+        static const uint32_t program[] = {
+                /* 0 */ LV(2, 10),
+                /* 1 */ OP(MAPSEG, 0, 3, 2),
+                /* 2 */ LV(2, 100),
+                /* 3 */ OP(MAPSEG, 0, 4, 2),
+                /* 4 */ OP(UNMAPSEG, 0, 0, 3),
+                /* 5 */ OP(HALT, 0, 0, 0)
+        };
+        uint32_t length = LENGTH(program);
+        uint8_t image[sizeof(program)];
+        struct Exchange exchange = { "", 0, "", 0 };
+        Um_io io = { read_input, write_output, &exchange };
+        Um_memory_stats stats;
+        uint32_t i, sizes = 0;
+
+        for ( i = 0; i < length; i++ ) {
+                image[4 * i]     = program[i] >> 24;
+                image[4 * i + 1] = program[i] >> 16;
+                image[4 * i + 2] = program[i] >> 8;
+                image[4 * i + 3] = program[i];
+        }
+
+        Um vm = um_new(&io);
+        assert(vm);
+        if ( um_memory_stats(vm, &stats) != -1 ) {
+                fail("memory", "has stats before a program is loaded");
+        }
+        um_load_buffer(vm, image, sizeof(image));
+
+        if ( um_run(vm, UM_NO_LIMIT) != UM_HALTED || 
+             um_memory_stats(vm, &stats) != 0 ) {
+                fail("memory", "did not halt with stats");
+        } else {
+                for ( i = 0; i < UM_SIZE_BUCKETS; i++ ) {
+                        sizes += stats.segment_sizes[i];
+                }
+                if ( stats.mapped_words != 106 || 
+                     stats.peak_mapped_words != 116 ||
+                     stats.live_segments != 2 || 
+                     stats.peak_live_segments != 3 || 
+                     stats.segment_sizes[3] != 1 || 
+                     stats.segment_sizes[7] != 1 || sizes != 2 ||
+                     stats.over_limit ) {
+                        fail("memory", "counted %llu words (peak %llu) in "
+                             "%u segments (peak %u)", 
+                             (unsigned long long)stats.mapped_words,
+                             (unsigned long long)stats.peak_mapped_words,
+                             stats.live_segments, stats.peak_live_segments);
+                }
+        }
+        um_free(&vm);
+
+        /* segment 0 is 6 words and counts as a segment */
+        test_memory_limit("segment limit", UM_NO_LIMIT, 4, "mmm");
+        test_memory_limit("word limit", 6 + 25, UM_NO_LIMIT, "mm");
+        test_memory_limit("exact word limit", 6 + 30, UM_NO_LIMIT, "mmm");
+        test_out_of_memory();
+}
+
+/*
+ * Runs a program that maps segments of 10 words, writing an m after
+ * each, under the limits given. The limits are set before the program
+ * is loaded, since they carry over to it
+ */
+static void test_memory_limit(const char *name, uint64_t max_words,
+                              uint64_t max_segments, const char *expected)
+{
+        static const uint32_t program[] = {
+                /* 0 */ LV(2, 10),
+                /* 1 */ LV(6, 'm'),
+                /* 2 */ OP(MAPSEG, 0, 3, 2),
+                /* 3 */ OP(OUT, 0, 0, 6),
+                /* 4 */ LV(4, 2),
+                /* 5 */ OP(LOADPROG, 0, 0, 4)
+        };
+        uint32_t length = LENGTH(program);
+        uint8_t image[sizeof(program)];
+        struct Exchange exchange = { "", 0, "", 0 };
+        Um_io io = { read_input, write_output, &exchange };
+        Um_memory_stats stats;
+        uint64_t mapped = 6 + 10 * strlen(expected);
+        uint32_t i;
+
+        for ( i = 0; i < length; i++ ) {
+                image[4 * i]     = program[i] >> 24;
+                image[4 * i + 1] = program[i] >> 16;
+                image[4 * i + 2] = program[i] >> 8;
+                image[4 * i + 3] = program[i];
+        }
+
+        Um vm = um_new(&io);
+        assert(vm);
+        um_limit_memory(vm, max_words, max_segments);
+        um_load_buffer(vm, image, sizeof(image));
+
+        if ( um_run(vm, UM_NO_LIMIT) != UM_FAULT ) {
+                fail(name, "did not fault");
+        }
+        if ( strcmp(exchange.output, expected) != 0 ) {
+                fail(name, "wrote \"%s\", not \"%s\"", exchange.output,
+                     expected);
+        }
+        if ( um_memory_stats(vm, &stats) != 0 || !stats.over_limit ||
+             stats.mapped_words != mapped || 
+             stats.live_segments != 1 + strlen(expected) ) {
+                fail(name, "faulted with %llu words in %u segments, not "
+                     "over the limit", 
+                     (unsigned long long)stats.mapped_words,
+                     stats.live_segments);
+        }
+        um_free(&vm);
+}
+
+
+/*
+ * A MAPSEG the process has no room for faults like one over a limit.
+ * The address space is cut to 4GB while the UM asks for 16GB
+ */
+static void test_out_of_memory(void)
+{
+        static const uint32_t program[] = {
+                /* 0 */ OP(NAND, 2, 0, 0),
+                /* 1 */ LV(6, 'm'),
+                /* 2 */ OP(MAPSEG, 0, 3, 2),
+                /* 3 */ OP(OUT, 0, 0, 6),
+                /* 4 */ OP(HALT, 0, 0, 0)
+        };
+        uint32_t length = LENGTH(program);
+        uint8_t image[sizeof(program)];
+        struct Exchange exchange = { "", 0, "", 0 };
+        Um_io io = { read_input, write_output, &exchange };
+        Um_memory_stats stats;
+        struct rlimit original, limited;
+        Um_status status;
+        uint32_t i;
+
+        for ( i = 0; i < length; i++ ) {
+                image[4 * i]     = program[i] >> 24;
+                image[4 * i + 1] = program[i] >> 16;
+                image[4 * i + 2] = program[i] >> 8;
+                image[4 * i + 3] = program[i];
+        }
+
+        Um vm = um_new(&io);
+        assert(vm);
+        um_load_buffer(vm, image, sizeof(image));
+
+        getrlimit(RLIMIT_AS, &original);
+        limited = original;
+        limited.rlim_cur = (rlim_t)4 << 30;
+        if ( setrlimit(RLIMIT_AS, &limited) != 0 ) {
+                fail("out of memory", "cannot limit the address space");
+                um_free(&vm);
+                return;
+        }
+        status = um_run(vm, UM_NO_LIMIT);
+        setrlimit(RLIMIT_AS, &original);
+
+        if ( status != UM_FAULT || exchange.output[0] != '\0' ) {
+                fail("out of memory", "did not fault");
+        }
+        if ( um_memory_stats(vm, &stats) != 0 || !stats.over_limit ||
+             stats.mapped_words != length || stats.live_segments != 1 ) {
+                fail("out of memory", "faulted with %llu words in %u "
+                     "segments, not over the limit", 
+                     (unsigned long long)stats.mapped_words,
+                     stats.live_segments);
+        }
+        um_free(&vm);
+}
+
+/*
+ * Loads from an unmapped ID and from the largest ID must fault, which 
+ * -DUM_GUARDED builds leave to the page at address 0 to catch
+ */
+static void test_unmapped(void)
+{
+        static const uint32_t unmapped[] = {
+                /* 0 */ LV(1, 5),
+                /* 1 */ OP(SEGLOAD, 2, 1, 0),
+                /* 2 */ OP(HALT, 0, 0, 0)
+        };
+        static const uint32_t largest[] = {
+                /* 0 */ OP(NAND, 1, 0, 0),
+                /* 1 */ OP(SEGLOAD, 2, 1, 0),
+                /* 2 */ OP(HALT, 0, 0, 0)
+        };
+        struct Exchange exchange = { "", 0, "", 0 };
+
+        if ( run_program(unmapped, LENGTH(unmapped), 0, UM_NO_LIMIT, 
+                         &exchange) != UM_FAULT ) {
+                fail("unmapped", "a load from ID 5 did not fault");
+        }
+        if ( run_program(largest, LENGTH(largest), 0, UM_NO_LIMIT, 
+                         &exchange) != UM_FAULT ) {
+                fail("unmapped", "a load from ID 0xffffffff did not fault");
+        }
+}
+
+
+/*
+ * A fault is reported on the word that failed, with the segment and 
+ * offset it reached for, in every build and however the steps are given.
+ * The load fused with the LOADVAL in front of it is reported on its own
+ * word, and a failed LOADPROG leaves the UM on itself
+ */
+static void test_fault_report(void)
+{
+        static const uint32_t unmapped[] = {
+                LV(1, 5), OP(NAND, 6, 6, 6), OP(SEGLOAD, 2, 1, 0), 
+                OP(HALT, 0, 0, 0)
+        };
+        static const uint32_t fused[] = {
+                LV(3, 7), OP(SEGLOAD, 2, 0, 3), OP(HALT, 0, 0, 0)
+        };
+        static const uint32_t largest[] = {
+                OP(NAND, 1, 0, 0), OP(SEGSTORE, 1, 0, 0), OP(HALT, 0, 0, 0)
+        };
+        static const uint32_t divide[] = {
+                OP(DIVIDE, 1, 1, 0), OP(HALT, 0, 0, 0)
+        };
+        static const uint32_t unmap[] = {
+                LV(1, 3), OP(NAND, 6, 6, 6), OP(UNMAPSEG, 0, 0, 1), 
+                OP(HALT, 0, 0, 0)
+        };
+        static const uint32_t jump[] = {
+                LV(1, 1), OP(MAPSEG, 0, 2, 1), LV(3, 5), 
+                OP(LOADPROG, 0, 2, 3), OP(HALT, 0, 0, 0)
+        };
+        static const uint32_t past_end[] = {
+                LV(1, 1)
+        };
+        
+        expect_fault("unmapped load", unmapped, LENGTH(unmapped), 
+                     (Um_fault){ 2, SEGLOAD, 1, 5, 0 });
+        expect_fault("fused load", fused, LENGTH(fused),
+                     (Um_fault){ 1, SEGLOAD, 1, 0, 7 });
+        expect_fault("store to the largest ID", largest, LENGTH(largest),
+                     (Um_fault){ 1, SEGSTORE, 1, 0xffffffff, 0 });
+        expect_fault("divide by zero", divide, LENGTH(divide),
+                     (Um_fault){ 0, DIVIDE, 0, 0, 0 });
+        expect_fault("unmap", unmap, LENGTH(unmap),
+                     (Um_fault){ 2, UNMAPSEG, 1, 3, 0 });
+        expect_fault("jump past a segment", jump, LENGTH(jump),
+                     (Um_fault){ 3, LOADPROG, 1, 1, 5 });
+        expect_fault("past the end", past_end, LENGTH(past_end),
+                     (Um_fault){ 1, UM_PAST_END, 0, 0, 0 });
+}
+
+
+/*
+ * A cache file is only used for the program it was written for, and one
+ * whose words or instructions have been changed since is decoded again 
+ * rather than run. Instructions that did not come from the decoder are
+ * refused
+ */
+static void test_image_cache(void)
+{
+        /* each writes a letter and then the word at 6 of segment 0 */
+        static const uint32_t program[] = {
+                LV(1, 'o'), OP(OUT, 0, 0, 1), LV(3, 6), OP(SEGLOAD, 2, 0, 3),
+                OP(OUT, 0, 0, 2), OP(HALT, 0, 0, 0), 'k'
+        };
+        static const uint32_t other[] = {
+                LV(1, 'n'), OP(OUT, 0, 0, 1), LV(3, 6), OP(SEGLOAD, 2, 0, 3),
+                OP(OUT, 0, 0, 2), OP(HALT, 0, 0, 0), 'o'
+        };
+        uint32_t length = LENGTH(program);
+        char path[] = "/tmp/umtest.XXXXXX";
+        int file = mkstemp(path);
+
+        assert(file != -1);
+        close(file);
+        unlink(path);
+
+        /* the words start after the header and the segment's own */
+        long words = 64 + 8;
+        long instructions = -(long)(length + 1) * 8;
+
+        expect_cached("cache", path, program, length, "ok");
+        if ( access(path, R_OK) != 0 ) {
+                fail("cache", "no cache file was written");
+        }
+        expect_cached("cached", path, program, length, "ok");
+        expect_cached("cache of another program", path, other, length, 
+                      "no");
+
+        expect_cached("cache", path, program, length, "ok");
+        flip_byte("changed word", path, words + 4 * 6);
+        expect_cached("changed word", path, program, length, "ok");
+
+        flip_byte("changed instruction", path, instructions);
+        expect_cached("changed instruction", path, program, length, "ok");
+        unlink(path);
+
+        /* everything the decoder writes is valid, and nothing else */
+        static const struct instruction invalid[] = {
+                { NUM_OPCODES, 0, 0, 0, 0 },
+                { ADD, UNUSED_REGISTER, 0, 0, 0 },
+                { ADD, 0, 8, 0, 0 },
+                { HALT, 3, UNUSED_REGISTER, UNUSED_REGISTER, 0 },
+                { LOADVAL, 0, UNUSED_REGISTER, UNUSED_REGISTER, 1 << 25 },
+                { MOVE, 0, 9, UNUSED_REGISTER, 0 },
+                { AND, 0, 1, 2, 8 },
+                { SUB, 0, 1, 2, 64 },
+                { LOADVAL_SEGLOAD, 0, 1, 2, 8u << FUSED_SHIFT }
+        };
+        struct instruction decoded[MAX_FUSED + 1];
+        uint32_t state = 7, i, j;
+
+        for ( i = 0; i < LENGTH(invalid); i++ ) {
+                if ( valid_instruction(&invalid[i]) ) {
+                        fail("valid_instruction", "took invalid "
+                             "instruction %u", i);
+                }
+        }
+        for ( i = 0; i < DECODE_WORDS / 8; i++ ) {
+                uint32_t words[MAX_FUSED];
+
+                for ( j = 0; j < MAX_FUSED; j++ ) {
+                        words[j] = next_random(&state) % 2 
+                                 ? next_random(&state)
+                                 : program[j] ^ (next_random(&state) & 0x1ff);
+                }
+                decode_program(words, MAX_FUSED, decoded);
+                for ( j = 0; j < MAX_FUSED; j++ ) {
+                        if ( !valid_instruction(&decoded[j]) ) {
+                                fail("valid_instruction", "refused the "
+                                     "decoding of 0x%08x", words[j]);
+                        }
+                }
+        }
+}
+
+
+/*
+ * A snapshot carries on where it was taken, but one whose program counter
+ * is past the end of segment 0 or that lists a free ID twice is refused
+ */
+static void test_snapshot(void)
+{
+        static const uint32_t program[] = {
+                /* 0 */ LV(1, 1),
+                /* 1 */ OP(MAPSEG, 0, 2, 1),
+                /* 2 */ OP(MAPSEG, 0, 3, 1),
+                /* 3 */ OP(MAPSEG, 0, 4, 1),
+                /* 4 */ OP(UNMAPSEG, 0, 0, 2),
+                /* 5 */ OP(UNMAPSEG, 0, 0, 3),
+                /* 6 */ LV(1, 'k'),
+                /* 7 */ OP(OUT, 0, 0, 1),
+                /* 8 */ OP(HALT, 0, 0, 0)
+        };
+        struct Exchange exchange = { "", 0, "", 0 };
+        Um_io io = { read_input, write_output, &exchange };
+        uint8_t image[LENGTH(program) * 4];
+        char path[] = "/tmp/umtest.XXXXXX";
+        int file = mkstemp(path);
+        uint32_t i;
+
+        assert(file != -1);
+        close(file);
+        for ( i = 0; i < LENGTH(program); i++ ) {
+                image[4 * i]     = program[i] >> 24;
+                image[4 * i + 1] = program[i] >> 16;
+                image[4 * i + 2] = program[i] >> 8;
+                image[4 * i + 3] = program[i];
+        }
+
+        /* stopped with IDs 1 and 2 free, so both are saved */
+        Um vm = um_new(&io);
+        assert(vm);
+
+        um_load_buffer(vm, image, sizeof(image));
+        if ( um_run(vm, 6) != UM_BUDGET_EXHAUSTED || 
+             um_checkpoint(vm, path) != 0 ) {
+                fail("snapshot", "could not be taken");
+        }
+        if ( um_restore(vm, path) != 0 || 
+             um_run(vm, UM_NO_LIMIT) != UM_HALTED || 
+             strcmp(exchange.output, "k") != 0 ) {
+                fail("snapshot", "did not carry on where it was taken");
+        }
+
+        /* the program counter follows the magic, version and registers, 
+         * and the free IDs follow the header and the memory's own */
+        write_word("snapshot", path, 8 + 8 * 4, LENGTH(program));
+        if ( um_restore(vm, path) != -1 ) {
+                fail("snapshot", "restored a program counter past the "
+                     "end of segment 0");
+        }
+        write_word("snapshot", path, 8 + 8 * 4, 6);
+        write_word("snapshot", path, 64 + 16 + 4, 1);
+        if ( um_restore(vm, path) != -1 ) {
+                fail("snapshot", "restored ID 1 freed twice");
+        }
+
+        um_free(&vm);
+        unlink(path);
+}
+
+
+/*
+ * A replayed input log gives the UM its bytes after the steps it read 
+ * them after when it was recorded, however the steps are given and in a
+ * UM restored from a snapshot. A program that gets to the same input 
+ * instruction after other steps fails
+ */
+static void test_input_log(void)
+{
+        /* echoes its input, 7 steps a byte */
+        static const uint32_t program[] = {
+                /*  0 */ LV(4, 3),
+                /*  1 */ LV(5, 8),
+                /*  2 */ LV(6, 10),
+                /*  3 */ OP(IN, 0, 0, 3),
+                /*  4 */ OP(NAND, 2, 3, 3),
+                /*  5 */ OP(ADD, 1, 6, 0),
+                /*  6 */ OP(CONDMOVE, 1, 5, 2),
+                /*  7 */ OP(LOADPROG, 0, 0, 1),
+                /*  8 */ OP(OUT, 0, 0, 3),
+                /*  9 */ OP(LOADPROG, 0, 0, 4),
+                /* 10 */ OP(HALT, 0, 0, 0)
+        };
+        /* the same, but set up in 7 steps rather than 3 */
+        static const uint32_t later[] = {
+                /*  0 */ LV(7, 11),
+                /*  1 */ OP(LOADPROG, 0, 0, 7),
+                /*  2 */ OP(HALT, 0, 0, 0),
+                /*  3 */ OP(IN, 0, 0, 3),
+                /*  4 */ OP(NAND, 2, 3, 3),
+                /*  5 */ OP(ADD, 1, 6, 0),
+                /*  6 */ OP(CONDMOVE, 1, 5, 2),
+                /*  7 */ OP(LOADPROG, 0, 0, 1),
+                /*  8 */ OP(OUT, 0, 0, 3),
+                /*  9 */ OP(LOADPROG, 0, 0, 4),
+                /* 10 */ OP(HALT, 0, 0, 0),
+                /* 11 */ LV(4, 3),
+                /* 12 */ LV(5, 8),
+                /* 13 */ LV(6, 10),
+                /* 14 */ LV(7, 3),
+                /* 15 */ OP(LOADPROG, 0, 0, 7)
+        };
+        struct Exchange exchange = { "abc", 0, "", 0 };
+        Um_io io = { read_input, write_output, &exchange };
+        char log_path[] = "/tmp/umtest.XXXXXX";
+        char snapshot_path[] = "/tmp/umtest.XXXXXX";
+        uint8_t image[sizeof(program)];
+        unsigned i;
+
+        int file = mkstemp(log_path);
+        assert(file != -1);
+        close(file);
+        file = mkstemp(snapshot_path);
+        assert(file != -1);
+        close(file);
+
+        for ( i = 0; i < LENGTH(program); i++ ) {
+                image[4 * i]     = program[i] >> 24;
+                image[4 * i + 1] = program[i] >> 16;
+                image[4 * i + 2] = program[i] >> 8;
+                image[4 * i + 3] = program[i];
+        }
+
+        Um vm = um_new(&io);
+        assert(vm);
+
+        um_load_buffer(vm, image, sizeof(image));
+        if ( um_record_input(vm, log_path) != 0 ||
+             um_run(vm, UM_NO_LIMIT) != UM_HALTED || 
+             um_record_input(vm, NULL) != 0 || 
+             strcmp(exchange.output, "abc") != 0 ) {
+                fail("input log", "could not be recorded");
+        }
+        um_free(&vm);
+
+        for ( i = 0; i < LENGTH(SLICES); i++ ) {
+                Um_status status;
+
+                vm = replaying(program, LENGTH(program), log_path, 
+                               &exchange);
+                while ( (status = um_run(vm, SLICES[i])) == 
+                        UM_BUDGET_EXHAUSTED ) {
+                }
+                if ( status != UM_HALTED || 
+                     strcmp(exchange.output, "abc") != 0 ) {
+                        fail("input log", "replayed in slices of %llu "
+                             "ended with status %d and \"%s\"", 
+                             (unsigned long long)SLICES[i], status,
+                             exchange.output);
+                }
+                um_free(&vm);
+        }
+
+        /* on the first byte, which is not written */
+        vm = replaying(later, LENGTH(later), log_path, &exchange);
+        if ( um_run(vm, UM_NO_LIMIT) != UM_FAULT || 
+             exchange.output[0] != '\0' ) {
+                fail("input log", "replayed after other steps");
+        }
+        um_free(&vm);
+
+        /* 'a' is read after 3 steps and 'b' after 10 */
+        vm = replaying(program, LENGTH(program), log_path, &exchange);
+        if ( um_run(vm, 12) != UM_BUDGET_EXHAUSTED || 
+             um_checkpoint(vm, snapshot_path) != 0 ) {
+                fail("input log", "could not be checkpointed");
+        }
+        um_free(&vm);
+
+        vm = replaying(program, LENGTH(program), log_path, &exchange);
+        if ( um_restore(vm, snapshot_path) != 0 || um_steps(vm) != 12 ||
+             um_run(vm, UM_NO_LIMIT) != UM_HALTED ||
+             strcmp(exchange.output, "bc") != 0 ) {
+                fail("input log", "replayed into a restored UM wrote "
+                     "\"%s\", not \"bc\"", exchange.output);
+        }
+        um_free(&vm);
+
+        unlink(log_path);
+        unlink(snapshot_path);
+}
+
+
+/*
+ * A UM that faults while it is profiled still has its fault reported and
+ * a complete report written, and a report that cannot be written leaves
+ * the UM as it was
+ */
+static void test_profile(void)
+{
+        static const uint32_t program[] = {
+                LV(1, 5), OP(NAND, 6, 6, 6), OP(SEGLOAD, 2, 1, 0), 
+                OP(HALT, 0, 0, 0)
+        };
+        struct Exchange exchange = { "", 0, "", 0 };
+        Um_io io = { read_input, write_output, &exchange };
+        uint8_t image[LENGTH(program) * 4];
+        char path[] = "/tmp/umtest.XXXXXX";
+        char report[4096];
+        int file = mkstemp(path);
+        Um_fault fault;
+        uint32_t i;
+
+        assert(file != -1);
+        for ( i = 0; i < LENGTH(program); i++ ) {
+                image[4 * i]     = program[i] >> 24;
+                image[4 * i + 1] = program[i] >> 16;
+                image[4 * i + 2] = program[i] >> 8;
+                image[4 * i + 3] = program[i];
+        }
+
+        Um vm = um_new(&io);
+        assert(vm);
+
+        um_load_buffer(vm, image, sizeof(image));
+        if ( um_profile(vm, "/nonexistent/umtest.json") != UM_FAULT ||
+             um_fault_info(vm, &fault) != -1 ) {
+                fail("profile", "ran without a report to write");
+        }
+        if ( um_profile(vm, path) != UM_FAULT || 
+             um_fault_info(vm, &fault) != 0 || 
+             fault.program_counter != 2 || fault.opcode != SEGLOAD ||
+             um_steps(vm) != 2 ) {
+                fail("profile", "did not report the fault");
+        }
+
+        ssize_t size = read(file, report, sizeof(report) - 1);
+
+        report[size < 0 ? 0 : size] = '\0';
+        if ( strstr(report, "\"faulted\": true,") == NULL || 
+             strstr(report, "\"instructions\": 3,") == NULL ||
+             size < 3 || strcmp(report + size - 3, "\n}\n") != 0 ) {
+                fail("profile", "wrote an unfinished report:\n%s", report);
+        }
+
+        um_free(&vm);
+        close(file);
+        unlink(path);
+}
+
+
+/*   R U N N I N G   P R O G R A M S   */
+
+/*
+ * Runs a program in every slice, from a segment 0 of its own and from a
+ * shared one, and checks that it halts having written expected
+ */
+static void expect_output(const char *name, const uint32_t *words,
+                          uint32_t length, const char *input,
+                          const char *expected)
+{
+        unsigned i;
+        int shared;
+
+        for ( shared = 0; shared < 2; shared++ ) {
+                for ( i = 0; i < LENGTH(SLICES); i++ ) {
+                        struct Exchange exchange;
+                        exchange.input = input;
+
+                        Um_status status = run_program(words, length,
+                                                       shared, SLICES[i],
+                                                       &exchange);
+                        if ( status != UM_HALTED ) {
+                                fail(name, "ended with status %d", status);
+                        } else if ( strcmp(exchange.output,
+                                           expected) != 0 ) {
+                                fail(name, "wrote \"%s\", not \"%s\"",
+                                     exchange.output, expected);
+                        }
+                }
+        }
+}
+
+/*
+ * Runs a program slice steps at a time until it stops, and returns why
+ * it stopped
+ */
+static Um_status run_program(const uint32_t *words, uint32_t length,
+                             int shared, uint64_t slice, Exchange exchange)
+{
+        Um_io io = { read_input, write_output, exchange };
+        uint8_t *image = malloc(length * 4 + 1);
+        Um_status status;
+        uint32_t i;
+
+        assert(image);
+        for ( i = 0; i < length; i++ ) {
+                image[4 * i]     = words[i] >> 24;
+                image[4 * i + 1] = words[i] >> 16;
+                image[4 * i + 2] = words[i] >> 8;
+                image[4 * i + 3] = words[i];
+        }
+
+        exchange->input_used = 0;
+        exchange->output_used = 0;
+        exchange->output[0] = '\0';
+
+        Um vm = um_new(&io);
+
+        assert(vm);
+        if ( shared ) {
+                um_load_shared(vm, image, length * 4);
+        } else {
+                um_load_buffer(vm, image, length * 4);
+        }
+
+        while ( (status = um_run(vm, slice)) == UM_BUDGET_EXHAUSTED ) {
+        }
+
+        um_free(&vm);
+        free(image);
+        return status;
+}
+
+/*
+ * Runs a program in every slice, from a segment 0 of its own and from a 
+ * shared one, and checks that it faults where expected says
+ */
+static void expect_fault(const char *name, const uint32_t *words, 
+                         uint32_t length, Um_fault expected)
+{
+        struct Exchange exchange = { "", 0, "", 0 };
+        Um_io io = { read_input, write_output, &exchange };
+        uint8_t *image = malloc(length * 4);
+        unsigned i;
+        int shared;
+
+        assert(image);
+        for ( i = 0; i < length; i++ ) {
+                image[4 * i]     = words[i] >> 24;
+                image[4 * i + 1] = words[i] >> 16;
+                image[4 * i + 2] = words[i] >> 8;
+                image[4 * i + 3] = words[i];
+        }
+
+        for ( shared = 0; shared < 2; shared++ ) {
+                for ( i = 0; i < LENGTH(SLICES); i++ ) {
+                        Um vm = um_new(&io);
+                        Um_status status;
+                        Um_fault report;
+
+                        assert(vm);
+                        if ( shared ) {
+                                um_load_shared(vm, image, length * 4);
+                        } else {
+                                um_load_buffer(vm, image, length * 4);
+                        }
+                        if ( um_fault_info(vm, &report) != -1 ) {
+                                fail(name, "reported a fault before "
+                                     "running");
+                        }
+                        while ( (status = um_run(vm, SLICES[i])) == 
+                                UM_BUDGET_EXHAUSTED ) {
+                        }
+
+                        if ( status != UM_FAULT ||
+                             um_fault_info(vm, &report) != 0 ) {
+                                fail(name, "did not fault");
+                        } else if ( report.program_counter != 
+                                    expected.program_counter ||
+                                    report.opcode != expected.opcode ||
+                                    report.access != expected.access ||
+                                    report.segment != expected.segment ||
+                                    report.offset != expected.offset ) {
+                                fail(name, "reported opcode %u at %u on "
+                                     "%u:%u (%d), not opcode %u at %u on "
+                                     "%u:%u (%d)", report.opcode, 
+                                     report.program_counter, report.segment,
+                                     report.offset, report.access,
+                                     expected.opcode, 
+                                     expected.program_counter,
+                                     expected.segment, expected.offset,
+                                     expected.access);
+                        }
+                        um_free(&vm);
+                }
+        }
+        free(image);
+}
+
+/* 
+ * Returns a UM with a program loaded that takes its input from the log at
+ * log_path, and writes its output to exchange
+ */
+static Um replaying(const uint32_t *words, uint32_t length, 
+                    const char *log_path, Exchange exchange)
+{
+        Um_io io = { read_input, write_output, exchange };
+        uint8_t *image = malloc(length * 4);
+        uint32_t i;
+
+        assert(image);
+        for ( i = 0; i < length; i++ ) {
+                image[4 * i]     = words[i] >> 24;
+                image[4 * i + 1] = words[i] >> 16;
+                image[4 * i + 2] = words[i] >> 8;
+                image[4 * i + 3] = words[i];
+        }
+
+        exchange->input = "";
+        exchange->input_used = 0;
+        exchange->output_used = 0;
+        exchange->output[0] = '\0';
+
+        Um vm = um_new(&io);
+        assert(vm);
+
+        um_load_buffer(vm, image, length * 4);
+        if ( um_replay_input(vm, log_path) != 0 ) {
+                fail("input log", "cannot replay %s", log_path);
+        }
+        free(image);
+        return vm;
+}
+
+/* Loads a program through the cache file at path and checks its output */
+static void expect_cached(const char *name, const char *path,
+                          const uint32_t *words, uint32_t length, 
+                          const char *expected)
+{
+        struct Exchange exchange = { "", 0, "", 0 };
+        Um_io io = { read_input, write_output, &exchange };
+        uint8_t *image = malloc(length * 4);
+        uint32_t i;
+
+        assert(image);
+        for ( i = 0; i < length; i++ ) {
+                image[4 * i]     = words[i] >> 24;
+                image[4 * i + 1] = words[i] >> 16;
+                image[4 * i + 2] = words[i] >> 8;
+                image[4 * i + 3] = words[i];
+        }
+
+        Um vm = um_new(&io);
+        assert(vm);
+
+        if ( um_load_cached(vm, image, length * 4, path) != 0 ||
+             um_run(vm, UM_NO_LIMIT) != UM_HALTED ) {
+                fail(name, "did not halt");
+        } else if ( strcmp(exchange.output, expected) != 0 ) {
+                fail(name, "wrote \"%s\", not \"%s\"", exchange.output,
+                     expected);
+        }
+
+        um_free(&vm);
+        free(image);
+}
+
+/* Overwrites the word at offset in a file with value, in host order */
+static void write_word(const char *name, const char *path, long offset,
+                       uint32_t value)
+{
+        FILE *file = fopen(path, "r+b");
+
+        if ( file == NULL || fseek(file, offset, SEEK_SET) != 0 ||
+             fwrite(&value, sizeof(value), 1, file) != 1 ) {
+                fail(name, "cannot change %s", path);
+        }
+        if ( file != NULL ) {
+                fclose(file);
+        }
+}
+
+/* Flips a byte of a file, counting a negative offset from its end */
+static void flip_byte(const char *name, const char *path, long offset)
+{
+        FILE *file = fopen(path, "r+b");
+        int byte;
+
+        if ( file == NULL || 
+             fseek(file, offset, offset < 0 ? SEEK_END : SEEK_SET) != 0 ||
+             (byte = fgetc(file)) == EOF ||
+             fseek(file, -1, SEEK_CUR) != 0 || 
+             fputc(byte ^ 0x5a, file) == EOF ) {
+                fail(name, "cannot change %s", path);
+        }
+        if ( file != NULL ) {
+                fclose(file);
+        }
+}
+
+static void fail(const char *name, const char *format, ...)
+{
+        va_list arguments;
+
+        fprintf(stderr, "%s: ", name);
+        va_start(arguments, format);
+        vfprintf(stderr, format, arguments);
+        va_end(arguments);
+        fprintf(stderr, "\n");
+
+        failures++;
+}
+
+/* 
+ * Checks that a UM is in the state of the reference after it has run 
+ * steps steps, or as many as it took to halt
+ */
+static void expect_state(const char *name, Um vm, Reference ref, 
+                         uint64_t steps)
+{
+        uint32_t registers[8];
+        uint32_t program_counter = um_registers(vm, registers);
+        unsigned i;
+
+        if ( program_counter != ref->program_counter ) {
+                fail(name, "after %llu steps the program counter is %u, "
+                     "not %u", (unsigned long long)steps, program_counter,
+                     ref->program_counter);
+        }
+        for ( i = 0; i < 8; i++ ) {
+                if ( registers[i] != ref->registers[i] ) {
+                        fail(name, "after %llu steps r%u is %u, not %u",
+                             (unsigned long long)steps, i, registers[i],
+                             ref->registers[i]);
+                }
+        }
+        if ( !ref->halted && um_steps(vm) != steps ) {
+                fail(name, "took %llu steps, not %llu", 
+                     (unsigned long long)um_steps(vm),
+                     (unsigned long long)steps);
+        }
+}
+
+
+/*   T H E   R E F E R E N C E   U M   */
+
+static Reference reference_new(const uint32_t *words, uint32_t length)
+{
+        Reference ref = calloc(1, sizeof(*ref));
+
+        assert(ref);
+        ref->segments[0] = malloc(length * sizeof(uint32_t) + 1);
+        assert(ref->segments[0]);
+        memcpy(ref->segments[0], words, length * sizeof(uint32_t));
+        ref->lengths[0] = length;
+        return ref;
+}
+
+/* Runs one word, which must be a legal instruction */
+static void reference_step(Reference ref)
+{
+        uint32_t *r = ref->registers;
+        uint32_t word = ref->segments[0][ref->program_counter];
+        unsigned a = (word >> 6) & 7, b = (word >> 3) & 7, c = word & 7;
+        uint32_t id;
+
+        assert(ref->program_counter < ref->lengths[0] && !ref->halted);
+        ref->program_counter++;
+
+        switch ( word >> 28 ) {
+                case CONDMOVE: 
+                        if ( r[c] != 0 ) {
+                                r[a] = r[b];
+                        }
+                        break;
+                case SEGLOAD:  
+                        assert(r[c] < ref->lengths[r[b]]);
+                        r[a] = ref->segments[r[b]][r[c]];
+                        break;
+                case SEGSTORE: 
+                        assert(r[b] < ref->lengths[r[a]]);
+                        ref->segments[r[a]][r[b]] = r[c];
+                        break;
+                case ADD:      r[a] = r[b] + r[c];     break;
+                case MULTI:    r[a] = r[b] * r[c];     break;
+                case DIVIDE:   r[a] = r[b] / r[c];     break;
+                case NAND:     r[a] = ~(r[b] & r[c]);  break;
+                case HALT:
+                        ref->program_counter--;
+                        ref->halted = 1;
+                        break;
+                case MAPSEG:
+                        for ( id = 1; ref->segments[id] != NULL; id++ ) {
+                                assert(id < MAX_SEGMENTS - 1);
+                        }
+                        ref->segments[id] = calloc(r[c] + 1, 
+                                                   sizeof(uint32_t));
+                        assert(ref->segments[id]);
+                        ref->lengths[id] = r[c];
+                        r[b] = id;
+                        break;
+                case UNMAPSEG:
+                        free(ref->segments[r[c]]);
+                        ref->segments[r[c]] = NULL;
+                        ref->lengths[r[c]] = 0;
+                        break;
+                case OUT:
+                        break;
+                case IN:
+                        r[c] = ~(uint32_t)0;
+                        break;
+                case LOADPROG:
+                        if ( r[b] != 0 ) {
+                                uint32_t length = ref->lengths[r[b]];
+
+                                free(ref->segments[0]);
+                                ref->segments[0] = malloc(length * 
+                                                          sizeof(uint32_t)
+                                                          + 1);
+                                assert(ref->segments[0]);
+                                memcpy(ref->segments[0], 
+                                       ref->segments[r[b]],
+                                       length * sizeof(uint32_t));
+                                ref->lengths[0] = length;
+                        }
+                        ref->program_counter = r[c];
+                        break;
+                case LOADVAL:
+                        r[(word >> 25) & 7] = word & 0x1ffffff;
+                        break;
+                default:
+                        assert(0);
+        }
+}
+
+static void reference_free(Reference ref)
+{
+        unsigned i;
+
+        for ( i = 0; i < MAX_SEGMENTS; i++ ) {
+                free(ref->segments[i]);
+        }
+        free(ref);
+}
+
+/* 
+ * Decodes a word a field at a time, as the decoder did before it used a 
+ * table. Fields the opcode does not use are UNUSED_REGISTER, and value 
+ * is 0 except for LOADVAL
+ */
+static void reference_decode(uint32_t codeword, instruction decoded)
+{
+        unsigned opcode = Bitpack_getu(codeword, 4, 28);
+        unsigned used = 0;
+
+        switch ( opcode ) {
+                case CONDMOVE: case SEGLOAD: case SEGSTORE: case ADD:
+                case MULTI: case DIVIDE: case NAND:
+                        used = 3;
+                        break;
+                case MAPSEG: case LOADPROG:
+                        used = 2;
+                        break;
+                case UNMAPSEG: case OUT: case IN:
+                        used = 1;
+                        break;
+        }
+
+        decoded->opcode = opcode;
+        decoded->ra = used >= 3 ? Bitpack_getu(codeword, 3, 6) 
+                                : UNUSED_REGISTER;
+        decoded->rb = used >= 2 ? Bitpack_getu(codeword, 3, 3) 
+                                : UNUSED_REGISTER;
+        decoded->rc = used >= 1 ? Bitpack_getu(codeword, 3, 0) 
+                                : UNUSED_REGISTER;
+        decoded->value = 0;
+
+        if ( opcode == LOADVAL ) {
+                decoded->ra = Bitpack_getu(codeword, 3, 25);
+                decoded->value = Bitpack_getu(codeword, 25, 0);
+        }
+}
+
+
+/*   H E L P E R S   */
+
+static int read_input(void *closure)
+{
+        Exchange exchange = closure;
+
+        if ( exchange->input[exchange->input_used] == STALL ) {
+                exchange->input_used++;
+                return UM_NO_INPUT;
+        }
+        if ( exchange->input[exchange->input_used] == '\0' ) {
+                return UM_EOF;
+        }
+        return (uint8_t)exchange->input[exchange->input_used++];
+}
+
+/* Keeps the first MAX_OUTPUT bytes written as a string */
+static void write_output(void *closure, const uint8_t *bytes, size_t count)
+{
+        Exchange exchange = closure;
+        size_t i;
+
+        for ( i = 0; i < count && exchange->output_used < MAX_OUTPUT; i++ ) {
+                exchange->output[exchange->output_used++] = bytes[i];
+        }
+        exchange->output[exchange->output_used] = '\0';
+}
+
+/* A 32-bit xorshift, so that every run checks the same words */
+static uint32_t next_random(uint32_t *state)
+{
+        *state ^= *state << 13;
+        *state ^= *state >> 17;
+        *state ^= *state << 5;
+        return *state;
+}
@@ -0,0 +1,150 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                                   *
+ *                              umtrace                              *
+ *                                                                   *
+ *                File: umtrace.c                                    *
+ *             Authors: Andrew Burgos and Lucy Qin                   *
+ *       Date Modified: November 13, 2014                            *
+ *             Purpose: Prints a trace written by um --trace or      *
+ *                      um_trace_dump. Usage:                        *
+ *                                                                   *
+ *                        umtrace trace                              *
+ *                                                                   *
+ *                      Prints what the UM was doing, its registers, *
+ *                      and then its traced instructions oldest      *
+ *                      first, each numbered by how many were traced *
+ *                      before it                                    *
+ *                                                                   *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "assert.h"
+#include "trace.h"
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ *   F U N C T I O N   D E C L A R A T I O N S   *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static void print_header (const Trace_header *header);
+static void print_record (const Trace_record *record, uint64_t event);
+static void print_byte   (uint32_t byte);
+
+
+static const char *const REASONS[] = {
+        "was running", "was paused", "halted", "faulted"
+};
+
+static const size_t RECORDS_AT_ONCE = 4096;
+
+
+/* * * * * * * * * * * * * * * * * *
+ *   I M P L E M E N T A T I O N   *
+ * * * * * * * * * * * * * * * * * */
+
+int main(int argc, char *argv[])
+{
+        if (argc != 2) {
+                fprintf(stderr, "Usage: umtrace trace\n");
+                exit(EXIT_FAILURE);
+        }
+
+        FILE *file = fopen(argv[1], "rb");
+        Trace_header header;
+
+        if (file == NULL || fread(&header, sizeof(header), 1, file) != 1 ||
+            header.magic != TRACE_MAGIC || header.version != TRACE_VERSION ||
+            header.reason > TRACE_FAULTED) {
+                fprintf(stderr, "Error: %s is not a UM trace\n", argv[1]);
+                exit(EXIT_FAILURE);
+        }
+
+        print_header(&header);
+
+        Trace_record *records = malloc(RECORDS_AT_ONCE * sizeof(*records));
+        uint64_t event = header.events - header.count;
+        uint64_t left = header.count;
+
+        assert(records);
+
+        while (left > 0) {
+                size_t wanted = left < RECORDS_AT_ONCE ? left
+                                                       : RECORDS_AT_ONCE;
+                size_t got = fread(records, sizeof(*records), wanted, file);
+                size_t i;
+
+                for (i = 0; i < got; i++) {
+                        print_record(&records[i], event++);
+                }
+                if (got < wanted) {
+                        fprintf(stderr, "Error: %s is cut short\n",
+                                argv[1]);
+                        exit(EXIT_FAILURE);
+                }
+                left -= got;
+        }
+
+        free(records);
+        fclose(file);
+        return EXIT_SUCCESS;
+}
+
+static void print_header(const Trace_header *header)
+{
+        int i;
+
+        printf("UM %s at program counter %u\n", REASONS[header->reason],
+               header->program_counter);
+        printf("registers");
+        for (i = 0; i < NUM_REGISTERS; i++) {
+                printf(" %u", header->registers[i]);
+        }
+        printf("\n%llu instructions traced, the last %llu follow\n\n",
+               (unsigned long long)header->events,
+               (unsigned long long)header->count);
+        printf("%12s %10s  %s\n", "event", "pc", "instruction");
+}
+
+static void print_record(const Trace_record *record, uint64_t event)
+{
+        printf("%12llu %10u  ", (unsigned long long)event,
+               record->program_counter);
+
+        switch (record->opcode) {
+                case LOADPROG:
+                        printf("loadprog  segment %u, to %u\n", record->a,
+                               record->b);
+                        break;
+                case MAPSEG:
+                        printf("mapseg    segment %u, %u words\n",
+                               record->a, record->b);
+                        break;
+                case UNMAPSEG:
+                        printf("unmapseg  segment %u\n", record->a);
+                        break;
+                case OUT:
+                        printf("output    ");
+                        print_byte(record->a);
+                        break;
+                case IN:
+                        printf("input     ");
+                        print_byte(record->a);
+                        break;
+                default:
+                        printf("opcode %u\n", record->opcode);
+        }
+}
+
+static void print_byte(uint32_t byte)
+{
+        if (byte == ~(uint32_t)0) {
+                printf("end of input\n");
+        } else if (byte >= 32 && byte < 127) {
+                printf("%u '%c'\n", byte, (char)byte);
+        } else {
+                printf("%u\n", byte);
+        }
+}